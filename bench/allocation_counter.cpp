@@ -0,0 +1,52 @@
+// Replaces operator new and delete to count allocations. All the replaceable
+// forms are replaced, so every allocation is counted and freed consistently.
+// Benchmarks are single threaded.
+
+#include "allocation_counter.h"
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+std::size_t num_allocations = 0;
+
+void* allocate(std::size_t size, std::size_t alignment) noexcept
+{
+	++num_allocations;
+	if (size == 0) size = 1;
+	if (alignment <= alignof(std::max_align_t)) return std::malloc(size);
+	return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+void* allocate_or_throw(std::size_t size, std::size_t alignment)
+{
+	if (void* res = allocate(size, alignment)) return res;
+	throw std::bad_alloc();
+}
+
+constexpr std::size_t default_alignment = alignof(std::max_align_t);
+}
+
+std::size_t allocation_count() noexcept { return num_allocations; }
+
+void* operator new(std::size_t size) { return allocate_or_throw(size, default_alignment); }
+void* operator new[](std::size_t size) { return allocate_or_throw(size, default_alignment); }
+void* operator new(std::size_t size, std::align_val_t al) { return allocate_or_throw(size, std::size_t(al)); }
+void* operator new[](std::size_t size, std::align_val_t al) { return allocate_or_throw(size, std::size_t(al)); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return allocate(size, default_alignment); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return allocate(size, default_alignment); }
+void* operator new(std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return allocate(size, std::size_t(al)); }
+void* operator new[](std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return allocate(size, std::size_t(al)); }
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { std::free(ptr); }
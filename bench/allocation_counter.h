@@ -0,0 +1,12 @@
+#ifndef BENCH_ALLOCATION_COUNTER_H_
+#define BENCH_ALLOCATION_COUNTER_H_
+
+#include <cstddef>
+
+// The number of heap allocations made by the program so far. Linking
+// allocation_counter.cpp replaces operator new and delete to count them.
+// They live in their own translation unit, so the compiler can't inline
+// them into their callers and pair a std::free with an unrelated operator new
+std::size_t allocation_count() noexcept;
+
+#endif /* BENCH_ALLOCATION_COUNTER_H_ */
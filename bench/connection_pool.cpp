@@ -0,0 +1,213 @@
+// Checkout latency of connection_pool under contention. No server is
+// needed: connections use an in-memory stream that completes the handshake.
+//
+// Usage: bench_connection_pool [iterations per thread]
+
+#include "psql/connection_pool.h"
+#include <boost/asio/io_context.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace psql;
+using bench_clock = std::chrono::steady_clock;
+
+namespace
+{
+
+// Serves an MD5 authentication request, AuthenticationOk and ReadyForQuery.
+// Writes are discarded
+class handshake_stream
+{
+	boost::asio::io_context::executor_type ex_;
+	std::string input_;
+	std::size_t pos_ {0};
+
+	static void append_message(std::string& to, char type, std::string_view body)
+	{
+		std::uint32_t size = std::uint32_t(body.size() + 4);
+		to.push_back(type);
+		for (int i = 3; i >= 0; --i) to.push_back(char((size >> (8 * i)) & 0xff));
+		to.append(body);
+	}
+public:
+	using executor_type = boost::asio::io_context::executor_type;
+
+	explicit handshake_stream(const executor_type& ex): ex_(ex)
+	{
+		append_message(input_, 'R', std::string_view("\0\0\0\5salt", 8));
+		append_message(input_, 'R', std::string_view("\0\0\0\0", 4));
+		append_message(input_, 'Z', "I");
+	}
+
+	executor_type get_executor() const noexcept { return ex_; }
+
+	template <typename MutableBufferSequence>
+	std::size_t read_some(const MutableBufferSequence& buffers, error_code& err)
+	{
+		std::size_t n = boost::asio::buffer_copy(buffers, boost::asio::buffer(input_.data() + pos_, input_.size() - pos_));
+		if (n == 0) err = boost::asio::error::eof;
+		pos_ += n;
+		return n;
+	}
+
+	template <typename MutableBufferSequence>
+	std::size_t read_some(const MutableBufferSequence& buffers)
+	{
+		error_code err;
+		std::size_t n = read_some(buffers, err);
+		if (err) throw boost::system::system_error(err);
+		return n;
+	}
+
+	template <typename ConstBufferSequence>
+	std::size_t write_some(const ConstBufferSequence& buffers) { return boost::asio::buffer_size(buffers); }
+
+	template <typename ConstBufferSequence>
+	std::size_t write_some(const ConstBufferSequence& buffers, error_code&) { return boost::asio::buffer_size(buffers); }
+
+	template <typename MutableBufferSequence, typename Handler>
+	void async_read_some(const MutableBufferSequence& buffers, Handler&& handler)
+	{
+		error_code err;
+		std::size_t n = read_some(buffers, err);
+		boost::asio::post(ex_, [handler = std::forward<Handler>(handler), err, n]() mutable { handler(err, n); });
+	}
+
+	template <typename ConstBufferSequence, typename Handler>
+	void async_write_some(const ConstBufferSequence& buffers, Handler&& handler)
+	{
+		std::size_t n = write_some(buffers);
+		boost::asio::post(ex_, [handler = std::forward<Handler>(handler), n]() mutable { handler(error_code(), n); });
+	}
+};
+
+using pool_type = connection_pool<handshake_stream>;
+
+pool_type make_pool(boost::asio::io_context& ctx, std::size_t size)
+{
+	pool_params params;
+	params.min_size = size;
+	params.max_size = size;
+	params.checkout_timeout = std::chrono::minutes(1);
+	return pool_type(ctx.get_executor(), params, connection_params{"user", "password", "db"},
+		[](handshake_stream&, std::function<void(error_code)> handler) { handler(error_code()); });
+}
+
+void wait_until_full(boost::asio::io_context& ctx, pool_type& pool, std::size_t size)
+{
+	while (pool.idle_size() < size)
+	{
+		ctx.run_for(std::chrono::milliseconds(1));
+		ctx.restart();
+	}
+}
+
+void report(const char* name, std::size_t threads, std::vector<double>& latencies, double elapsed_s)
+{
+	std::sort(latencies.begin(), latencies.end());
+	auto pct = [&](double p) { return latencies[std::size_t(p * double(latencies.size() - 1))]; };
+	std::printf("%-28s %7zu %12.0f %9.0f %9.0f %9.0f\n", name, threads,
+		double(latencies.size()) / elapsed_s, pct(0.5), pct(0.99), latencies.back());
+}
+
+// Every thread has a connection available, so all checkouts take the fast path
+void bench_try_checkout(std::size_t threads, std::size_t iterations)
+{
+	boost::asio::io_context ctx;
+	pool_type pool = make_pool(ctx, threads);
+	wait_until_full(ctx, pool, threads);
+
+	std::vector<std::vector<double>> per_thread (threads, std::vector<double>(iterations));
+	auto start = bench_clock::now();
+	std::vector<std::thread> workers;
+	for (std::size_t t = 0; t < threads; ++t)
+	{
+		workers.emplace_back([&, t] {
+			for (std::size_t i = 0; i < iterations; ++i)
+			{
+				auto before = bench_clock::now();
+				auto conn = pool.try_checkout();
+				per_thread[t][i] = std::chrono::duration<double, std::nano>(bench_clock::now() - before).count();
+				if (!conn.valid()) std::abort();
+			}
+		});
+	}
+	for (auto& w: workers) w.join();
+	double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+	std::vector<double> all;
+	for (auto& v: per_thread) all.insert(all.end(), v.begin(), v.end());
+	report("try_checkout", threads, all, elapsed);
+}
+
+// Twice as many workers as connections, running on an io_context with
+// the given number of threads, so half the checkouts wait in the queue
+void bench_async_checkout(std::size_t threads, std::size_t iterations)
+{
+	constexpr std::size_t workers_per_thread = 4;
+	std::size_t num_workers = threads * workers_per_thread;
+	std::size_t pool_size = num_workers / 2;
+
+	boost::asio::io_context ctx {int(threads)};
+	pool_type pool = make_pool(ctx, pool_size);
+	wait_until_full(ctx, pool, pool_size);
+
+	std::vector<std::vector<double>> per_worker (num_workers);
+	std::function<void(std::size_t, std::size_t)> run_worker = [&](std::size_t w, std::size_t remaining) {
+		if (remaining == 0) return;
+		auto before = bench_clock::now();
+		pool.async_checkout([&, w, remaining, before](error_code err, pooled_connection<handshake_stream> conn) {
+			per_worker[w].push_back(std::chrono::duration<double, std::nano>(bench_clock::now() - before).count());
+			if (err) std::abort();
+			conn.reset();
+			run_worker(w, remaining - 1);
+		});
+	};
+
+	auto start = bench_clock::now();
+	for (std::size_t w = 0; w < num_workers; ++w)
+	{
+		per_worker[w].reserve(iterations);
+		run_worker(w, iterations);
+	}
+	std::vector<std::thread> runners;
+	for (std::size_t t = 0; t < threads; ++t) runners.emplace_back([&ctx] { ctx.run_for(std::chrono::minutes(5)); });
+	while (true)
+	{
+		std::size_t done = 0;
+		for (std::size_t w = 0; w < num_workers; ++w) done += per_worker[w].size() == iterations;
+		if (done == num_workers) break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+	pool.close();
+	ctx.stop();
+	for (auto& t: runners) t.join();
+
+	std::vector<double> all;
+	for (auto& v: per_worker) all.insert(all.end(), v.begin(), v.end());
+	report("async_checkout (waiting)", threads, all, elapsed);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	std::size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 200000;
+	std::size_t max_threads = std::max(2u, std::thread::hardware_concurrency());
+
+	std::printf("%-28s %7s %12s %9s %9s %9s\n", "benchmark", "threads", "checkouts/s", "p50 ns", "p99 ns", "max ns");
+	for (std::size_t threads = 1; threads <= max_threads; threads *= 2)
+	{
+		bench_try_checkout(threads, iterations);
+	}
+	for (std::size_t threads = 1; threads <= max_threads; threads *= 2)
+	{
+		bench_async_checkout(threads, iterations / 10);
+	}
+}
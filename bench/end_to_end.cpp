@@ -0,0 +1,110 @@
+// End-to-end throughput and latency of query(), execute() and prepared
+// statements, against the in-process fake server in fake_backend.h.
+// The server does almost no work, so this measures the client's overhead:
+// serialization, parsing, row decoding and round trips over loopback.
+//
+// Usage: bench_end_to_end [iterations] [injected server latency, in us]
+
+#include "fake_backend.h"
+#include "psql/connection.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace psql;
+using bench_clock = std::chrono::steady_clock;
+using boost::asio::ip::tcp;
+
+namespace
+{
+
+struct scenario
+{
+	const char* name;
+	const char* sql; // interpreted by fake_pg::make_generated_result
+};
+
+constexpr scenario scenarios [] = {
+	{"1 row x 4 cols", "SELECT * FROM t WHERE id = $1 -- rows=1 cols=4"},
+	{"100 rows x 4 cols", "SELECT * FROM t WHERE id > $1 -- rows=100 cols=4"},
+	{"1000 rows x 16 cols", "SELECT * FROM t WHERE id > $1 -- rows=1000 cols=16 width=32"},
+	{"no rows (UPDATE)", "UPDATE t SET a = 1 WHERE id = $1 -- rows=0 cols=0"},
+};
+
+void report(const char* method, const char* name, std::vector<double>& latencies, double elapsed_s)
+{
+	std::sort(latencies.begin(), latencies.end());
+	auto pct = [&](double p) { return latencies[std::size_t(p * double(latencies.size() - 1))]; };
+	std::printf("%-22s %-20s %12.0f %9.1f %9.1f %9.1f\n", method, name,
+		double(latencies.size()) / elapsed_s, pct(0.5), pct(0.99), pct(0.999));
+}
+
+// Reads and decodes all rows, so their decoding is included in the measurement
+std::size_t consume(resultset<tcp::socket>& result)
+{
+	return result.fetch_all().size();
+}
+
+template <typename Op>
+void run(const char* method, const scenario& sc, std::size_t iterations, Op&& op)
+{
+	for (std::size_t i = 0; i < iterations / 10; ++i) op(); // warm up
+
+	std::vector<double> latencies (iterations);
+	auto start = bench_clock::now();
+	for (std::size_t i = 0; i < iterations; ++i)
+	{
+		auto before = bench_clock::now();
+		op();
+		latencies[i] = std::chrono::duration<double, std::micro>(bench_clock::now() - before).count();
+	}
+	double elapsed = std::chrono::duration<double>(bench_clock::now() - start).count();
+	report(method, sc.name, latencies, elapsed);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	std::size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 20000;
+	fake_pg::fake_backend_config config;
+	config.latency = std::chrono::microseconds(argc > 2 ? std::strtol(argv[2], nullptr, 10) : 0);
+	fake_pg::fake_backend server (tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0), config);
+
+	boost::asio::io_context ctx;
+	connection<tcp::socket> conn (ctx);
+	conn.next_layer().connect(server.endpoint());
+	conn.next_layer().set_option(tcp::no_delay(true));
+	conn.handshake(connection_params{"user", "password", "db"});
+
+	std::printf("%-22s %-20s %12s %9s %9s %9s\n", "method", "result", "queries/s", "p50 us", "p99 us", "p999 us");
+	for (const auto& sc: scenarios)
+	{
+		// The simple protocol doesn't take parameters
+		std::string query_sql = sc.sql;
+		query_sql.replace(query_sql.find("$1"), 2, "42");
+		run("query", sc, iterations, [&] {
+			auto result = conn.query(query_sql);
+			consume(result);
+		});
+		run("execute (unnamed)", sc, iterations, [&] {
+			auto result = conn.execute(sc.sql, {value(std::int32_t(42))});
+			consume(result);
+		});
+		auto stmt = conn.prepare_statement(sc.sql);
+		value params [] = {std::int32_t(42)};
+		run("prepared execute", sc, iterations, [&] {
+			auto result = stmt.execute(std::begin(params), std::end(params));
+			consume(result);
+		});
+	}
+
+	const connection_stats& stats = conn.stats();
+	std::printf("\n%llu round trips, %llu rows, %llu bytes sent, %llu bytes received, %.1f ms in I/O, %.1f ms decoding\n",
+		(unsigned long long)stats.round_trips, (unsigned long long)stats.rows_decoded,
+		(unsigned long long)stats.bytes_sent, (unsigned long long)stats.bytes_received,
+		std::chrono::duration<double, std::milli>(stats.io_time).count(),
+		std::chrono::duration<double, std::milli>(stats.decode_time).count());
+}
@@ -0,0 +1,776 @@
+#ifndef BENCH_FAKE_BACKEND_H_
+#define BENCH_FAKE_BACKEND_H_
+
+// An in-process fake PostgreSQL server, to measure and test the client without
+// a real server. It accepts connections on a loopback TCP or UNIX socket,
+// speaks the v3 protocol (startup, optional TLS, MD5 or SCRAM-SHA-256 auth,
+// simple queries with one or more statements, and extended queries)
+// and answers queries with generated or scripted results.
+//
+// Each connection is served by a thread using blocking I/O. Results are
+// encoded once per statement, so serving rows costs little more than copying
+// them to the socket, and the measurements are dominated by the client.
+
+#include "psql/auth_scram.h"
+#include "psql/oids.h"
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <boost/asio/ssl/stream.hpp>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace fake_pg
+{
+
+struct fake_column
+{
+	std::string name;
+	std::int32_t type_oid; // int4, int8, float8 or text
+	std::size_t text_size = 16; // length of text values
+};
+
+// What the server answers to a statement
+struct fake_result
+{
+	std::vector<fake_column> columns; // no columns means no rows (e.g. an UPDATE)
+	std::size_t num_rows = 0;
+	std::string command_tag; // "SELECT <num_rows>" if empty
+	std::string error_sqlstate; // if not empty, the statement fails with this code
+	std::string error_message;
+};
+
+/**
+ * Generates a result from tokens in the SQL text: rows=N, cols=N and width=N
+ * (length of text values). Columns cycle through int4, int8, text and float8.
+ * Defaults to a single row with a single int4 column. With cols=0, rows is
+ * the number of affected rows.
+ */
+inline fake_result make_generated_result(std::string_view sql)
+{
+	auto get = [sql](std::string_view key, std::size_t default_value) {
+		auto pos = sql.find(key);
+		if (pos == std::string_view::npos) return default_value;
+		std::size_t res = 0;
+		for (pos += key.size(); pos < sql.size() && sql[pos] >= '0' && sql[pos] <= '9'; ++pos)
+		{
+			res = res * 10 + std::size_t(sql[pos] - '0');
+		}
+		return res;
+	};
+	static constexpr std::int32_t types [] = {psql::int4_oid, psql::int8_oid, psql::text_oid, psql::float8_oid};
+
+	fake_result res;
+	res.num_rows = get("rows=", 1);
+	std::size_t num_cols = get("cols=", 1);
+	std::size_t width = get("width=", 16);
+	for (std::size_t i = 0; i < num_cols; ++i)
+	{
+		res.columns.push_back(fake_column{"col" + std::to_string(i), types[i % 4], width});
+	}
+	if (num_cols == 0) res.command_tag = "UPDATE " + std::to_string(res.num_rows);
+	return res;
+}
+
+struct fake_backend_config
+{
+	// Decides the result of each statement, given its SQL text
+	std::function<fake_result(std::string_view sql)> script {make_generated_result};
+
+	// Injected before answering each round trip (Sync, Flush or Query)
+	std::chrono::microseconds latency {0};
+
+	// With MD5, any password is accepted. With SCRAM, the password is checked
+	enum class auth_method { md5, scram_sha_256 } auth = auth_method::md5;
+	std::string password = "password";
+	std::string scram_salt = "fake backend salt";
+	std::int32_t scram_iterations = 4096;
+
+	// If set, SSLRequests are accepted and TLS is negotiated with this context
+	// (see make_self_signed_context()). Otherwise, they are declined
+	std::shared_ptr<boost::asio::ssl::context> ssl_context;
+};
+
+// Counts requests received by a server, across all its connections, to let
+// tests check what the client sent
+struct fake_backend_stats
+{
+	std::atomic<std::uint64_t> statements_prepared {0}; // named statements only
+	std::atomic<std::uint64_t> statements_closed {0};
+};
+
+/**
+ * A server TLS context with a freshly generated key and self-signed
+ * certificate (ECDSA P-256, CN=localhost). Clients must not verify it.
+ * Issues session tickets, so clients can resume sessions.
+ */
+inline std::shared_ptr<boost::asio::ssl::context> make_self_signed_context()
+{
+	auto check = [](bool ok) { if (!ok) throw std::runtime_error("fake backend: OpenSSL failed to generate a certificate"); };
+
+	std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> key_ctx (EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr), EVP_PKEY_CTX_free);
+	EVP_PKEY* raw_key = nullptr;
+	check(key_ctx && EVP_PKEY_keygen_init(key_ctx.get()) == 1 &&
+		EVP_PKEY_CTX_set_ec_paramgen_curve_nid(key_ctx.get(), NID_X9_62_prime256v1) == 1 &&
+		EVP_PKEY_keygen(key_ctx.get(), &raw_key) == 1);
+	std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key (raw_key, EVP_PKEY_free);
+
+	std::unique_ptr<X509, decltype(&X509_free)> cert (X509_new(), X509_free);
+	check(cert != nullptr);
+	ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), 1);
+	X509_gmtime_adj(X509_getm_notBefore(cert.get()), 0);
+	X509_gmtime_adj(X509_getm_notAfter(cert.get()), 24 * 3600);
+	X509_NAME* name = X509_get_subject_name(cert.get());
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+	X509_set_issuer_name(cert.get(), name);
+	check(X509_set_pubkey(cert.get(), key.get()) == 1 && X509_sign(cert.get(), key.get(), EVP_sha256()) > 0);
+
+	auto res = std::make_shared<boost::asio::ssl::context>(boost::asio::ssl::context::tls_server);
+	check(SSL_CTX_use_certificate(res->native_handle(), cert.get()) == 1 &&
+		SSL_CTX_use_PrivateKey(res->native_handle(), key.get()) == 1);
+	return res;
+}
+
+namespace detail
+{
+
+// Builds backend messages
+class message_writer
+{
+	std::string& buffer_;
+	std::size_t start_;
+public:
+	message_writer(std::string& buffer, char type): buffer_(buffer), start_(buffer.size())
+	{
+		buffer_.push_back(type);
+		buffer_.append(4, '\0'); // length, set by the destructor
+	}
+	message_writer(const message_writer&) = delete;
+	~message_writer()
+	{
+		auto length = std::uint32_t(buffer_.size() - start_ - 1);
+		for (int i = 0; i < 4; ++i) buffer_[start_ + 1 + i] = char(length >> (24 - 8 * i));
+	}
+
+	template <typename T>
+	message_writer& integer(T value)
+	{
+		for (int i = int(sizeof(T)) - 1; i >= 0; --i) buffer_.push_back(char(value >> (8 * i)));
+		return *this;
+	}
+
+	message_writer& string_null(std::string_view value)
+	{
+		buffer_.append(value);
+		buffer_.push_back('\0');
+		return *this;
+	}
+
+	message_writer& raw(std::string_view value)
+	{
+		buffer_.append(value);
+		return *this;
+	}
+};
+
+// Parses frontend messages
+class message_reader
+{
+	std::string_view body_;
+public:
+	explicit message_reader(std::string_view body) noexcept: body_(body) {}
+
+	template <typename T>
+	T integer() noexcept
+	{
+		std::uint64_t res = 0;
+		for (std::size_t i = 0; i < sizeof(T) && !body_.empty(); ++i)
+		{
+			res = (res << 8) | std::uint8_t(body_.front());
+			body_.remove_prefix(1);
+		}
+		return T(res);
+	}
+
+	std::string_view string_null() noexcept
+	{
+		auto pos = body_.find('\0');
+		auto res = body_.substr(0, pos);
+		body_.remove_prefix(pos == std::string_view::npos ? body_.size() : pos + 1);
+		return res;
+	}
+
+	void skip(std::size_t size) noexcept { body_.remove_prefix(std::min(size, body_.size())); }
+};
+
+inline std::string encode_value(const fake_column& col, bool binary)
+{
+	switch (col.type_oid)
+	{
+	case psql::int4_oid: return binary ? std::string("\0\0\x01\x00", 4) : "256";
+	case psql::int8_oid: return binary ? std::string("\0\0\0\0\0\x01\x00\x00", 8) : "65536";
+	case psql::float8_oid: return binary ? std::string("\x3f\xf8\0\0\0\0\0\0", 8) : "1.5";
+	default: return std::string(col.text_size, 'x'); // text is the same in both formats
+	}
+}
+
+// Format codes, as sent in Bind: none means text, one applies to all columns
+inline bool is_binary(const std::vector<std::int16_t>& formats, std::size_t index) noexcept
+{
+	if (formats.empty()) return false;
+	return formats[formats.size() == 1 ? 0 : index] == psql::binary_format;
+}
+
+struct statement
+{
+	std::string sql;
+	std::vector<std::int32_t> param_types;
+	std::shared_ptr<const fake_result> result;
+};
+
+struct portal
+{
+	std::shared_ptr<const fake_result> result;
+	std::vector<std::int16_t> formats;
+	std::string data_row; // the complete DataRow message, repeated for every row
+	std::size_t rows_sent = 0;
+};
+
+// Serves a single connection
+template <typename Socket>
+class session
+{
+	Socket& sock_;
+	std::optional<boost::asio::ssl::stream<Socket&>> tls_; // once negotiated, all I/O goes through it
+	const fake_backend_config& config_;
+	const psql::scram_keys& scram_keys_; // derived once by the server, as real servers store them
+	fake_backend_stats& stats_;
+	std::string in_;
+	std::string out_;
+	std::map<std::string, statement, std::less<>> statements_;
+	std::map<std::string, portal, std::less<>> portals_;
+	bool failed_ {false}; // an extended query request failed: skip messages until Sync
+
+	template <typename Buffer>
+	void read(const Buffer& buff)
+	{
+		if (tls_) boost::asio::read(*tls_, buff);
+		else boost::asio::read(sock_, buff);
+	}
+
+	template <typename Buffer>
+	void write(const Buffer& buff)
+	{
+		if (tls_) boost::asio::write(*tls_, buff);
+		else boost::asio::write(sock_, buff);
+	}
+
+	void flush()
+	{
+		if (config_.latency.count() > 0) std::this_thread::sleep_for(config_.latency);
+		write(boost::asio::buffer(out_));
+		out_.clear();
+	}
+
+	// Reads a message: type, then length including itself, then body
+	char read_message()
+	{
+		char header [5];
+		read(boost::asio::buffer(header));
+		message_reader reader (std::string_view(header + 1, 4));
+		in_.resize(reader.integer<std::uint32_t>() - 4);
+		read(boost::asio::buffer(in_));
+		return header[0];
+	}
+
+	void write_ready() { message_writer(out_, 'Z').raw("I"); }
+
+	void write_error(const fake_result& res)
+	{
+		message_writer(out_, 'E')
+			.raw("S").string_null("ERROR")
+			.raw("V").string_null("ERROR")
+			.raw("C").string_null(res.error_sqlstate)
+			.raw("M").string_null(res.error_message)
+			.raw(std::string_view("\0", 1));
+	}
+
+	void write_row_description(const fake_result& res, const std::vector<std::int16_t>& formats)
+	{
+		if (res.columns.empty())
+		{
+			message_writer(out_, 'n'); // NoData
+			return;
+		}
+		message_writer w (out_, 'T');
+		w.integer(std::int16_t(res.columns.size()));
+		for (std::size_t i = 0; i < res.columns.size(); ++i)
+		{
+			const auto& col = res.columns[i];
+			w.string_null(col.name)
+				.integer(std::int32_t(0)) // table OID
+				.integer(std::int16_t(0)) // column number
+				.integer(col.type_oid)
+				.integer(std::int16_t(-1)) // type size
+				.integer(std::int32_t(-1)) // type modifier
+				.integer(std::int16_t(is_binary(formats, i) ? 1 : 0));
+		}
+	}
+
+	void write_complete(const fake_result& res)
+	{
+		message_writer(out_, 'C').string_null(res.command_tag.empty() ?
+			"SELECT " + std::to_string(res.num_rows) : res.command_tag);
+	}
+
+	static std::string make_data_row(const fake_result& res, const std::vector<std::int16_t>& formats)
+	{
+		std::string msg;
+		{
+			message_writer w (msg, 'D');
+			w.integer(std::int16_t(res.columns.size()));
+			for (std::size_t i = 0; i < res.columns.size(); ++i)
+			{
+				std::string value = encode_value(res.columns[i], is_binary(formats, i));
+				w.integer(std::int32_t(value.size())).raw(value);
+			}
+		}
+		return msg;
+	}
+
+	// Sends up to max_rows rows (0 = all), then CommandComplete or PortalSuspended
+	void write_rows(portal& p, std::size_t max_rows)
+	{
+		const fake_result& res = *p.result;
+		std::size_t remaining = res.columns.empty() ? 0 : res.num_rows - p.rows_sent;
+		std::size_t count = max_rows == 0 ? remaining : std::min(remaining, max_rows);
+		for (std::size_t i = 0; i < count; ++i) out_.append(p.data_row);
+		p.rows_sent += count;
+		if (count < remaining) message_writer(out_, 's');
+		else write_complete(res);
+	}
+
+	std::shared_ptr<const fake_result> run_script(std::string_view sql)
+	{
+		return std::make_shared<const fake_result>(config_.script(sql));
+	}
+
+	// Statements separated by semicolons are run in order, until one fails
+	void handle_query()
+	{
+		message_reader reader (in_);
+		std::string_view sql = reader.string_null();
+		bool any = false;
+		while (!sql.empty())
+		{
+			auto end = std::min(sql.find(';'), sql.size());
+			std::string_view stmt = sql.substr(0, end);
+			sql.remove_prefix(std::min(end + 1, sql.size()));
+			if (stmt.find_first_not_of(" \t\n") == std::string_view::npos) continue;
+			any = true;
+			auto res = run_script(stmt);
+			if (!res->error_sqlstate.empty())
+			{
+				write_error(*res);
+				break;
+			}
+			// The simple protocol doesn't use NoData
+			portal p {res, {}, make_data_row(*res, {})};
+			if (!res->columns.empty()) write_row_description(*res, {});
+			write_rows(p, 0);
+		}
+		if (!any) message_writer(out_, 'I'); // EmptyQueryResponse
+		write_ready();
+		flush();
+	}
+
+	void handle_parse()
+	{
+		message_reader reader (in_);
+		std::string name (reader.string_null());
+		statement stmt;
+		stmt.sql = reader.string_null();
+		auto num_params = reader.integer<std::int16_t>();
+		for (std::int16_t i = 0; i < num_params; ++i) stmt.param_types.push_back(reader.integer<std::int32_t>());
+		stmt.result = run_script(stmt.sql);
+		if (!stmt.result->error_sqlstate.empty())
+		{
+			write_error(*stmt.result);
+			failed_ = true;
+			return;
+		}
+		if (!name.empty()) ++stats_.statements_prepared;
+		statements_[name] = std::move(stmt);
+		message_writer(out_, '1');
+	}
+
+	void handle_bind()
+	{
+		message_reader reader (in_);
+		std::string portal_name (reader.string_null());
+		auto stmt = statements_.find(reader.string_null());
+		if (stmt == statements_.end())
+		{
+			write_missing_statement_error();
+			return;
+		}
+		auto num_formats = reader.integer<std::int16_t>();
+		reader.skip(2 * std::size_t(num_formats));
+		auto num_params = reader.integer<std::int16_t>();
+		for (std::int16_t i = 0; i < num_params; ++i)
+		{
+			auto size = reader.integer<std::int32_t>();
+			if (size > 0) reader.skip(std::size_t(size));
+		}
+		portal p;
+		p.result = stmt->second.result;
+		auto num_result_formats = reader.integer<std::int16_t>();
+		for (std::int16_t i = 0; i < num_result_formats; ++i) p.formats.push_back(reader.integer<std::int16_t>());
+		p.data_row = make_data_row(*p.result, p.formats);
+		portals_[portal_name] = std::move(p);
+		message_writer(out_, '2');
+	}
+
+	void write_missing_statement_error()
+	{
+		write_error(fake_result{{}, 0, {}, "26000", "prepared statement does not exist"});
+		failed_ = true;
+	}
+
+	void write_missing_portal_error()
+	{
+		write_error(fake_result{{}, 0, {}, "34000", "portal does not exist"});
+		failed_ = true;
+	}
+
+	void handle_describe()
+	{
+		message_reader reader (in_);
+		char type = reader.integer<char>();
+		std::string_view name = reader.string_null();
+		if (type == 'S')
+		{
+			auto it = statements_.find(name);
+			if (it == statements_.end())
+			{
+				write_missing_statement_error();
+				return;
+			}
+			const statement& stmt = it->second;
+
+			// Parameters not declared by the client are reported as text
+			std::int16_t num_params = 0;
+			for (auto pos = stmt.sql.find('$'); pos != std::string::npos; pos = stmt.sql.find('$', pos + 1))
+			{
+				num_params = std::max(num_params, std::int16_t(std::atoi(stmt.sql.c_str() + pos + 1)));
+			}
+			num_params = std::max(num_params, std::int16_t(stmt.param_types.size()));
+			{
+				message_writer w (out_, 't');
+				w.integer(num_params);
+				for (std::int16_t i = 0; i < num_params; ++i)
+				{
+					std::size_t index = std::size_t(i);
+					bool declared = index < stmt.param_types.size() && stmt.param_types[index] != psql::unspecified_oid;
+					w.integer(declared ? stmt.param_types[index] : psql::text_oid);
+				}
+			}
+			write_row_description(*stmt.result, {});
+		}
+		else
+		{
+			auto it = portals_.find(name);
+			if (it == portals_.end()) write_missing_portal_error();
+			else write_row_description(*it->second.result, it->second.formats);
+		}
+	}
+
+	void handle_execute()
+	{
+		message_reader reader (in_);
+		auto it = portals_.find(reader.string_null());
+		auto max_rows = reader.integer<std::int32_t>();
+		if (it == portals_.end()) write_missing_portal_error();
+		else write_rows(it->second, std::size_t(max_rows));
+	}
+
+	void handle_close()
+	{
+		message_reader reader (in_);
+		char type = reader.integer<char>();
+		std::string_view name = reader.string_null();
+		if (type == 'S')
+		{
+			auto it = statements_.find(name);
+			if (it != statements_.end())
+			{
+				if (!name.empty()) ++stats_.statements_closed;
+				statements_.erase(it);
+			}
+		}
+		else
+		{
+			auto it = portals_.find(name);
+			if (it != portals_.end()) portals_.erase(it);
+		}
+		message_writer(out_, '3');
+	}
+
+	// Returns false if authentication fails
+	bool startup()
+	{
+		while (true)
+		{
+			// Startup packets have no type byte
+			char length_buff [4];
+			read(boost::asio::buffer(length_buff));
+			in_.resize(message_reader(std::string_view(length_buff, 4)).integer<std::uint32_t>() - 4);
+			read(boost::asio::buffer(in_));
+			if (message_reader(in_).integer<std::int32_t>() != 80877103) break; // not an SSLRequest
+			if (tls_ || !config_.ssl_context)
+			{
+				write(boost::asio::buffer("N", 1));
+				continue;
+			}
+			write(boost::asio::buffer("S", 1));
+			tls_.emplace(sock_, *config_.ssl_context);
+			tls_->handshake(boost::asio::ssl::stream_base::server);
+		}
+
+		if (config_.auth == fake_backend_config::auth_method::scram_sha_256)
+		{
+			if (!scram_auth()) return false;
+		}
+		else
+		{
+			message_writer(out_, 'R').integer(std::int32_t(5)).raw("salt");
+			flush();
+			read_message();
+		}
+		message_writer(out_, 'R').integer(std::int32_t(0));
+		message_writer(out_, 'S').string_null("server_version").string_null("16.0");
+		message_writer(out_, 'S').string_null("client_encoding").string_null("UTF8");
+		message_writer(out_, 'K').integer(std::int32_t(1234)).integer(std::int32_t(5678));
+		write_ready();
+		flush();
+		return true;
+	}
+
+	// The server side of SCRAM-SHA-256. Returns false if the client's proof is wrong
+	bool scram_auth()
+	{
+		message_writer(out_, 'R').integer(std::int32_t(10)).string_null("SCRAM-SHA-256").string_null("");
+		flush();
+
+		// SASLInitialResponse: mechanism, length, then "n,,n=,r=<client nonce>"
+		read_message();
+		message_reader reader (in_);
+		reader.string_null();
+		reader.skip(4);
+		std::string client_first (reader.string_null());
+		std::string client_first_bare = client_first.substr(client_first.find(',', client_first.find(',') + 1) + 1);
+		std::string_view client_nonce;
+		psql::detail::scram_attribute(client_first_bare, 'r', client_nonce);
+
+		std::string server_first = "r=" + std::string(client_nonce) + "fakebackendnonce,s=" +
+			psql::detail::base64_encode(reinterpret_cast<const std::uint8_t*>(config_.scram_salt.data()),
+				config_.scram_salt.size()) +
+			",i=" + std::to_string(config_.scram_iterations);
+		message_writer(out_, 'R').integer(std::int32_t(11)).raw(server_first);
+		flush();
+
+		// SASLResponse: "c=biws,r=<nonce>,p=<proof>"
+		read_message();
+		std::string_view client_final = in_;
+		std::string_view proof_b64;
+		std::string proof;
+		psql::detail::scram_attribute(client_final, 'p', proof_b64);
+		psql::detail::base64_decode(proof_b64, proof);
+		std::string auth_message = client_first_bare + "," + server_first + "," +
+			std::string(client_final.substr(0, client_final.find(",p=")));
+
+		// The proof is ClientKey XOR HMAC(StoredKey, AuthMessage)
+		psql::scram_digest stored_key, client_signature, server_signature, client_key;
+		SHA256(scram_keys_.client_key.data(), scram_keys_.client_key.size(), stored_key.data());
+		psql::detail::hmac_sha256(stored_key, auth_message, client_signature);
+		psql::detail::hmac_sha256(scram_keys_.server_key, auth_message, server_signature);
+		bool ok = proof.size() == client_key.size();
+		for (std::size_t i = 0; ok && i < client_key.size(); ++i)
+		{
+			client_key[i] = std::uint8_t(proof[i]) ^ client_signature[i];
+		}
+		if (!ok || client_key != scram_keys_.client_key)
+		{
+			fake_result res;
+			res.error_sqlstate = "28P01";
+			res.error_message = "password authentication failed";
+			write_error(res);
+			flush();
+			return false;
+		}
+		message_writer(out_, 'R').integer(std::int32_t(12))
+			.raw("v=" + psql::detail::base64_encode(server_signature.data(), server_signature.size()));
+		return true;
+	}
+public:
+	session(Socket& sock, const fake_backend_config& config, const psql::scram_keys& scram_keys, fake_backend_stats& stats):
+		sock_(sock), config_(config), scram_keys_(scram_keys), stats_(stats) {}
+
+	// Serves requests until the client disconnects. Throws on I/O errors
+	void run()
+	{
+		if (!startup()) return;
+		while (true)
+		{
+			char type = read_message();
+			if (type == 'X') return; // Terminate
+			if (type == 'Q') { failed_ = false; handle_query(); continue; }
+			if (type == 'S') { failed_ = false; write_ready(); flush(); continue; }
+			if (type == 'H') { flush(); continue; }
+			if (failed_) continue;
+			switch (type)
+			{
+			case 'P': handle_parse(); break;
+			case 'B': handle_bind(); break;
+			case 'D': handle_describe(); break;
+			case 'E': handle_execute(); break;
+			case 'C': handle_close(); break;
+			default: std::fprintf(stderr, "fake backend: unsupported message '%c'\n", type); return;
+			}
+		}
+	}
+};
+
+}
+
+/**
+ * The fake server. Starts accepting connections on construction, on the given
+ * endpoint (for TCP, port 0 selects a free port; see endpoint()). UNIX socket
+ * files are removed on destruction.
+ * The destructor disconnects all clients and waits for their threads.
+ */
+template <typename Protocol>
+class basic_fake_backend
+{
+public:
+	using endpoint_type = typename Protocol::endpoint;
+private:
+	using socket_type = typename Protocol::socket;
+
+	fake_backend_config config_;
+	psql::scram_keys scram_keys_ {};
+	fake_backend_stats stats_;
+	boost::asio::io_context ctx_;
+	typename Protocol::acceptor acceptor_;
+	std::atomic<bool> stopped_ {false};
+	std::mutex mtx_;
+	std::vector<std::shared_ptr<socket_type>> sockets_;
+	std::vector<std::thread> sessions_;
+	std::thread acceptor_thread_;
+
+	void accept_loop()
+	{
+		while (true)
+		{
+			auto sock = std::make_shared<socket_type>(ctx_);
+			boost::system::error_code err;
+			acceptor_.accept(*sock, err);
+			if (stopped_ || err) return;
+			if constexpr (std::is_same_v<Protocol, boost::asio::ip::tcp>)
+			{
+				// TLS handshakes take several writes
+				sock->set_option(boost::asio::ip::tcp::no_delay(true), err);
+			}
+			std::lock_guard<std::mutex> lock (mtx_);
+			sockets_.push_back(sock);
+			sessions_.emplace_back([this, sock] {
+				try
+				{
+					detail::session<socket_type>(*sock, config_, scram_keys_, stats_).run();
+				}
+				catch (const boost::system::system_error&)
+				{
+					// The client disconnected
+				}
+			});
+		}
+	}
+public:
+	basic_fake_backend(const endpoint_type& ep, fake_backend_config config = {}):
+		config_(std::move(config)),
+		acceptor_(ctx_, ep)
+	{
+		if (config_.auth == fake_backend_config::auth_method::scram_sha_256)
+		{
+			psql::derive_scram_keys("", config_.password, config_.scram_salt, config_.scram_iterations,
+				scram_keys_, nullptr);
+		}
+		acceptor_thread_ = std::thread([this] { accept_loop(); });
+	}
+	basic_fake_backend(const basic_fake_backend&) = delete;
+	basic_fake_backend& operator=(const basic_fake_backend&) = delete;
+
+	~basic_fake_backend()
+	{
+		// Wake up the acceptor with a dummy connection
+		stopped_ = true;
+		{
+			socket_type wake_up (ctx_);
+			boost::system::error_code err;
+			wake_up.connect(endpoint(), err);
+		}
+		acceptor_thread_.join();
+
+		// Blocking reads return once the socket is shut down
+		std::lock_guard<std::mutex> lock (mtx_);
+		for (auto& sock: sockets_)
+		{
+			boost::system::error_code err;
+			sock->shutdown(socket_type::shutdown_both, err);
+		}
+		for (auto& t: sessions_) t.join();
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+		if constexpr (std::is_same_v<Protocol, boost::asio::local::stream_protocol>)
+		{
+			std::remove(endpoint().path().c_str());
+		}
+#endif
+	}
+
+	/// The endpoint clients should connect to.
+	endpoint_type endpoint() const { return acceptor_.local_endpoint(); }
+
+	/// What clients have sent so far.
+	const fake_backend_stats& stats() const noexcept { return stats_; }
+};
+
+using fake_backend = basic_fake_backend<boost::asio::ip::tcp>;
+
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+using local_fake_backend = basic_fake_backend<boost::asio::local::stream_protocol>;
+#endif
+
+}
+
+#endif /* BENCH_FAKE_BACKEND_H_ */
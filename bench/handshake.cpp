@@ -0,0 +1,105 @@
+// Connection establishment cost: TCP connect plus the PostgreSQL startup and
+// authentication, against the in-process fake server in fake_backend.h.
+// Compares MD5 with SCRAM-SHA-256, with and without the cache of SCRAM keys.
+// Without it, every handshake derives the keys (PBKDF2 with the server's
+// iteration count), as happens on the first connection for a password.
+// Then compares TLS (with a self-signed certificate) with and without
+// session resumption, using MD5 to isolate the cost of TLS.
+//
+// Usage: bench_handshake [iterations] [SCRAM iterations]
+
+#include "fake_backend.h"
+#include "psql/connection.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace psql;
+using bench_clock = std::chrono::steady_clock;
+using boost::asio::ip::tcp;
+using ssl_socket = boost::asio::ssl::stream<tcp::socket>;
+
+namespace
+{
+
+const connection_params params {"user", "password", "db", ssl_mode::require};
+
+// Runs connect, which returns whether the connection resumed a TLS session
+template <typename Connect>
+void run(const char* name, std::size_t iterations, Connect&& connect)
+{
+	connect(); // warm up, and fill the caches if enabled
+
+	std::vector<double> latencies (iterations);
+	std::size_t resumed = 0;
+	for (std::size_t i = 0; i < iterations; ++i)
+	{
+		auto before = bench_clock::now();
+		if (connect()) ++resumed;
+		latencies[i] = std::chrono::duration<double, std::micro>(bench_clock::now() - before).count();
+	}
+	std::sort(latencies.begin(), latencies.end());
+	auto pct = [&](double p) { return latencies[std::size_t(p * double(latencies.size() - 1))]; };
+	std::printf("%-28s %9.1f %9.1f %9.1f %9zu\n", name, pct(0.5), pct(0.9), pct(0.99), resumed);
+}
+
+void run_plain(const char* name, std::size_t iterations, const fake_pg::fake_backend_config& config)
+{
+	fake_pg::fake_backend server (tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0), config);
+	boost::asio::io_context ctx;
+	run(name, iterations, [&] {
+		connection<tcp::socket> conn (ctx);
+		conn.next_layer().connect(server.endpoint());
+		conn.next_layer().set_option(tcp::no_delay(true));
+		conn.handshake(params);
+		return false;
+	});
+}
+
+void run_tls(const char* name, std::size_t iterations, const fake_pg::fake_backend_config& config, bool resume)
+{
+	fake_pg::fake_backend server (tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0), config);
+	boost::asio::io_context ctx;
+	boost::asio::ssl::context ssl_ctx (boost::asio::ssl::context::tls_client);
+	ssl_ctx.set_verify_mode(boost::asio::ssl::verify_none); // self-signed
+	if (resume) ssl_session_cache::enable(ssl_ctx);
+	run(name, iterations, [&] {
+		connection<ssl_socket> conn (ctx, ssl_ctx);
+		conn.next_layer().next_layer().connect(server.endpoint());
+		conn.next_layer().next_layer().set_option(tcp::no_delay(true));
+		conn.handshake(params);
+		return SSL_session_reused(conn.next_layer().native_handle()) == 1;
+	});
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	std::size_t iterations = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 500;
+	fake_pg::fake_backend_config config;
+	config.scram_iterations = argc > 2 ? std::int32_t(std::strtol(argv[2], nullptr, 10)) : 4096;
+
+	std::printf("%-28s %9s %9s %9s %9s\n", "handshake", "p50 us", "p90 us", "p99 us", "resumed");
+	run_plain("md5", iterations, config);
+
+	config.auth = fake_pg::fake_backend_config::auth_method::scram_sha_256;
+	scram_key_cache& cache = scram_key_cache::global();
+	std::size_t capacity = cache.capacity();
+	cache.set_capacity(0);
+	run_plain("scram-sha-256 (no key cache)", iterations, config);
+	cache.set_capacity(capacity);
+	run_plain("scram-sha-256 (key cache)", iterations, config);
+
+	config.auth = fake_pg::fake_backend_config::auth_method::md5;
+	config.ssl_context = fake_pg::make_self_signed_context();
+	run_tls("tls + md5 (full handshake)", iterations, config, false);
+	run_tls("tls + md5 (resumed)", iterations, config, true);
+
+	std::printf("\nkey cache: %llu hits, %llu misses\n",
+		(unsigned long long)cache.hits(), (unsigned long long)cache.misses());
+	std::printf("session cache: %llu hits, %llu misses\n",
+		(unsigned long long)ssl_session_cache::global().hits(),
+		(unsigned long long)ssl_session_cache::global().misses());
+}
@@ -0,0 +1,288 @@
+// Microbenchmarks for the protocol hot paths: message serialization and
+// deserialization over synthetic wire buffers. No server is needed.
+// For each benchmark, reports the time per operation, the wire bytes
+// produced or consumed per operation and the heap allocations per operation.
+//
+// Usage: psql_bench [filter]
+// Only benchmarks whose name contains filter are run.
+
+#include "psql/channel.h"
+#include "psql/messages.h"
+#include "psql/metadata.h"
+#include "psql/deserialize_row.h"
+#include "allocation_counter.h"
+#include <boost/asio/io_context.hpp>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace psql;
+using bench_clock = std::chrono::steady_clock;
+
+namespace
+{
+
+// Prevents the compiler from optimizing away the benchmarked computation
+template <typename T>
+void do_not_optimize(const T& value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	asm volatile("" : : "r"(&value) : "memory");
+#else
+	static const void* volatile sink;
+	sink = &value;
+#endif
+}
+
+const char* name_filter = nullptr;
+
+// Runs op in batches until at least min_time has elapsed, after a warm up run.
+// op returns the number of wire bytes it processed
+template <typename Op>
+void run(const char* name, Op&& op)
+{
+	if (name_filter && !std::strstr(name, name_filter)) return;
+
+	constexpr auto min_time = std::chrono::milliseconds(200);
+	std::size_t bytes = op(); // warm up: buffers reach their final capacity
+
+	std::size_t iterations = 0;
+	std::size_t batch = 64;
+	std::size_t allocations_before = allocation_count();
+	bench_clock::duration elapsed {};
+	while (elapsed < min_time)
+	{
+		auto before = bench_clock::now();
+		for (std::size_t i = 0; i < batch; ++i) op();
+		elapsed += bench_clock::now() - before;
+		iterations += batch;
+		batch *= 2;
+	}
+	std::size_t allocations = allocation_count() - allocations_before;
+
+	double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+	std::printf("%-36s %10.1f %10zu %10.2f\n", name, ns / double(iterations), bytes,
+		double(allocations) / double(iterations));
+}
+
+// Big endian integers and null-terminated strings, as sent by the server
+class wire_writer
+{
+	bytestring buffer_;
+public:
+	template <typename T>
+	wire_writer& integer(T value)
+	{
+		for (int i = int(sizeof(T)) - 1; i >= 0; --i) buffer_.push_back(std::uint8_t(value >> (8 * i)));
+		return *this;
+	}
+
+	wire_writer& string_null(std::string_view value)
+	{
+		buffer_.insert(buffer_.end(), value.begin(), value.end());
+		buffer_.push_back(0);
+		return *this;
+	}
+
+	wire_writer& raw(std::string_view value)
+	{
+		buffer_.insert(buffer_.end(), value.begin(), value.end());
+		return *this;
+	}
+
+	const bytestring& buffer() const noexcept { return buffer_; }
+};
+
+struct column
+{
+	std::string name;
+	std::int32_t type_oid;
+	std::int16_t format;
+	std::string value; // as encoded in a DataRow, in the column's format
+};
+
+// A typical narrow row: an integer key, a short string and a bigint
+std::vector<column> narrow_columns()
+{
+	return {
+		{"id", int4_oid, binary_format, std::string("\0\0\0\x2a", 4)},
+		{"name", text_oid, text_format, "some user name"},
+		{"created_at_epoch", int8_oid, binary_format, std::string("\0\0\0\0\x60\x00\x00\x00", 8)},
+	};
+}
+
+// A wide row of 64 columns, mixing types and formats
+std::vector<column> wide_columns()
+{
+	std::vector<column> res;
+	for (int i = 0; i < 16; ++i)
+	{
+		std::string suffix = std::to_string(i);
+		res.push_back({"int_col_" + suffix, int4_oid, binary_format, std::string("\0\0\x01\x00", 4)});
+		res.push_back({"bigint_col_" + suffix, int8_oid, binary_format, std::string("\0\0\0\0\0\0\x01\x00", 8)});
+		res.push_back({"text_col_" + suffix, text_oid, text_format, "a medium sized text value"});
+		res.push_back({"double_col_" + suffix, float8_oid, binary_format, std::string("\x3f\xf0\0\0\0\0\0\0", 8)});
+	}
+	return res;
+}
+
+bytestring make_row_description(const std::vector<column>& columns)
+{
+	wire_writer w;
+	w.integer(std::int16_t(columns.size()));
+	for (const auto& col: columns)
+	{
+		w.string_null(col.name)
+			.integer(std::int32_t(16384)) // table OID
+			.integer(std::int16_t(1))     // column number
+			.integer(col.type_oid)
+			.integer(std::int16_t(-1))    // type size
+			.integer(std::int32_t(-1))    // type modifier
+			.integer(col.format);
+	}
+	return w.buffer();
+}
+
+bytestring make_data_row(const std::vector<column>& columns)
+{
+	wire_writer w;
+	w.integer(std::int16_t(columns.size()));
+	for (const auto& col: columns)
+	{
+		w.integer(std::int32_t(col.value.size())).raw(col.value);
+	}
+	return w.buffer();
+}
+
+// Writes are discarded. Only used to give the channel a stream to wrap
+struct null_stream
+{
+	using executor_type = boost::asio::io_context::executor_type;
+	executor_type ex;
+	executor_type get_executor() const noexcept { return ex; }
+};
+
+void bench_bind(const char* name, const std::vector<value>& params)
+{
+	boost::asio::io_context ctx;
+	null_stream stream {ctx.get_executor()};
+	channel<null_stream> chan (stream);
+	const std::int16_t result_formats [] = {binary_format};
+	run(name, [&] {
+		chan.shared_buffer().clear();
+		chan.enqueue(bind_message<std::vector<value>::const_iterator>{
+			string_null(""),
+			string_null("__psql_asio_0"),
+			params.begin(),
+			params.end(),
+			&chan.param_buffer(),
+			nullptr,
+			std::begin(result_formats),
+			std::end(result_formats)
+		});
+		do_not_optimize(chan.shared_buffer());
+		return chan.shared_buffer().size();
+	});
+}
+
+void bench_bind_messages()
+{
+	std::vector<value> ints, texts, mixed;
+	for (int i = 0; i < 64; ++i)
+	{
+		ints.push_back(std::int32_t(i));
+		texts.push_back(std::string_view("a parameter value"));
+	}
+	for (int i = 0; i < 16; ++i)
+	{
+		mixed.push_back(std::int64_t(i));
+		mixed.push_back(std::string_view("text"));
+		mixed.push_back(3.14);
+		mixed.push_back(nullptr);
+	}
+	bench_bind("bind/no_params", {});
+	bench_bind("bind/int4x1", std::vector<value>(ints.begin(), ints.begin() + 1));
+	bench_bind("bind/int4x8", std::vector<value>(ints.begin(), ints.begin() + 8));
+	bench_bind("bind/int4x64", ints);
+	bench_bind("bind/textx8", std::vector<value>(texts.begin(), texts.begin() + 8));
+	bench_bind("bind/textx64", texts);
+	bench_bind("bind/mixedx64", mixed);
+}
+
+void bench_row_description(const char* name, const std::vector<column>& columns)
+{
+	bytestring body = make_row_description(columns);
+	row_description descr;
+	run(name, [&] {
+		deserialization_context ctx (boost::asio::buffer(body));
+		auto err = deserialize_message(descr, ctx);
+		if (err) std::abort();
+		do_not_optimize(descr);
+		return body.size();
+	});
+}
+
+void bench_make_metadata(const char* name, const std::vector<column>& columns)
+{
+	bytestring body = make_row_description(columns);
+	run(name, [&] {
+		resultset_metadata meta;
+		auto err = make_resultset_metadata(boost::asio::buffer(body), meta);
+		if (err) std::abort();
+		do_not_optimize(meta);
+		return body.size();
+	});
+}
+
+void bench_deserialize_row(const char* name, const std::vector<column>& columns)
+{
+	bytestring descr = make_row_description(columns);
+	bytestring row = make_data_row(columns);
+	resultset_metadata meta;
+	if (make_resultset_metadata(boost::asio::buffer(descr), meta)) std::abort();
+	std::vector<value> output;
+	run(name, [&] {
+		if (deserialize_row(meta.fields(), boost::asio::buffer(row), output) != errc::ok) std::abort();
+		do_not_optimize(output);
+		return row.size();
+	});
+}
+
+void bench_string_null()
+{
+	// The column names of a wide RowDescription, back to back
+	wire_writer w;
+	for (const auto& col: wide_columns()) w.string_null(col.name);
+	bytestring buffer = w.buffer();
+	run("string_null/x64", [&] {
+		deserialization_context ctx (boost::asio::buffer(buffer));
+		string_null output;
+		while (!ctx.empty())
+		{
+			if (deserialize(output, ctx) != errc::ok) std::abort();
+			do_not_optimize(output);
+		}
+		return buffer.size();
+	});
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1) name_filter = argv[1];
+
+	std::printf("%-36s %10s %10s %10s\n", "benchmark", "ns/op", "bytes/op", "allocs/op");
+	bench_bind_messages();
+	bench_row_description("row_description/narrow", narrow_columns());
+	bench_row_description("row_description/wide", wide_columns());
+	bench_make_metadata("make_resultset_metadata/narrow", narrow_columns());
+	bench_make_metadata("make_resultset_metadata/wide", wide_columns());
+	bench_deserialize_row("deserialize_row/narrow", narrow_columns());
+	bench_deserialize_row("deserialize_row/wide", wide_columns());
+	bench_string_null();
+}
@@ -0,0 +1,393 @@
+#ifndef INCLUDE_PSQL_AUTH_SCRAM_H_
+#define INCLUDE_PSQL_AUTH_SCRAM_H_
+
+#include "psql/error.h"
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace psql
+{
+
+/// A SHA-256 digest or HMAC.
+using scram_digest = std::array<std::uint8_t, SHA256_DIGEST_LENGTH>;
+
+/// The keys derived from a password, salt and iteration count (RFC 5802).
+struct scram_keys
+{
+	scram_digest client_key;
+	scram_digest server_key;
+};
+
+/**
+ * \brief A process-wide cache of SCRAM keys, so reconnects skip the key derivation.
+ * \details Deriving the keys takes thousands of HMAC iterations, which
+ * dominates the client's cost of a SCRAM handshake. Entries are keyed by user,
+ * salt, iteration count and a digest of the password, so a wrong password
+ * never matches the keys derived from the right one. When the server changes
+ * the salt or iteration count (e.g. the password was changed), the keys are
+ * derived again. Arbitrary entries are evicted when the cache is full.
+ * Thread safe.
+ */
+class scram_key_cache
+{
+	mutable std::mutex mtx_;
+	std::unordered_map<std::string, scram_keys> entries_;
+	std::size_t capacity_;
+	std::uint64_t hits_ {0};
+	std::uint64_t misses_ {0};
+public:
+	static constexpr std::size_t default_capacity = 64;
+
+	explicit scram_key_cache(std::size_t capacity = default_capacity) noexcept: capacity_(capacity) {}
+
+	/// The cache used by connections.
+	static scram_key_cache& global() noexcept
+	{
+		static scram_key_cache res;
+		return res;
+	}
+
+	/// The key for a set of derivation inputs.
+	static std::string make_key(
+		std::string_view user,
+		std::string_view password,
+		std::string_view salt,
+		std::int32_t iterations
+	)
+	{
+		// Fixed size fields first, so the key is unambiguous
+		std::string res (SHA256_DIGEST_LENGTH + 2 * sizeof(std::uint32_t), '\0');
+		SHA256(reinterpret_cast<const unsigned char*>(password.data()), password.size(),
+			reinterpret_cast<unsigned char*>(res.data()));
+		auto salt_size = std::uint32_t(salt.size());
+		std::memcpy(&res[SHA256_DIGEST_LENGTH], &iterations, sizeof(iterations));
+		std::memcpy(&res[SHA256_DIGEST_LENGTH + sizeof(std::uint32_t)], &salt_size, sizeof(salt_size));
+		res += salt;
+		res += user;
+		return res;
+	}
+
+	/// Looks up the keys for key. Updates hit and miss counts.
+	bool find(const std::string& key, scram_keys& output)
+	{
+		std::lock_guard<std::mutex> guard (mtx_);
+		auto it = entries_.find(key);
+		if (it == entries_.end())
+		{
+			++misses_;
+			return false;
+		}
+		++hits_;
+		output = it->second;
+		return true;
+	}
+
+	/// Adds or replaces an entry. Does nothing if the capacity is zero.
+	void insert(std::string key, const scram_keys& keys)
+	{
+		std::lock_guard<std::mutex> guard (mtx_);
+		if (capacity_ == 0) return;
+		if (entries_.size() >= capacity_ && !entries_.count(key))
+		{
+			entries_.erase(entries_.begin());
+		}
+		entries_.insert_or_assign(std::move(key), keys);
+	}
+
+	/// Changes the maximum number of entries, evicting them if needed. Zero disables caching.
+	void set_capacity(std::size_t value)
+	{
+		std::lock_guard<std::mutex> guard (mtx_);
+		capacity_ = value;
+		while (entries_.size() > capacity_) entries_.erase(entries_.begin());
+	}
+
+	/// Removes all entries, e.g. after rotating credentials.
+	void clear() noexcept
+	{
+		std::lock_guard<std::mutex> guard (mtx_);
+		entries_.clear();
+	}
+
+	std::size_t capacity() const noexcept { std::lock_guard<std::mutex> guard (mtx_); return capacity_; }
+	std::size_t size() const noexcept { std::lock_guard<std::mutex> guard (mtx_); return entries_.size(); }
+
+	/// The number of handshakes that reused cached keys.
+	std::uint64_t hits() const noexcept { std::lock_guard<std::mutex> guard (mtx_); return hits_; }
+
+	/// The number of handshakes that had to derive the keys.
+	std::uint64_t misses() const noexcept { std::lock_guard<std::mutex> guard (mtx_); return misses_; }
+};
+
+namespace detail
+{
+
+inline std::string base64_encode(const std::uint8_t* data, std::size_t size)
+{
+	static const char* chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string res;
+	res.reserve((size + 2) / 3 * 4);
+	for (std::size_t i = 0; i < size; i += 3)
+	{
+		std::uint32_t group = std::uint32_t(data[i]) << 16;
+		if (i + 1 < size) group |= std::uint32_t(data[i + 1]) << 8;
+		if (i + 2 < size) group |= data[i + 2];
+		res.push_back(chars[(group >> 18) & 0x3F]);
+		res.push_back(chars[(group >> 12) & 0x3F]);
+		res.push_back(i + 1 < size ? chars[(group >> 6) & 0x3F] : '=');
+		res.push_back(i + 2 < size ? chars[group & 0x3F] : '=');
+	}
+	return res;
+}
+
+// Returns false if input is not valid, padded base64
+inline bool base64_decode(std::string_view input, std::string& output)
+{
+	auto decode_char = [](char c) -> int {
+		if (c >= 'A' && c <= 'Z') return c - 'A';
+		if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+		if (c >= '0' && c <= '9') return c - '0' + 52;
+		if (c == '+') return 62;
+		if (c == '/') return 63;
+		return -1;
+	};
+	output.clear();
+	if (input.size() % 4 != 0) return false;
+	for (std::size_t i = 0; i < input.size(); i += 4)
+	{
+		bool last = i + 4 == input.size();
+		std::size_t padding = 0;
+		if (last && input[i + 3] == '=') padding = input[i + 2] == '=' ? 2 : 1;
+		std::uint32_t group = 0;
+		for (std::size_t j = 0; j < 4; ++j)
+		{
+			int v = j < 4 - padding ? decode_char(input[i + j]) : 0;
+			if (v < 0) return false;
+			group = (group << 6) | std::uint32_t(v);
+		}
+		output.push_back(char(group >> 16));
+		if (padding < 2) output.push_back(char((group >> 8) & 0xFF));
+		if (padding < 1) output.push_back(char(group & 0xFF));
+	}
+	return true;
+}
+
+inline bool hmac_sha256(const scram_digest& key, std::string_view data, scram_digest& output)
+{
+	unsigned int size = 0;
+	return HMAC(EVP_sha256(), key.data(), int(key.size()),
+		reinterpret_cast<const unsigned char*>(data.data()), data.size(), output.data(), &size) != nullptr;
+}
+
+// Gets the value of the attribute with the given name (e.g. 'r' for "r=value")
+// from a comma separated list of SCRAM attributes
+inline bool scram_attribute(std::string_view message, char name, std::string_view& output)
+{
+	while (!message.empty())
+	{
+		std::size_t end = message.find(',');
+		std::string_view attr = message.substr(0, end);
+		if (attr.size() >= 2 && attr[0] == name && attr[1] == '=')
+		{
+			output = attr.substr(2);
+			return true;
+		}
+		if (end == std::string_view::npos) break;
+		message.remove_prefix(end + 1);
+	}
+	return false;
+}
+
+}
+
+/**
+ * \brief Derives the SCRAM-SHA-256 keys for a password.
+ * \details Uses the cache, if not null, to avoid the derivation.
+ * Returns false if OpenSSL fails.
+ */
+inline bool derive_scram_keys(
+	std::string_view user,
+	std::string_view password,
+	std::string_view salt,
+	std::int32_t iterations,
+	scram_keys& output,
+	scram_key_cache* cache
+)
+{
+	std::string key;
+	if (cache)
+	{
+		key = scram_key_cache::make_key(user, password, salt, iterations);
+		if (cache->find(key, output)) return true;
+	}
+
+	scram_digest salted_password;
+	bool ok = PKCS5_PBKDF2_HMAC(password.data(), int(password.size()),
+			reinterpret_cast<const unsigned char*>(salt.data()), int(salt.size()),
+			iterations, EVP_sha256(), int(salted_password.size()), salted_password.data()) == 1 &&
+		detail::hmac_sha256(salted_password, "Client Key", output.client_key) &&
+		detail::hmac_sha256(salted_password, "Server Key", output.server_key);
+	OPENSSL_cleanse(salted_password.data(), salted_password.size());
+	if (ok && cache) cache->insert(std::move(key), output);
+	return ok;
+}
+
+/**
+ * \brief The client side of a SCRAM-SHA-256 exchange (RFC 5802 and 7677).
+ * \details Used by the handshake when the server requests SASL authentication.
+ * Channel binding (SCRAM-SHA-256-PLUS) is not supported. Passwords are used
+ * as given, without SASLprep normalization, which makes no difference for
+ * ASCII passwords. The user name is not sent, as the server uses the one in
+ * the startup message.
+ */
+class scram_client
+{
+	enum class state_t { initial, client_first_sent, client_final_sent, done };
+
+	state_t state_ {state_t::initial};
+	std::string client_nonce_;
+	std::string auth_message_;
+	scram_digest server_signature_ {};
+public:
+	static constexpr std::string_view mechanism = "SCRAM-SHA-256";
+
+	/// Whether mechanism is in the list sent by AuthenticationSASL (null-terminated names, then an empty one).
+	static bool is_offered(std::string_view mechanisms) noexcept
+	{
+		while (!mechanisms.empty() && mechanisms[0] != '\0')
+		{
+			std::size_t end = mechanisms.find('\0');
+			if (mechanisms.substr(0, end) == mechanism) return true;
+			if (end == std::string_view::npos) break;
+			mechanisms.remove_prefix(end + 1);
+		}
+		return false;
+	}
+
+	/// Whether the exchange has started but the server has not been verified yet.
+	bool in_progress() const noexcept { return state_ != state_t::initial && state_ != state_t::done; }
+
+	/// Generates the client-first-message, with a random nonce.
+	errc start(std::string& client_first)
+	{
+		std::uint8_t nonce [18];
+		if (RAND_bytes(nonce, sizeof(nonce)) != 1) return errc::crypto_error;
+		start(detail::base64_encode(nonce, sizeof(nonce)), std::string_view(), client_first);
+		return errc::ok;
+	}
+
+	/**
+	 * \brief Generates the client-first-message, with the given nonce and user name.
+	 * \details For reproducing known exchanges, like the one in RFC 7677.
+	 * The nonce must be printable ASCII, without commas. The server ignores
+	 * the user name in favor of the one in the startup message, so the
+	 * overload with a random nonce sends an empty one.
+	 */
+	void start(std::string_view client_nonce, std::string_view user, std::string& client_first)
+	{
+		client_nonce_ = client_nonce;
+		client_first = "n,,"; // no channel binding
+		std::size_t bare_begin = client_first.size();
+		client_first += "n=";
+		for (char c: user)
+		{
+			// Commas and equal signs are escaped (saslname in RFC 5802)
+			if (c == ',') client_first += "=2C";
+			else if (c == '=') client_first += "=3D";
+			else client_first += c;
+		}
+		client_first += ",r=";
+		client_first += client_nonce_;
+		auth_message_.assign(client_first, bare_begin);
+		state_ = state_t::client_first_sent;
+	}
+
+	/// Processes the server-first-message, generating the client-final-message.
+	errc process_server_first(
+		std::string_view server_first,
+		std::string_view user,
+		std::string_view password,
+		std::string& client_final,
+		scram_key_cache* cache = &scram_key_cache::global()
+	)
+	{
+		if (state_ != state_t::client_first_sent) return errc::unexpected_message;
+
+		// The nonce must extend ours. Mandatory extensions (m=) are not supported
+		std::string_view nonce, salt_b64, iterations_str, extension;
+		if (!detail::scram_attribute(server_first, 'r', nonce) ||
+			!detail::scram_attribute(server_first, 's', salt_b64) ||
+			!detail::scram_attribute(server_first, 'i', iterations_str) ||
+			detail::scram_attribute(server_first, 'm', extension) ||
+			nonce.size() <= client_nonce_.size() ||
+			nonce.substr(0, client_nonce_.size()) != client_nonce_)
+		{
+			return errc::protocol_value_error;
+		}
+		std::int32_t iterations = 0;
+		auto [ptr, ec] = std::from_chars(iterations_str.data(), iterations_str.data() + iterations_str.size(), iterations);
+		std::string salt;
+		if (ec != std::errc() || ptr != iterations_str.data() + iterations_str.size() || iterations <= 0 ||
+			!detail::base64_decode(salt_b64, salt) || salt.empty())
+		{
+			return errc::protocol_value_error;
+		}
+
+		scram_keys keys;
+		if (!derive_scram_keys(user, password, salt, iterations, keys, cache)) return errc::crypto_error;
+
+		// "biws" is base64 for "n,,", the GS2 header sent in the client-first-message
+		client_final = "c=biws,r=";
+		client_final += nonce;
+		auth_message_ += ',';
+		auth_message_ += server_first;
+		auth_message_ += ',';
+		auth_message_ += client_final;
+
+		scram_digest stored_key, client_signature, proof;
+		SHA256(keys.client_key.data(), keys.client_key.size(), stored_key.data());
+		if (!detail::hmac_sha256(stored_key, auth_message_, client_signature) ||
+			!detail::hmac_sha256(keys.server_key, auth_message_, server_signature_))
+		{
+			return errc::crypto_error;
+		}
+		for (std::size_t i = 0; i < proof.size(); ++i) proof[i] = keys.client_key[i] ^ client_signature[i];
+		client_final += ",p=";
+		client_final += detail::base64_encode(proof.data(), proof.size());
+		OPENSSL_cleanse(&keys, sizeof(keys));
+		state_ = state_t::client_final_sent;
+		return errc::ok;
+	}
+
+	/// Processes the server-final-message, verifying the server's signature.
+	errc process_server_final(std::string_view server_final)
+	{
+		if (state_ != state_t::client_final_sent) return errc::unexpected_message;
+		std::string_view signature_b64;
+		std::string signature;
+		if (!detail::scram_attribute(server_final, 'v', signature_b64) ||
+			!detail::base64_decode(signature_b64, signature) ||
+			signature.size() != server_signature_.size() ||
+			CRYPTO_memcmp(signature.data(), server_signature_.data(), signature.size()) != 0)
+		{
+			return errc::server_verification_failed;
+		}
+		state_ = state_t::done;
+		return errc::ok;
+	}
+};
+
+}
+
+#endif /* INCLUDE_PSQL_AUTH_SCRAM_H_ */
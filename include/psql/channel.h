@@ -2,65 +2,470 @@
 #define INCLUDE_PSQL_CHANNEL_H_
 
 #include "psql/serialization.h"
+#include "psql/messages.h"
+#include "psql/codec_registry.h"
+#include "psql/instrumentation.h"
+#include "psql/ssl.h"
 #include <boost/asio/write.hpp>
 #include <boost/asio/read.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/compose.hpp>
+#include <boost/asio/coroutine.hpp>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 namespace psql
 {
 
+using stats_clock = std::chrono::steady_clock;
+
+// Measures the time spent by a fetch operation decoding rows,
+// excluding the socket operations performed meanwhile
+class decode_timer
+{
+	connection_stats& stats_;
+	stats_clock::time_point start_;
+	std::chrono::nanoseconds io_start_;
+public:
+	explicit decode_timer(connection_stats& stats) noexcept:
+		stats_(stats), start_(stats_clock::now()), io_start_(stats.io_time) {}
+	decode_timer(const decode_timer&) = delete;
+	decode_timer& operator=(const decode_timer&) = delete;
+	~decode_timer()
+	{
+		stats_.decode_time += (stats_clock::now() - start_) - (stats_.io_time - io_start_);
+	}
+};
+
+// Stores the fields of an ErrorResponse in output, reusing its memory
+inline void parse_error_response(const message_view& msg, error_info& output)
+{
+	assert(msg.type == error_response_message_type);
+	output.assign_server_error(get_string(static_cast<const std::uint8_t*>(msg.body.data()), msg.body.size()));
+}
+
+inline void conditional_parse_error_response(const message_view& msg, error_info* output)
+{
+	if (output) parse_error_response(msg, *output);
+}
+
 template <typename AsyncStream>
 class channel
 {
+	static constexpr std::size_t header_size = 5; // type + length
+	static constexpr std::size_t initial_read_buffer_size = 16 * 1024;
+
 	AsyncStream& stream_;
- 	std::array<std::uint8_t, 5> header_buffer_ {}; // for async ops
-	bytestring shared_buff_; // for async ops
+	bool ssl_active_ {false}; // for SSL streams, whether TLS has been negotiated
+	bytestring shared_buff_; // outgoing messages not sent yet
+	std::vector<encoded_param> param_buff_; // parameters of the Bind message being enqueued
 
-	error_code process_header_read(std::uint32_t& size_to_read); // reads from header_buffer_
-	void process_header_write(std::uint32_t size_to_write); // writes to header_buffer_
-public:
-	channel(AsyncStream& stream): stream_(stream) {}
+	// Read-ahead buffer. Bytes in [read_first_, read_last_) have been
+	// received but not handed out yet.
+	bytestring read_buff_;
+	std::size_t read_first_ {0};
+	std::size_t read_last_ {0};
+
+	// Number of ReadyForQuery messages received. Each request ending in
+	// a Sync (or each simple query) produces exactly one
+	std::size_t ready_count_ {0};
+	std::uint8_t transaction_status_ {'I'}; // as reported by the last ReadyForQuery
+
+	// Requests enqueued whose ReadyForQuery hasn't been received yet
+	std::size_t pending_syncs_ {0};
+	bool unsynced_ {false}; // extended query messages have been enqueued without a Sync (e.g. by an open cursor)
+	bool broken_ {false}; // an I/O or framing error left the stream in an unknown state
+
+	// CloseComplete messages to be discarded, answering Close messages sent
+	// without waiting for a response (see enqueue_lazy_close())
+	std::size_t lazy_closes_ {0};
+
+	connection_stats stats_;
+	const codec_registry* codecs_ {&default_codec_registry()};
+	bool awaiting_response_ {false}; // data was sent, and no read has waited for the response yet
+
+	// Operations reported to the tracing hook, waiting for their ReadyForQuery
+	struct traced_operation
+	{
+		operation_type type;
+		std::string statement_name;
+		std::string sql;
+		bool failed;
+		operation_info info() const noexcept { return operation_info{type, statement_name, sql}; }
+	};
+	tracing_hook* hook_ {nullptr};
+	std::deque<traced_operation> traced_ops_;
+
+	struct read_message_op;
+	struct flush_op;
+	struct handle_error_response_op;
+	struct finish_response_op;
+
+	// Attempts to extract a complete message from the read buffer.
+	// If there is not enough data, returns false and sets required_size
+	// to the number of buffered bytes needed to complete the message.
+	// Responses to lazy closes and asynchronous messages (notices, parameter
+	// status changes and notifications) are skipped, so response parsers never see them.
+	// msg is only modified if a message is returned.
+	bool parse_buffered(message_view& msg, std::size_t& required_size, error_code& err)
+	{
+		message_view res;
+		while (parse_single(res, required_size, err))
+		{
+			if (res.type == close_complete::message_type && lazy_closes_ > 0)
+			{
+				--lazy_closes_;
+				continue;
+			}
+			if (is_async_message(res.type))
+			{
+				++stats_.async_messages_skipped;
+				continue;
+			}
+			msg = res;
+			return true;
+		}
+		return false;
+	}
+
+	void start_traced_operation(operation_type type, std::string_view statement_name, std::string_view sql)
+	{
+		traced_ops_.push_back(traced_operation{type, std::string(statement_name), std::string(sql), false});
+		hook_->on_operation_start(traced_ops_.back().info());
+	}
+
+	void end_traced_operation()
+	{
+		if (traced_ops_.empty()) return;
+		const auto& op = traced_ops_.front();
+		hook_->on_operation_end(op.info(), op.failed ? make_error_code(errc::server_error) : error_code());
+		traced_ops_.pop_front();
+	}
+
+	// Makes a server waiting for COPY data that won't come end the statement with an error
+	void enqueue_unexpected_copy_fail()
+	{
+		enqueue(copy_fail_message{
+			string_null("COPY FROM STDIN was not expected")
+		});
+	}
+
+	// The connection can't be used after a socket error, so no ReadyForQuery will come
+	void on_io_error(const error_code& err)
+	{
+		broken_ = true;
+		if (!hook_) return;
+		for (const auto& op: traced_ops_) hook_->on_operation_end(op.info(), err);
+		traced_ops_.clear();
+	}
+
+	void on_write_start() noexcept
+	{
+		++stats_.write_calls;
+		stats_.bytes_sent += shared_buff_.size();
+		awaiting_response_ = true;
+	}
+
+	void on_read_start() noexcept
+	{
+		++stats_.read_calls;
+		if (awaiting_response_)
+		{
+			++stats_.round_trips;
+			awaiting_response_ = false;
+		}
+	}
+
+	void on_io_end(stats_clock::time_point start) noexcept
+	{
+		stats_.io_time += stats_clock::now() - start;
+	}
 
-	void read(bytestring& buffer, std::uint8_t& msg_type)
+	// Calls op with the stream to perform I/O on. SSL streams are bypassed
+	// until TLS is negotiated, as the SSLRequest exchange is unencrypted
+	template <typename Op>
+	decltype(auto) with_io_layer(Op&& op)
 	{
-		boost::asio::read(stream_, boost::asio::buffer(header_buffer_));
-		deserialization_context ctx (boost::asio::buffer(header_buffer_));
-		auto err = deserialize(msg_type, ctx);
-		assert(err == errc::ok);
+		if constexpr (is_ssl_stream<AsyncStream>::value)
+		{
+			if (!ssl_active_) return op(stream_.next_layer());
+		}
+		return op(stream_);
+	}
+
+	std::size_t read_some(error_code& err)
+	{
+		on_read_start();
+		auto start = stats_clock::now();
+		std::size_t res = with_io_layer([&](auto& stream) { return stream.read_some(read_free_space(), err); });
+		on_io_end(start);
+		stats_.bytes_received += res;
+		if (err) on_io_error(err);
+		return res;
+	}
+
+	bool parse_single(message_view& msg, std::size_t& required_size, error_code& err)
+	{
+		std::size_t available = read_last_ - read_first_;
+		if (available < header_size)
+		{
+			required_size = header_size;
+			return false;
+		}
+		deserialization_context ctx (read_buff_.data() + read_first_, read_buff_.data() + read_last_);
+		std::uint8_t msg_type = 0;
 		std::int32_t size = 0;
-		err = deserialize(size, ctx);
-		assert(err == errc::ok);
-		buffer.resize(size - 4);
-		boost::asio::read(stream_, boost::asio::buffer(buffer, buffer.size()));
+		deserialize(msg_type, ctx);
+		deserialize(size, ctx);
+		if (size < 4)
+		{
+			broken_ = true;
+			err = make_error_code(errc::protocol_value_error);
+			return false;
+		}
+		std::size_t total_size = std::size_t(size) + 1;
+		if (available < total_size)
+		{
+			required_size = total_size;
+			return false;
+		}
+		msg.type = msg_type;
+		msg.body = boost::asio::buffer(read_buff_.data() + read_first_ + header_size, total_size - header_size);
+		read_first_ += total_size;
+		++stats_.messages_received;
+		if (msg_type == ready_for_query_message::message_type)
+		{
+			++ready_count_;
+			if (pending_syncs_ > 0) --pending_syncs_;
+			if (total_size > header_size) transaction_status_ = read_buff_[read_first_ - total_size + header_size];
+			if (hook_) end_traced_operation();
+		}
+		else if (msg_type == error_response_message_type && hook_ && !traced_ops_.empty())
+		{
+			traced_ops_.front().failed = true;
+		}
+		return true;
+	}
+
+	// Makes room for a message of required_size bytes starting at read_first_.
+	// Only moves memory when the free space at the end of the buffer is not enough.
+	void prepare_read(std::size_t required_size)
+	{
+		if (read_first_ == read_last_)
+		{
+			read_first_ = read_last_ = 0;
+		}
+		if (read_buff_.size() - read_first_ < required_size)
+		{
+			std::size_t pending = read_last_ - read_first_;
+			std::memmove(read_buff_.data(), read_buff_.data() + read_first_, pending);
+			read_first_ = 0;
+			read_last_ = pending;
+		}
+		if (read_buff_.size() < required_size)
+		{
+			read_buff_.resize(std::max(required_size, read_buff_.size() * 2));
+		}
 	}
 
+	boost::asio::mutable_buffer read_free_space() noexcept
+	{
+		return boost::asio::buffer(read_buff_.data() + read_last_, read_buff_.size() - read_last_);
+	}
+public:
+	channel(AsyncStream& stream): stream_(stream), read_buff_(initial_read_buffer_size) {}
 
-	template <typename Message>
-	void read(Message& msg)
+	/**
+	 * \brief Reads a single message.
+	 * \details Reads as much as the stream has available, so subsequent
+	 * calls may be served from memory without performing any I/O.
+	 * The returned view is valid until the next read operation.
+	 * Any pending enqueued message is sent before reading.
+	 */
+	message_view read_message(error_code& err)
+	{
+		message_view res;
+		flush(err);
+		if (err) return res;
+		std::size_t required_size = 0;
+		while (!parse_buffered(res, required_size, err))
+		{
+			if (err) return res;
+			prepare_read(required_size);
+			read_last_ += read_some(err);
+			if (err) return res;
+		}
+		return res;
+	}
+
+	/**
+	 * \brief Reads a message of the expected type.
+	 * \details If the server sends an error instead, it is handled as
+	 * by handle_error_response(). Other types are errc::unexpected_message.
+	 */
+	message_view read_message(std::uint8_t expected_type, error_code& err, error_info& info)
+	{
+		message_view res = read_message(err);
+		if (!err) check_message_type(res, expected_type, err, info);
+		return res;
+	}
+
+	/**
+	 * \brief Extracts a message from the read buffer, without performing any I/O.
+	 * \details Returns false, leaving msg unchanged, if no complete message
+	 * has been received yet. Pending enqueued messages are not sent. The returned view is valid
+	 * until the next read operation.
+	 */
+	bool read_buffered_message(message_view& msg, error_code& err)
+	{
+		std::size_t required_size = 0;
+		return parse_buffered(msg, required_size, err);
+	}
+
+	/**
+	 * \brief Reads a single message (async version).
+	 * \details The handler signature is void(error_code, message_view).
+	 * The message view is valid until the next read operation.
+	 */
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, message_view))
+	async_read_message(CompletionToken&& token)
+	{
+		return boost::asio::async_compose<CompletionToken, void(error_code, message_view)>(
+			read_message_op{*this}, token, stream_);
+	}
+
+	/**
+	 * \brief Handles an ErrorResponse received in the middle of an operation (async version).
+	 * \details Discards the rest of the response until the server is ready
+	 * for a new query, and completes with errc::server_error. The handler
+	 * signature is void(error_code). The server message is stored in info, if not nullptr.
+	 */
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code))
+	async_handle_error_response(const message_view& msg, error_info* info, CompletionToken&& token)
+	{
+		conditional_parse_error_response(msg, info);
+		return boost::asio::async_compose<CompletionToken, void(error_code)>(
+			handle_error_response_op{*this, errc::server_error}, token, stream_);
+	}
+
+	/// Discards messages until (and including) the next ReadyForQuery.
+	void read_until_ready(error_code& err)
+	{
+		while (read_message(err).type != ready_for_query_message::message_type && !err)
+		{
+		}
+	}
+
+	/**
+	 * \brief Discards the rest of a response, until (and including) the next ReadyForQuery.
+	 * \details Used once the result of interest has been read. A simple query
+	 * with several statements may have further results, which are skipped.
+	 * If any of them is an error, it is reported.
+	 */
+	void finish_response(error_code& err, error_info& info)
 	{
-		read(msg, shared_buff_);
+		for (auto msg = read_message(err); !err; msg = read_message(err))
+		{
+			if (msg.type == ready_for_query_message::message_type) break;
+			if (msg.type == error_response_message_type)
+			{
+				handle_error_response(msg, err, info);
+				break;
+			}
+		}
 	}
 
+	/// Discards the rest of a response (async version). The handler signature is void(error_code).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code))
+	async_finish_response(error_info* info, CompletionToken&& token)
+	{
+		return boost::asio::async_compose<CompletionToken, void(error_code)>(
+			finish_response_op{*this, info}, token, stream_);
+	}
+
+	/**
+	 * \brief Handles an ErrorResponse received in the middle of an operation.
+	 * \details Stores the server's error in info, and discards the rest of the
+	 * response until the server is ready for a new query, so the connection
+	 * remains usable. Sets err to errc::server_error, or to the error that
+	 * prevented reaching the end of the response.
+	 */
+	void handle_error_response(const message_view& msg, error_code& err, error_info& info)
+	{
+		parse_error_response(msg, info);
+		read_until_ready(err);
+		if (!err) err = make_error_code(errc::server_error);
+	}
+
+	/**
+	 * \brief Discards a response that is not the kind an operation expected.
+	 * \details msg is the first message of the response (e.g. a RowDescription,
+	 * when a COPY was expected). The rest is discarded until the server is ready
+	 * for a new query, so the connection remains usable. A server waiting for
+	 * COPY data is sent a CopyFail first. Sets err to errc::unexpected_message,
+	 * or to the error that prevented reaching the end of the response.
+	 */
+	void discard_unexpected_response(const message_view& msg, error_code& err)
+	{
+		if (msg.type == copy_in_response_message::message_type) enqueue_unexpected_copy_fail();
+		read_until_ready(err);
+		if (!err) err = make_error_code(errc::unexpected_message);
+	}
+
+	/// Discards a response that is not the kind an operation expected (async version).
+	/// The handler signature is void(error_code).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code))
+	async_discard_unexpected_response(const message_view& msg, CompletionToken&& token)
+	{
+		if (msg.type == copy_in_response_message::message_type) enqueue_unexpected_copy_fail();
+		return boost::asio::async_compose<CompletionToken, void(error_code)>(
+			handle_error_response_op{*this, errc::unexpected_message}, token, stream_);
+	}
+
+	/// Checks that msg is of the expected type, handling server errors. Returns false if it isn't.
+	bool check_message_type(const message_view& msg, std::uint8_t expected_type, error_code& err, error_info& info)
+	{
+		if (msg.type == expected_type) return true;
+		if (msg.type == error_response_message_type) handle_error_response(msg, err, info);
+		else err = make_error_code(errc::unexpected_message);
+		return false;
+	}
+
+	/// Reads and deserializes a message of the expected type.
 	template <typename Message>
-	void read(Message& msg, bytestring& buffer)
+	void read(Message& msg, error_code& err, error_info& info)
 	{
-		std::uint8_t msg_type = 0;
-		read(buffer, msg_type);
-		if (msg_type != Message::message_type) throw std::runtime_error("Unexpected msg type");
-		deserialization_context ctx (boost::asio::buffer(buffer));
-		auto err = deserialize_message(msg, ctx);
-		check_error_code(err, error_info());
+		auto view = read_message(Message::message_type, err, info);
+		if (err) return;
+		deserialization_context ctx (view.body);
+		err = deserialize_message(msg, ctx);
 	}
 
+	/**
+	 * \brief Serializes a message into the outgoing buffer, without sending it.
+	 * \details Any number of messages may be enqueued. They are sent
+	 * together, using a single write, by flush() or the next
+	 * read operation.
+	 */
 	template <typename Message>
-	void write(const Message& msg, bool write_msg_type=true)
+	void enqueue(const Message& msg, bool write_msg_type=true)
 	{
 		serialization_context ctx;
 
 		std::size_t effective_size = 4 + get_size(msg, ctx);
-		std::size_t buffer_size = effective_size +  (write_msg_type ? 1 : 0);
+		std::size_t message_size = effective_size +  (write_msg_type ? 1 : 0);
 
-		shared_buff_.resize(buffer_size);
-		ctx.set_first(shared_buff_.data());
+		std::size_t old_size = shared_buff_.size();
+		shared_buff_.resize(old_size + message_size);
+		ctx.set_first(shared_buff_.data() + old_size);
 
 		if (write_msg_type)
 		{
@@ -68,15 +473,298 @@ public:
 		}
 		serialize(std::uint32_t(effective_size), ctx);
 		serialize(msg, ctx);
+		on_message_framed();
+		if constexpr (
+			std::is_same_v<Message, sync_message> ||
+			std::is_same_v<Message, query_message> ||
+			std::is_same_v<Message, startup_message>
+		)
+		{
+			++pending_syncs_;
+			unsynced_ = false;
+		}
+		else if constexpr (is_extended_query_message(Message::message_type))
+		{
+			unsynced_ = true;
+		}
+	}
+
+	/// Sends all enqueued messages with a single write.
+	void flush(error_code& err)
+	{
+		if (!shared_buff_.empty())
+		{
+			on_write_start();
+			auto start = stats_clock::now();
+			with_io_layer([&](auto& stream) { boost::asio::write(stream, boost::asio::buffer(shared_buff_), err); });
+			on_io_end(start);
+			shared_buff_.clear();
+			if (err) on_io_error(err);
+		}
+	}
+
+	/// Sends all enqueued messages with a single write (async version).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code))
+	async_flush(CompletionToken&& token)
+	{
+		return boost::asio::async_compose<CompletionToken, void(error_code)>(
+			flush_op{*this}, token, stream_);
+	}
+
+	bool has_pending_writes() const noexcept { return !shared_buff_.empty(); }
+
+
+	/**
+	 * \brief Enqueues a Close message whose response is discarded.
+	 * \details The Close is sent with the next request, so closing
+	 * doesn't cost a round trip.
+	 */
+	void enqueue_lazy_close(std::uint8_t type, std::string_view name)
+	{
+		bool unsynced = unsynced_; // the Close goes with the next request's Sync
+		enqueue(close_message{
+			type,
+			string_null(name)
+		});
+		unsynced_ = unsynced;
+		++lazy_closes_;
+	}
+
+	/// The number of ReadyForQuery messages received so far.
+	std::size_t ready_count() const noexcept { return ready_count_; }
+
+	/// The transaction status reported by the last ReadyForQuery.
+	std::uint8_t transaction_status() const noexcept { return transaction_status_; }
+
+	/// The number of requests (Syncs, simple queries and the startup) whose ReadyForQuery hasn't been received yet.
+	std::size_t pending_syncs() const noexcept { return pending_syncs_; }
+
+	/// Whether extended query messages have been enqueued without a Sync after them, as an open cursor does.
+	bool unsynced() const noexcept { return unsynced_; }
+
+	/// Whether an I/O or framing error occurred. The connection can't be used anymore.
+	bool broken() const noexcept { return broken_; }
+
+	/// Counters describing the work done so far.
+	const connection_stats& stats() const noexcept { return stats_; }
+	connection_stats& stats() noexcept { return stats_; }
+
+	/// The registry that resolves the decoders of the fields received.
+	const codec_registry& codecs() const noexcept { return *codecs_; }
+
+	/// Sets the registry returned by codecs(). It is not owned, and must outlive the channel.
+	void set_codecs(const codec_registry& registry) noexcept { codecs_ = &registry; }
+
+	/**
+	 * \brief Installs a hook notified of the operations performed, or removes it if nullptr.
+	 * \details The hook is not owned, and must outlive the channel or be removed.
+	 * Must not be called while an operation is in progress.
+	 */
+	void set_tracing_hook(tracing_hook* hook) noexcept
+	{
+		hook_ = hook;
+		traced_ops_.clear();
+	}
 
-		boost::asio::write(stream_, boost::asio::buffer(shared_buff_));
+	/**
+	 * \brief Notifies the tracing hook, if any, that a request is being queued.
+	 * \details Must be called once per request that ends with a ReadyForQuery
+	 * (i.e. ends with a Sync or is a simple query), before enqueueing it.
+	 */
+	void begin_operation(operation_type type, std::string_view statement_name = {}, std::string_view sql = {})
+	{
+		if (hook_) start_traced_operation(type, statement_name, sql);
 	}
 
+	/// For SSL streams, whether I/O goes through TLS. Set by the handshake once negotiated.
+	bool ssl_active() const noexcept { return ssl_active_; }
+	void set_ssl_active(bool value) noexcept { ssl_active_ = value; }
+
 	using stream_type = AsyncStream;
 	stream_type& next_layer() { return stream_; }
 
 	const bytestring& shared_buffer() const noexcept { return shared_buff_; }
 	bytestring& shared_buffer() noexcept { return shared_buff_; }
+
+	// Accounts for a complete message in shared_buffer(). Called by enqueue(), and
+	// by code that frames messages in the buffer itself, as COPY does with CopyData
+	void on_message_framed() noexcept { ++stats_.messages_sent; }
+
+	// Scratch for bind_message, so parameters are encoded once without allocating
+	std::vector<encoded_param>& param_buffer() noexcept { return param_buff_; }
+};
+
+// Async operation implementations
+template <typename AsyncStream>
+struct channel<AsyncStream>::flush_op : boost::asio::coroutine
+{
+	channel<AsyncStream>& chan_;
+	stats_clock::time_point io_start_;
+
+	flush_op(channel<AsyncStream>& chan) noexcept: chan_(chan) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, std::size_t = 0)
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			if (chan_.shared_buff_.empty())
+			{
+				BOOST_ASIO_CORO_YIELD boost::asio::post(chan_.stream_.get_executor(), std::move(self));
+			}
+			else
+			{
+				chan_.on_write_start();
+				io_start_ = stats_clock::now();
+				BOOST_ASIO_CORO_YIELD chan_.with_io_layer([&](auto& stream) {
+					boost::asio::async_write(stream, boost::asio::buffer(chan_.shared_buff_), std::move(self));
+				});
+				chan_.on_io_end(io_start_);
+				chan_.shared_buff_.clear();
+				if (err) chan_.on_io_error(err);
+			}
+			self.complete(err);
+		}
+	}
+};
+
+template <typename AsyncStream>
+struct channel<AsyncStream>::read_message_op : boost::asio::coroutine
+{
+	channel<AsyncStream>& chan_;
+	message_view msg_;
+	bool has_performed_io_ {false};
+	stats_clock::time_point io_start_;
+
+	read_message_op(channel<AsyncStream>& chan) noexcept: chan_(chan) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, std::size_t bytes_transferred = 0)
+	{
+		std::size_t required_size = 0;
+
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			// Send any pending message first
+			if (!chan_.shared_buff_.empty())
+			{
+				has_performed_io_ = true;
+				chan_.on_write_start();
+				io_start_ = stats_clock::now();
+				BOOST_ASIO_CORO_YIELD chan_.with_io_layer([&](auto& stream) {
+					boost::asio::async_write(stream, boost::asio::buffer(chan_.shared_buff_), std::move(self));
+				});
+				chan_.on_io_end(io_start_);
+				chan_.shared_buff_.clear();
+				if (err)
+				{
+					chan_.on_io_error(err);
+					self.complete(err, message_view());
+					BOOST_ASIO_CORO_YIELD break;
+				}
+			}
+
+			// Read until we have a complete message
+			while (!chan_.parse_buffered(msg_, required_size, err))
+			{
+				if (err)
+				{
+					self.complete(err, message_view());
+					BOOST_ASIO_CORO_YIELD break;
+				}
+				chan_.prepare_read(required_size);
+				has_performed_io_ = true;
+				chan_.on_read_start();
+				io_start_ = stats_clock::now();
+				BOOST_ASIO_CORO_YIELD chan_.with_io_layer([&](auto& stream) {
+					stream.async_read_some(chan_.read_free_space(), std::move(self));
+				});
+				chan_.on_io_end(io_start_);
+				chan_.stats_.bytes_received += bytes_transferred;
+				if (err)
+				{
+					chan_.on_io_error(err);
+					self.complete(err, message_view());
+					BOOST_ASIO_CORO_YIELD break;
+				}
+				chan_.read_last_ += bytes_transferred;
+			}
+
+			// The message was already in the buffer. Don't call the handler
+			// from within the initiating function
+			if (!has_performed_io_)
+			{
+				BOOST_ASIO_CORO_YIELD boost::asio::post(chan_.stream_.get_executor(), std::move(self));
+			}
+
+			self.complete(error_code(), msg_);
+		}
+	}
+};
+
+template <typename AsyncStream>
+struct channel<AsyncStream>::handle_error_response_op : boost::asio::coroutine
+{
+	channel<AsyncStream>& chan_;
+	errc result_; // reported once the server is ready
+
+	handle_error_response_op(channel<AsyncStream>& chan, errc result) noexcept: chan_(chan), result_(result) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			do
+			{
+				BOOST_ASIO_CORO_YIELD chan_.async_read_message(std::move(self));
+				if (err)
+				{
+					self.complete(err);
+					BOOST_ASIO_CORO_YIELD break;
+				}
+			} while (msg.type != ready_for_query_message::message_type);
+			self.complete(make_error_code(result_));
+		}
+	}
+};
+
+template <typename AsyncStream>
+struct channel<AsyncStream>::finish_response_op : boost::asio::coroutine
+{
+	channel<AsyncStream>& chan_;
+	error_info* info_;
+
+	finish_response_op(channel<AsyncStream>& chan, error_info* info) noexcept: chan_(chan), info_(info) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			// Messages that have already been received are
+			// discarded without going through the executor
+			do
+			{
+				BOOST_ASIO_CORO_YIELD chan_.async_read_message(std::move(self));
+				while (!err &&
+					msg.type != ready_for_query_message::message_type &&
+					msg.type != error_response_message_type &&
+					chan_.read_buffered_message(msg, err))
+				{
+				}
+			} while (!err &&
+				msg.type != ready_for_query_message::message_type &&
+				msg.type != error_response_message_type);
+
+			if (!err && msg.type == error_response_message_type)
+			{
+				BOOST_ASIO_CORO_YIELD chan_.async_handle_error_response(msg, info_, std::move(self));
+			}
+			self.complete(err);
+		}
+	}
 };
 
 }
@@ -0,0 +1,110 @@
+#ifndef INCLUDE_PSQL_CODEC_REGISTRY_H_
+#define INCLUDE_PSQL_CODEC_REGISTRY_H_
+
+#include "psql/codecs.h"
+#include <map>
+#include <utility>
+
+namespace psql
+{
+
+/// Decodes a single non-NULL field. Strings may point into from.
+using value_decoder = errc(*)(std::string_view from, value& output) noexcept;
+
+/**
+ * \brief Maps type OIDs and formats to the functions that decode them.
+ * \details A default constructed registry knows all built-in types.
+ * Applications may add decoders for their own types (e.g. extension types,
+ * which have no fixed OID), or replace the built-in ones. Decoders are looked up
+ * once per field when a resultset's metadata is received, not once per value.
+ */
+class codec_registry
+{
+	std::map<std::pair<std::int32_t, std::int16_t>, value_decoder> decoders_;
+
+	void add_builtin(std::int32_t type_oid, value_decoder text, value_decoder binary)
+	{
+		add(type_oid, text_format, text);
+		add(type_oid, binary_format, binary);
+	}
+public:
+	codec_registry()
+	{
+		add_builtin(bool_oid, &decode_text_bool, &decode_binary_int<std::uint8_t, std::int32_t>);
+		add_builtin(int2_oid, &decode_text_number<std::int32_t>, &decode_binary_int<std::int16_t, std::int32_t>);
+		add_builtin(int4_oid, &decode_text_number<std::int32_t>, &decode_binary_int<std::int32_t>);
+		add_builtin(int8_oid, &decode_text_number<std::int64_t>, &decode_binary_int<std::int64_t>);
+		add_builtin(oid_oid, &decode_text_number<std::uint32_t>, &decode_binary_int<std::uint32_t>);
+		add_builtin(float4_oid, &decode_text_number<float>, &decode_binary_float<float, std::uint32_t>);
+		add_builtin(float8_oid, &decode_text_number<double>, &decode_binary_float<double, std::uint64_t>);
+		add_builtin(date_oid, &decode_text_date, &decode_binary_date);
+		add_builtin(time_oid, &decode_text_time, &decode_binary_time);
+		add_builtin(timestamp_oid, &decode_text_timestamp, &decode_binary_datetime);
+		add_builtin(timestamptz_oid, &decode_text_timestamptz, &decode_binary_datetime);
+		// bytea values are strings as received: the escaped text form (e.g. \x0102),
+		// or the raw bytes in binary format, which is only received in binary COPY data
+		for (std::int32_t type_oid: {bytea_oid, char_oid, name_oid, text_oid, json_oid, bpchar_oid, varchar_oid})
+		{
+			add_builtin(type_oid, &decode_string, &decode_string);
+		}
+	}
+
+	/// Registers the decoder for a type in a format, replacing any previous one.
+	void add(std::int32_t type_oid, std::int16_t format, value_decoder decoder)
+	{
+		decoders_[{type_oid, format}] = decoder;
+	}
+
+	/// The decoder registered for a type in a format, or nullptr.
+	value_decoder find(std::int32_t type_oid, std::int16_t format) const noexcept
+	{
+		auto it = decoders_.find({type_oid, format});
+		return it == decoders_.end() ? nullptr : it->second;
+	}
+
+	/**
+	 * \brief The decoder to use for a field.
+	 * \details Unregistered types are returned as their text representation
+	 * in text format. In binary format, decoding them fails with errc::unsupported_type.
+	 */
+	value_decoder get_decoder(std::int32_t type_oid, std::int16_t format) const noexcept
+	{
+		value_decoder res = find(type_oid, format);
+		if (res) return res;
+		return format == text_format ? &decode_string : &decode_unsupported;
+	}
+
+	/// Whether values of the given type can be decoded in binary format.
+	bool is_binary_supported(std::int32_t type_oid) const noexcept
+	{
+		return find(type_oid, binary_format) != nullptr;
+	}
+};
+
+/**
+ * \brief The registry used by connections, unless they're given another one.
+ * \details Custom decoders should be added before connecting, as
+ * the registry must not be modified while it's being used.
+ * See connection::set_codec_registry().
+ */
+inline codec_registry& default_codec_registry()
+{
+	static codec_registry res;
+	return res;
+}
+
+/**
+ * \brief Whether decoder was registered by the application for a type and format.
+ * \details That is, whether it differs from the decoder a default constructed
+ * registry would use. Typed rows and record batches decode built-in types
+ * directly, and only use the registry for types decoded by such decoders.
+ */
+inline bool is_custom_decoder(std::int32_t type_oid, std::int16_t format, value_decoder decoder)
+{
+	static const codec_registry builtins;
+	return builtins.get_decoder(type_oid, format) != decoder;
+}
+
+}
+
+#endif /* INCLUDE_PSQL_CODEC_REGISTRY_H_ */
@@ -0,0 +1,643 @@
+#ifndef INCLUDE_PSQL_CODECS_H_
+#define INCLUDE_PSQL_CODECS_H_
+
+#include "psql/oids.h"
+#include "psql/value.h"
+#include "psql/error.h"
+#include <boost/endian/conversion.hpp>
+#include <charconv>
+#include <cstring>
+#include <array>
+#include <limits>
+
+// Decoding and encoding of single field values, in text and binary format
+
+namespace psql
+{
+
+// PostgreSQL dates and timestamps count from 2000-01-01
+constexpr ::date::days postgres_epoch_offset {10957};
+
+// Binary format. Values are in network byte order
+template <typename T>
+errc read_big_endian(std::string_view from, T& output) noexcept
+{
+	if (from.size() != sizeof(T)) return errc::protocol_value_error;
+	std::memcpy(&output, from.data(), sizeof(T));
+	boost::endian::big_to_native_inplace(output);
+	return errc::ok;
+}
+
+// Bit representation of floating point values, to be sent as integers
+inline std::uint32_t float_bits(float v) noexcept
+{
+	std::uint32_t res;
+	std::memcpy(&res, &v, sizeof(res));
+	return res;
+}
+
+inline std::uint64_t float_bits(double v) noexcept
+{
+	std::uint64_t res;
+	std::memcpy(&res, &v, sizeof(res));
+	return res;
+}
+
+template <typename Float, typename Int>
+errc read_big_endian_float(std::string_view from, Float& output) noexcept
+{
+	static_assert(sizeof(Float) == sizeof(Int));
+	Int bits = 0;
+	auto err = read_big_endian(from, bits);
+	std::memcpy(&output, &bits, sizeof(Float));
+	return err;
+}
+
+// Reads a number with the given wire type and converts it to T
+template <typename Wire, typename T=Wire>
+errc read_binary_number(std::string_view from, T& output) noexcept
+{
+	Wire v {};
+	errc err;
+	if constexpr (std::is_same_v<Wire, float>) err = read_big_endian_float<float, std::uint32_t>(from, v);
+	else if constexpr (std::is_same_v<Wire, double>) err = read_big_endian_float<double, std::uint64_t>(from, v);
+	else err = read_big_endian(from, v);
+	output = T(v);
+	return err;
+}
+
+// Dates and timestamps count from postgres_epoch_offset. infinity and -infinity
+// are sent as the extreme values of the wire type, and map to the extreme values
+// of date and datetime. They are checked before adding the offset, which would overflow
+inline errc read_binary_date(std::string_view from, date& output) noexcept
+{
+	using lims = std::numeric_limits<std::int32_t>;
+	std::int32_t days = 0;
+	auto err = read_big_endian(from, days);
+	if (err != errc::ok) return err;
+	if (days > lims::max() - postgres_epoch_offset.count()) output = date::max();
+	else if (days == lims::min()) output = date::min();
+	else output = date(::date::days(days) + postgres_epoch_offset);
+	return errc::ok;
+}
+
+inline errc read_binary_datetime(std::string_view from, datetime& output) noexcept
+{
+	using lims = std::numeric_limits<std::int64_t>;
+	constexpr std::int64_t offset = std::chrono::microseconds(postgres_epoch_offset).count();
+	std::int64_t us = 0;
+	auto err = read_big_endian(from, us);
+	if (err != errc::ok) return err;
+	if (us > lims::max() - offset) output = datetime::max();
+	else if (us == lims::min()) output = datetime::min();
+	else output = datetime(std::chrono::microseconds(us + offset));
+	return errc::ok;
+}
+
+inline errc read_binary_time(std::string_view from, time& output) noexcept
+{
+	std::int64_t us = 0;
+	auto err = read_big_endian(from, us);
+	output = time(us);
+	return err;
+}
+
+// The inverse of read_binary_date and read_binary_datetime. Values that can't
+// be represented once the offset is subtracted are sent as infinity or -infinity
+inline std::int32_t to_binary_date(date d) noexcept
+{
+	using lims = std::numeric_limits<std::int32_t>;
+	constexpr std::int64_t offset = postgres_epoch_offset.count();
+	std::int64_t days = d.time_since_epoch().count();
+	if (d == date::max() || days >= lims::max() + offset) return lims::max();
+	if (days <= lims::min() + offset) return lims::min();
+	return std::int32_t(days - offset);
+}
+
+inline std::int64_t to_binary_datetime(datetime dt) noexcept
+{
+	using lims = std::numeric_limits<std::int64_t>;
+	constexpr std::int64_t offset = std::chrono::microseconds(postgres_epoch_offset).count();
+	std::int64_t us = dt.time_since_epoch().count();
+	if (dt == datetime::max()) return lims::max();
+	if (us < lims::min() + offset) return lims::min();
+	return us - offset;
+}
+
+// Reads a value with the given wire type (Int) and stores it as Output
+template <typename Int, typename Output=Int>
+errc decode_binary_int(std::string_view from, value& output) noexcept
+{
+	Output v {};
+	auto err = read_binary_number<Int, Output>(from, v);
+	output = v;
+	return err;
+}
+
+template <typename Float, typename Int>
+errc decode_binary_float(std::string_view from, value& output) noexcept
+{
+	static_assert(sizeof(Float) == sizeof(Int));
+	Float v {};
+	auto err = read_binary_number<Float>(from, v);
+	output = v;
+	return err;
+}
+
+inline errc decode_binary_date(std::string_view from, value& output) noexcept
+{
+	date d;
+	auto err = read_binary_date(from, d);
+	output = d;
+	return err;
+}
+
+// timestamptz is always sent in UTC
+inline errc decode_binary_datetime(std::string_view from, value& output) noexcept
+{
+	datetime dt;
+	auto err = read_binary_datetime(from, dt);
+	output = dt;
+	return err;
+}
+
+inline errc decode_binary_time(std::string_view from, value& output) noexcept
+{
+	time t;
+	auto err = read_binary_time(from, t);
+	output = t;
+	return err;
+}
+
+// Strings in any format, and the text representation of types
+// without a more specific one. The value points into the message
+inline errc decode_string(std::string_view from, value& output) noexcept
+{
+	output = from;
+	return errc::ok;
+}
+
+// Types without a known binary representation
+inline errc decode_unsupported(std::string_view, value&) noexcept
+{
+	return errc::unsupported_type;
+}
+
+// Text format
+template <typename T>
+errc parse_text_number(std::string_view from, T& output) noexcept
+{
+	const char* last = from.data() + from.size();
+	auto res = std::from_chars(from.data(), last, output);
+	if (res.ec != std::errc() || res.ptr != last) return errc::protocol_value_error;
+	return errc::ok;
+}
+
+template <typename T, typename Output=T>
+errc decode_text_number(std::string_view from, value& output) noexcept
+{
+	T v {};
+	auto err = parse_text_number(from, v);
+	output = Output(v);
+	return err;
+}
+
+// Consumes exactly num_digits decimal digits from the beginning of from
+inline bool consume_digits(std::string_view& from, std::size_t num_digits, int& output) noexcept
+{
+	if (from.size() < num_digits) return false;
+	output = 0;
+	for (std::size_t i = 0; i < num_digits; ++i)
+	{
+		char c = from[i];
+		if (c < '0' || c > '9') return false;
+		output = output * 10 + (c - '0');
+	}
+	from.remove_prefix(num_digits);
+	return true;
+}
+
+inline bool consume_char(std::string_view& from, char c) noexcept
+{
+	if (from.empty() || from.front() != c) return false;
+	from.remove_prefix(1);
+	return true;
+}
+
+// YYYY-MM-DD (ISO DateStyle, the default). Years may have more than 4 digits
+inline bool consume_date(std::string_view& from, date& output) noexcept
+{
+	std::size_t year_digits = from.find('-');
+	int year = 0, month = 0, day = 0;
+	if (year_digits < 4 || year_digits == std::string_view::npos) return false;
+	if (!consume_digits(from, year_digits, year) || !consume_char(from, '-') ||
+		!consume_digits(from, 2, month) || !consume_char(from, '-') ||
+		!consume_digits(from, 2, day))
+	{
+		return false;
+	}
+	::date::year_month_day ymd {::date::year{year}, ::date::month(unsigned(month)), ::date::day(unsigned(day))};
+	if (!ymd.ok()) return false;
+	output = date(ymd);
+	return true;
+}
+
+// HH:MM:SS[.ffffff]
+inline bool consume_time(std::string_view& from, time& output) noexcept
+{
+	int hours = 0, minutes = 0, seconds = 0, micros = 0;
+	if (!consume_digits(from, 2, hours) || !consume_char(from, ':') ||
+		!consume_digits(from, 2, minutes) || !consume_char(from, ':') ||
+		!consume_digits(from, 2, seconds))
+	{
+		return false;
+	}
+	if (consume_char(from, '.'))
+	{
+		std::size_t num_digits = 0;
+		while (num_digits < from.size() && num_digits < 6 && from[num_digits] >= '0' && from[num_digits] <= '9')
+			++num_digits;
+		if (num_digits == 0 || !consume_digits(from, num_digits, micros)) return false;
+		for (std::size_t i = num_digits; i < 6; ++i) micros *= 10;
+	}
+	output = std::chrono::hours(hours) + std::chrono::minutes(minutes) +
+		std::chrono::seconds(seconds) + std::chrono::microseconds(micros);
+	return true;
+}
+
+// +HH[:MM[:SS]] or -HH[:MM[:SS]]
+inline bool consume_utc_offset(std::string_view& from, std::chrono::seconds& output) noexcept
+{
+	if (from.empty() || (from.front() != '+' && from.front() != '-')) return false;
+	bool negative = from.front() == '-';
+	from.remove_prefix(1);
+	int hours = 0, minutes = 0, seconds = 0;
+	if (!consume_digits(from, 2, hours)) return false;
+	if (consume_char(from, ':') && !consume_digits(from, 2, minutes)) return false;
+	if (consume_char(from, ':') && !consume_digits(from, 2, seconds)) return false;
+	output = std::chrono::hours(hours) + std::chrono::minutes(minutes) + std::chrono::seconds(seconds);
+	if (negative) output = -output;
+	return true;
+}
+
+// Dates and timestamps may be infinity or -infinity, which map to the
+// extreme values of date and datetime, as in binary format
+template <typename T>
+bool consume_infinity(std::string_view from, T& output) noexcept
+{
+	if (from == "infinity") output = T::max();
+	else if (from == "-infinity") output = T::min();
+	else return false;
+	return true;
+}
+
+inline errc read_text_date(std::string_view from, date& output) noexcept
+{
+	if (consume_infinity(from, output)) return errc::ok;
+	return consume_date(from, output) && from.empty() ? errc::ok : errc::protocol_value_error;
+}
+
+inline errc read_text_datetime(std::string_view from, bool has_offset, datetime& output) noexcept
+{
+	if (consume_infinity(from, output)) return errc::ok;
+	date d;
+	time t;
+	std::chrono::seconds offset {0};
+	if (!consume_date(from, d) || !consume_char(from, ' ') || !consume_time(from, t) ||
+		(has_offset && !consume_utc_offset(from, offset)) || !from.empty())
+	{
+		return errc::protocol_value_error;
+	}
+	output = datetime(d) + t - offset;
+	return errc::ok;
+}
+
+inline errc read_text_time(std::string_view from, time& output) noexcept
+{
+	return consume_time(from, output) && from.empty() ? errc::ok : errc::protocol_value_error;
+}
+
+inline errc read_text_bool(std::string_view from, bool& output) noexcept
+{
+	if (from != "t" && from != "f") return errc::protocol_value_error;
+	output = from == "t";
+	return errc::ok;
+}
+
+inline errc decode_text_bool(std::string_view from, value& output) noexcept
+{
+	bool v = false;
+	auto err = read_text_bool(from, v);
+	output = std::int32_t(v);
+	return err;
+}
+
+inline errc decode_text_date(std::string_view from, value& output) noexcept
+{
+	date d;
+	auto err = read_text_date(from, d);
+	output = d;
+	return err;
+}
+
+inline errc decode_text_time(std::string_view from, value& output) noexcept
+{
+	time t;
+	auto err = read_text_time(from, t);
+	output = t;
+	return err;
+}
+
+inline errc decode_text_datetime(std::string_view from, bool has_offset, value& output) noexcept
+{
+	datetime dt;
+	auto err = read_text_datetime(from, has_offset, dt);
+	output = dt;
+	return err;
+}
+
+inline errc decode_text_timestamp(std::string_view from, value& output) noexcept
+{
+	return decode_text_datetime(from, false, output);
+}
+
+inline errc decode_text_timestamptz(std::string_view from, value& output) noexcept
+{
+	return decode_text_datetime(from, true, output);
+}
+
+
+// Parameter encoding
+/**
+ * \brief A parameter value, ready to be sent in a Bind message.
+ * \details Fixed-size values are encoded into an internal buffer,
+ * and strings reference the original value, so encoding never allocates.
+ */
+class encoded_param
+{
+	static constexpr std::size_t inline_size = 48; // enough for any number or date in text format
+
+	std::int16_t format_ {binary_format};
+	bool is_null_ {false};
+	std::string_view external_;
+	std::array<char, inline_size> inline_;
+	std::size_t inline_used_ {0};
+	bool uses_inline_ {false};
+public:
+	// Makes the object ready to encode another value, leaving the buffer's contents as they are
+	void reset() noexcept
+	{
+		format_ = binary_format;
+		is_null_ = false;
+		uses_inline_ = false;
+	}
+
+	void set_null() noexcept { is_null_ = true; }
+
+	void set_external(std::string_view data, std::int16_t format) noexcept
+	{
+		format_ = format;
+		external_ = data;
+	}
+
+	// Writable space for inline data
+	char* inline_first() noexcept { return inline_.data(); }
+	char* inline_last() noexcept { return inline_.data() + inline_.size(); }
+	void set_inline(char* last, std::int16_t format) noexcept
+	{
+		format_ = format;
+		uses_inline_ = true;
+		inline_used_ = last - inline_.data();
+	}
+
+	template <typename T>
+	void set_big_endian(T v) noexcept
+	{
+		boost::endian::native_to_big_inplace(v);
+		std::memcpy(inline_.data(), &v, sizeof(T));
+		set_inline(inline_.data() + sizeof(T), binary_format);
+	}
+
+	std::int16_t format() const noexcept { return format_; }
+
+	/// The length to send in the Bind message (-1 for NULL).
+	std::int32_t length() const noexcept { return is_null_ ? -1 : std::int32_t(data().size()); }
+
+	std::string_view data() const noexcept
+	{
+		return uses_inline_ ? std::string_view(inline_.data(), inline_used_) : external_;
+	}
+};
+
+/**
+ * \brief The type OID that best represents a value, used when no parameter type is known.
+ * \details Strings and datetimes use unspecified_oid and are sent as text,
+ * so the server infers their type from the statement.
+ */
+inline std::int32_t natural_type_oid(const value& v) noexcept
+{
+	return std::visit([](auto typed_v) -> std::int32_t {
+		using T = decltype(typed_v);
+		if constexpr (std::is_same_v<T, std::int32_t>) return int4_oid;
+		else if constexpr (std::is_same_v<T, std::int64_t> || std::is_same_v<T, std::uint32_t>) return int8_oid;
+		else if constexpr (std::is_same_v<T, std::uint64_t>) return numeric_oid; // may not fit in an int8
+		else if constexpr (std::is_same_v<T, float>) return float4_oid;
+		else if constexpr (std::is_same_v<T, double>) return float8_oid;
+		else if constexpr (std::is_same_v<T, date>) return date_oid;
+		else if constexpr (std::is_same_v<T, time>) return time_oid;
+		else return unspecified_oid; // string_view, datetime, NULL
+	}, v);
+}
+
+template <typename T>
+void encode_text_number(T v, encoded_param& output) noexcept
+{
+	auto res = std::to_chars(output.inline_first(), output.inline_last(), v);
+	assert(res.ec == std::errc());
+	output.set_inline(res.ptr, text_format);
+}
+
+// Writes exactly num_digits decimal digits
+inline char* write_digits(char* to, unsigned v, int num_digits) noexcept
+{
+	for (int i = num_digits - 1; i >= 0; --i)
+	{
+		to[i] = char('0' + v % 10);
+		v /= 10;
+	}
+	return to + num_digits;
+}
+
+// Writes the year with at least 4 digits, then -MM-DD. Years before 1 AD are
+// written as BC years (year 0 is 1 BC), so the value must end with write_text_era()
+inline char* write_text_date(char* to, date d) noexcept
+{
+	::date::year_month_day ymd (d);
+	int year = int(ymd.year());
+	unsigned abs_year = year > 0 ? unsigned(year) : unsigned(1 - year);
+	to = abs_year <= 9999 ? write_digits(to, abs_year, 4) : std::to_chars(to, to + 8, abs_year).ptr;
+	*to++ = '-';
+	to = write_digits(to, unsigned(ymd.month()), 2);
+	*to++ = '-';
+	return write_digits(to, unsigned(ymd.day()), 2);
+}
+
+// Writes " BC" for dates before 1 AD, which PostgreSQL expects after the whole value
+inline char* write_text_era(char* to, date d) noexcept
+{
+	if (int(::date::year_month_day(d).year()) > 0) return to;
+	*to++ = ' ';
+	*to++ = 'B';
+	*to++ = 'C';
+	return to;
+}
+
+// Writes [-]HH:MM:SS.ffffff. Durations may be negative or longer than a day
+// (e.g. when sent as an interval), so the hours may take more than 2 digits
+inline char* write_text_time(char* to, time t) noexcept
+{
+	std::uint64_t us = std::uint64_t(t.count());
+	if (t.count() < 0)
+	{
+		*to++ = '-';
+		us = 0 - us;
+	}
+	std::uint64_t hours = us / 3600000000;
+	to = hours < 100 ? write_digits(to, unsigned(hours), 2) : std::to_chars(to, to + 20, hours).ptr;
+	*to++ = ':';
+	to = write_digits(to, unsigned(us / 60000000 % 60), 2);
+	*to++ = ':';
+	to = write_digits(to, unsigned(us / 1000000 % 60), 2);
+	*to++ = '.';
+	return write_digits(to, unsigned(us % 1000000), 6);
+}
+
+// infinity and -infinity for the extreme values of date and datetime, or an empty view
+template <typename T>
+std::string_view get_text_infinity(T v) noexcept
+{
+	if (v == T::max()) return "infinity";
+	if (v == T::min()) return "-infinity";
+	return {};
+}
+
+template <typename T>
+bool is_in_range(T v, std::int64_t min, std::int64_t max) noexcept
+{
+	if constexpr (std::is_unsigned_v<T>)
+		return v <= std::uint64_t(max);
+	else
+		return v >= min && v <= max;
+}
+
+template <typename T>
+void encode_integer(T v, std::int32_t type_oid, encoded_param& output) noexcept
+{
+	using lims16 = std::numeric_limits<std::int16_t>;
+	using lims32 = std::numeric_limits<std::int32_t>;
+	using lims64 = std::numeric_limits<std::int64_t>;
+	switch (type_oid)
+	{
+	case int2_oid:
+		if (is_in_range(v, lims16::min(), lims16::max())) return output.set_big_endian(std::int16_t(v));
+		break;
+	case int4_oid:
+		if (is_in_range(v, lims32::min(), lims32::max())) return output.set_big_endian(std::int32_t(v));
+		break;
+	case int8_oid:
+		if (is_in_range(v, lims64::min(), lims64::max())) return output.set_big_endian(std::int64_t(v));
+		break;
+	case oid_oid:
+		if (is_in_range(v, 0, std::numeric_limits<std::uint32_t>::max())) return output.set_big_endian(std::uint32_t(v));
+		break;
+	case bool_oid: return output.set_big_endian(std::uint8_t(v != 0));
+	case float4_oid: return output.set_big_endian(float_bits(float(v)));
+	case float8_oid: return output.set_big_endian(float_bits(double(v)));
+	default: break;
+	}
+
+	// Out of range or another type (e.g. numeric): let the server parse and check it
+	encode_text_number(v, output);
+}
+
+/**
+ * \brief Encodes a parameter, given the type the server expects for it.
+ * \details Values with a binary representation matching type_oid are
+ * sent in binary. Anything else is sent as text, and converted by the server.
+ */
+inline void encode_param(const value& v, std::int32_t type_oid, encoded_param& output) noexcept
+{
+	std::visit([type_oid, &output](auto typed_v) {
+		using T = decltype(typed_v);
+		if constexpr (std::is_same_v<T, std::nullptr_t>)
+		{
+			output.set_null();
+		}
+		else if constexpr (std::is_integral_v<T>)
+		{
+			encode_integer(typed_v, type_oid, output);
+		}
+		else if constexpr (std::is_floating_point_v<T>)
+		{
+			if (type_oid == float4_oid) output.set_big_endian(float_bits(float(typed_v)));
+			else if (type_oid == float8_oid) output.set_big_endian(float_bits(double(typed_v)));
+			else encode_text_number(typed_v, output);
+		}
+		else if constexpr (std::is_same_v<T, std::string_view>)
+		{
+			// bytea in text format would require escaping
+			output.set_external(typed_v, type_oid == bytea_oid ? binary_format : text_format);
+		}
+		else if constexpr (std::is_same_v<T, date>)
+		{
+			if (type_oid == date_oid)
+			{
+				output.set_big_endian(to_binary_date(typed_v));
+			}
+			else if (auto inf = get_text_infinity(typed_v); !inf.empty())
+			{
+				output.set_external(inf, text_format);
+			}
+			else
+			{
+				char* it = write_text_date(output.inline_first(), typed_v);
+				output.set_inline(write_text_era(it, typed_v), text_format);
+			}
+		}
+		else if constexpr (std::is_same_v<T, datetime>)
+		{
+			if (type_oid == timestamp_oid || type_oid == timestamptz_oid)
+			{
+				output.set_big_endian(to_binary_datetime(typed_v));
+			}
+			else if (auto inf = get_text_infinity(typed_v); !inf.empty())
+			{
+				output.set_external(inf, text_format);
+			}
+			else
+			{
+				// YYYY-MM-DD HH:MM:SS.ffffff+00[ BC]
+				auto d = std::chrono::floor<::date::days>(typed_v);
+				char* it = write_text_date(output.inline_first(), d);
+				*it++ = ' ';
+				it = write_text_time(it, typed_v - d);
+				*it++ = '+';
+				*it++ = '0';
+				*it++ = '0';
+				output.set_inline(write_text_era(it, d), text_format);
+			}
+		}
+		else // time
+		{
+			static_assert(std::is_same_v<T, time>);
+			if (type_oid == time_oid)
+				output.set_big_endian(std::int64_t(typed_v.count()));
+			else
+				output.set_inline(write_text_time(output.inline_first(), typed_v), text_format);
+		}
+	}, v);
+}
+
+}
+
+#endif /* INCLUDE_PSQL_CODECS_H_ */
@@ -0,0 +1,503 @@
+#ifndef INCLUDE_PSQL_COLUMNAR_H_
+#define INCLUDE_PSQL_COLUMNAR_H_
+
+#include "psql/metadata.h"
+#include "psql/codecs.h"
+#include "psql/serialization.h"
+#include "psql/arrow_c.h"
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <limits>
+
+namespace psql
+{
+
+/// The in-memory representation of a column, chosen from its type OID.
+enum class column_type : std::uint8_t
+{
+	boolean,     // bool, one bit per value
+	int16,       // int2
+	int32,       // int4
+	int64,       // int8
+	uint32,      // oid
+	float32,     // float4
+	float64,     // float8
+	date32,      // date, as days since 1970-01-01
+	time64,      // time, as microseconds since midnight
+	timestamp,   // timestamp, as microseconds since 1970-01-01
+	timestamptz, // timestamptz, as microseconds since 1970-01-01 UTC
+	binary,      // bytea and non-string types in binary format, as offsets + data
+	string       // string types, and anything else in text format, as offsets + text data
+};
+
+inline column_type get_column_type(std::int32_t type_oid, std::int16_t format) noexcept
+{
+	switch (type_oid)
+	{
+	case bool_oid: return column_type::boolean;
+	case int2_oid: return column_type::int16;
+	case int4_oid: return column_type::int32;
+	case int8_oid: return column_type::int64;
+	case oid_oid: return column_type::uint32;
+	case float4_oid: return column_type::float32;
+	case float8_oid: return column_type::float64;
+	case date_oid: return column_type::date32;
+	case time_oid: return column_type::time64;
+	case timestamp_oid: return column_type::timestamp;
+	case timestamptz_oid: return column_type::timestamptz;
+	case char_oid:
+	case name_oid:
+	case text_oid:
+	case json_oid:
+	case bpchar_oid:
+	case varchar_oid: return column_type::string;
+	default: return format == binary_format ? column_type::binary : column_type::string;
+	}
+}
+
+// Size of each value in the data buffer, or 0 for variable length and bit-packed types
+inline std::size_t get_value_size(column_type type) noexcept
+{
+	switch (type)
+	{
+	case column_type::int16: return 2;
+	case column_type::int32:
+	case column_type::uint32:
+	case column_type::float32:
+	case column_type::date32: return 4;
+	case column_type::int64:
+	case column_type::float64:
+	case column_type::time64:
+	case column_type::timestamp:
+	case column_type::timestamptz: return 8;
+	default: return 0;
+	}
+}
+
+// Format string used by the Arrow C Data Interface
+inline const char* get_arrow_format(column_type type) noexcept
+{
+	switch (type)
+	{
+	case column_type::boolean: return "b";
+	case column_type::int16: return "s";
+	case column_type::int32: return "i";
+	case column_type::int64: return "l";
+	case column_type::uint32: return "I";
+	case column_type::float32: return "f";
+	case column_type::float64: return "g";
+	case column_type::date32: return "tdD";
+	case column_type::time64: return "ttu";
+	case column_type::timestamp: return "tsu:";
+	case column_type::timestamptz: return "tsu:UTC";
+	case column_type::binary: return "Z"; // large binary, 64 bit offsets
+	default: return "U"; // large UTF-8 string, 64 bit offsets
+	}
+}
+
+/**
+ * \brief The values of a single column, decoded into typed buffers.
+ * \details Fixed size values are stored contiguously in data(), in native
+ * byte order. Booleans are stored as bits. For variable length types,
+ * the i-th value spans [offsets()[i], offsets()[i+1]) within data().
+ * NULL values have a zeroed or empty entry and a cleared bit in validity().
+ */
+class column
+{
+	std::string name_;
+	column_type type_ {column_type::string};
+	std::int16_t format_ {text_format};
+	value_decoder custom_decoder_ {}; // for string and binary columns, if registered by the application
+	std::int64_t size_ {0};
+	std::int64_t null_count_ {0};
+	bytestring validity_; // bit i is set if value i is not NULL
+	bytestring data_;
+	std::vector<std::int64_t> offsets_ {0};
+
+	template <typename T>
+	void push_value(T v)
+	{
+		auto pos = data_.size();
+		data_.resize(pos + sizeof(T));
+		std::memcpy(data_.data() + pos, &v, sizeof(T));
+	}
+
+	void push_bit(bytestring& to, bool v)
+	{
+		if (size_ % 8 == 0) to.push_back(0);
+		if (v) to.back() |= std::uint8_t(1 << (size_ % 8));
+	}
+
+	template <typename T>
+	errc append_number(std::string_view from)
+	{
+		T v {};
+		auto err = format_ == text_format ? parse_text_number(from, v) : read_binary_number<T>(from, v);
+		if (err == errc::ok) push_value(v);
+		return err;
+	}
+
+	errc append_bool(std::string_view from)
+	{
+		bool v = false;
+		auto err = format_ == text_format ? read_text_bool(from, v) : read_binary_number<std::uint8_t, bool>(from, v);
+		if (err == errc::ok) push_bit(data_, v);
+		return err;
+	}
+
+	// Infinite dates and timestamps are stored as the extreme values of the column type.
+	// date may count days with a wider type than date32
+	errc append_date(std::string_view from)
+	{
+		using lims = std::numeric_limits<std::int32_t>;
+		date d;
+		auto err = format_ == text_format ? read_text_date(from, d) : read_binary_date(from, d);
+		std::int64_t days = d.time_since_epoch().count();
+		if (err == errc::ok) push_value(std::int32_t(std::clamp<std::int64_t>(days, lims::min(), lims::max())));
+		return err;
+	}
+
+	errc append_time(std::string_view from)
+	{
+		time t;
+		auto err = format_ == text_format ? read_text_time(from, t) : read_binary_time(from, t);
+		if (err == errc::ok) push_value(std::int64_t(t.count()));
+		return err;
+	}
+
+	errc append_timestamp(std::string_view from)
+	{
+		datetime dt;
+		auto err = format_ == text_format ?
+			read_text_datetime(from, type_ == column_type::timestamptz, dt) :
+			read_binary_datetime(from, dt);
+		if (err == errc::ok) push_value(std::int64_t(dt.time_since_epoch().count()));
+		return err;
+	}
+
+	// Types with a custom decoder are stored as the strings it returns
+	errc append_bytes(std::string_view from)
+	{
+		if (custom_decoder_)
+		{
+			value v;
+			auto err = custom_decoder_(from, v);
+			if (err != errc::ok) return err;
+			if (!std::holds_alternative<std::string_view>(v)) return errc::type_mismatch;
+			from = std::get<std::string_view>(v);
+		}
+		data_.insert(data_.end(), from.begin(), from.end());
+		offsets_.push_back(std::int64_t(data_.size()));
+		return errc::ok;
+	}
+
+	errc append_value(std::string_view from)
+	{
+		switch (type_)
+		{
+		case column_type::boolean: return append_bool(from);
+		case column_type::int16: return append_number<std::int16_t>(from);
+		case column_type::int32: return append_number<std::int32_t>(from);
+		case column_type::int64: return append_number<std::int64_t>(from);
+		case column_type::uint32: return append_number<std::uint32_t>(from);
+		case column_type::float32: return append_number<float>(from);
+		case column_type::float64: return append_number<double>(from);
+		case column_type::date32: return append_date(from);
+		case column_type::time64: return append_time(from);
+		case column_type::timestamp:
+		case column_type::timestamptz: return append_timestamp(from);
+		default: return append_bytes(from);
+		}
+	}
+public:
+	column() = default;
+	explicit column(const field_metadata& meta):
+		name_(meta.field_name()),
+		type_(get_column_type(meta.type_oid(), meta.format())),
+		format_(meta.format())
+	{
+		if (get_value_size(type_) == 0 && type_ != column_type::boolean &&
+			is_custom_decoder(meta.type_oid(), format_, meta.decoder()))
+		{
+			custom_decoder_ = meta.decoder();
+		}
+	}
+
+	const std::string& name() const noexcept { return name_; }
+	column_type type() const noexcept { return type_; }
+	std::size_t size() const noexcept { return std::size_t(size_); }
+	std::size_t null_count() const noexcept { return std::size_t(null_count_); }
+	bool is_null(std::size_t i) const noexcept { assert(i < size()); return !(validity_[i / 8] & (1 << (i % 8))); }
+	const bytestring& validity() const noexcept { return validity_; }
+	const bytestring& data() const noexcept { return data_; }
+	const std::vector<std::int64_t>& offsets() const noexcept { return offsets_; }
+
+	/// The values of a fixed size column, as an array of T.
+	template <typename T>
+	const T* values() const noexcept
+	{
+		assert(get_value_size(type_) == sizeof(T));
+		return reinterpret_cast<const T*>(data_.data());
+	}
+
+	/// The i-th value of a string or binary column.
+	std::string_view string_at(std::size_t i) const noexcept
+	{
+		assert(i < size());
+		return get_string(data_.data() + offsets_[i], offsets_[i+1] - offsets_[i]);
+	}
+
+	// Private, do not use. Decodes a value in the field's wire format
+	errc append(std::string_view from)
+	{
+		auto err = append_value(from);
+		if (err != errc::ok) return err;
+		push_bit(validity_, true);
+		++size_;
+		return errc::ok;
+	}
+
+	// Private, do not use
+	void append_null()
+	{
+		if (type_ == column_type::boolean) push_bit(data_, false);
+		else if (get_value_size(type_) == 0) offsets_.push_back(offsets_.back());
+		else data_.resize(data_.size() + get_value_size(type_));
+		push_bit(validity_, false);
+		++null_count_;
+		++size_;
+	}
+};
+
+/**
+ * \brief A set of rows, stored by column.
+ * \details Values are decoded from each DataRow straight into the
+ * typed buffers of each column. Batches can be handed to Arrow-based
+ * engines without copying by export_record_batch().
+ */
+class record_batch
+{
+	std::vector<column> columns_;
+	std::size_t num_rows_ {};
+public:
+	record_batch() = default;
+	explicit record_batch(const std::vector<field_metadata>& fields)
+	{
+		columns_.reserve(fields.size());
+		for (const auto& field: fields)
+		{
+			columns_.emplace_back(field);
+		}
+	}
+
+	// Private, do not use. Decodes a DataRow message body into the columns
+	errc append(boost::asio::const_buffer body)
+	{
+		deserialization_context ctx (body);
+		std::int16_t field_count = 0;
+		auto err = deserialize(field_count, ctx);
+		if (err != errc::ok) return err;
+		if (std::size_t(field_count) != columns_.size()) return errc::protocol_value_error;
+
+		for (auto& col: columns_)
+		{
+			std::int32_t size = 0;
+			err = deserialize(size, ctx);
+			if (err != errc::ok) return err;
+			if (size == -1)
+			{
+				col.append_null();
+				continue;
+			}
+			if (size < 0 || !ctx.enough_size(size)) return errc::incomplete_message;
+			err = col.append(get_string(ctx.first(), size));
+			if (err != errc::ok) return err;
+			ctx.advance(size);
+		}
+		if (!ctx.empty()) return errc::extra_bytes;
+		++num_rows_;
+		return errc::ok;
+	}
+
+	// Private, do not use. Values are decoded as they are appended
+	errc finish(const std::vector<field_metadata>&) noexcept { return errc::ok; }
+
+	/// The number of rows.
+	std::size_t size() const noexcept { return num_rows_; }
+
+	/// Whether there are no rows.
+	bool empty() const noexcept { return num_rows_ == 0; }
+
+	/// The columns, in the same order as the resultset fields.
+	const std::vector<column>& columns() const noexcept { return columns_; }
+
+	/// The i-th column.
+	const column& operator[](std::size_t i) const noexcept { assert(i < columns_.size()); return columns_[i]; }
+
+	// Private, do not use. Leaves the batch empty
+	std::vector<column> release_columns() noexcept
+	{
+		num_rows_ = 0;
+		return std::move(columns_);
+	}
+};
+
+// Arrow C Data Interface export. Each exported array and schema owns
+// its data through private_data, and frees it in its release callback
+struct arrow_column_data
+{
+	column col;
+	const void* buffers[3];
+};
+
+struct arrow_batch_data
+{
+	std::vector<ArrowArray> child_arrays;
+	std::vector<ArrowArray*> children;
+	const void* buffers[1] {nullptr};
+};
+
+struct arrow_schema_data
+{
+	std::string format;
+	std::string name;
+	std::vector<ArrowSchema> child_schemas;
+	std::vector<ArrowSchema*> children;
+};
+
+inline void release_arrow_column(ArrowArray* array)
+{
+	delete static_cast<arrow_column_data*>(array->private_data);
+	array->release = nullptr;
+}
+
+inline void release_arrow_batch(ArrowArray* array)
+{
+	auto* data = static_cast<arrow_batch_data*>(array->private_data);
+	for (ArrowArray* child: data->children)
+	{
+		// Children may have been moved out and released by the consumer
+		if (child->release) child->release(child);
+	}
+	delete data;
+	array->release = nullptr;
+}
+
+inline void release_arrow_schema(ArrowSchema* schema)
+{
+	auto* data = static_cast<arrow_schema_data*>(schema->private_data);
+	for (ArrowSchema* child: data->children)
+	{
+		if (child->release) child->release(child);
+	}
+	delete data;
+	schema->release = nullptr;
+}
+
+inline void export_arrow_schema(
+	const char* format,
+	std::string name,
+	std::size_t num_children,
+	ArrowSchema& output
+)
+{
+	auto* data = new arrow_schema_data{format, std::move(name), {}, {}};
+	output = ArrowSchema{
+		data->format.c_str(),
+		data->name.c_str(),
+		nullptr, // metadata
+		ARROW_FLAG_NULLABLE,
+		std::int64_t(num_children),
+		nullptr, // children
+		nullptr, // dictionary
+		&release_arrow_schema,
+		data
+	};
+	if (num_children)
+	{
+		data->child_schemas.resize(num_children);
+		for (auto& child: data->child_schemas)
+		{
+			data->children.push_back(&child);
+		}
+		output.children = data->children.data();
+	}
+}
+
+inline void export_arrow_column(column&& col, ArrowArray& output)
+{
+	auto* data = new arrow_column_data{std::move(col), {}};
+	const column& c = data->col;
+	data->buffers[0] = c.null_count() ? c.validity().data() : nullptr;
+	data->buffers[1] = get_value_size(c.type()) || c.type() == column_type::boolean ?
+		static_cast<const void*>(c.data().data()) : c.offsets().data();
+	data->buffers[2] = c.data().data();
+	output = ArrowArray{
+		std::int64_t(c.size()),
+		std::int64_t(c.null_count()),
+		0, // offset
+		get_value_size(c.type()) || c.type() == column_type::boolean ? 2 : 3,
+		0, // children
+		data->buffers,
+		nullptr, // children
+		nullptr, // dictionary
+		&release_arrow_column,
+		data
+	};
+}
+
+// Private, do not use. What fetch functions return when they fail: no rows.
+// Record batches keep the resultset's columns, so they still export its schema
+template <typename Result>
+Result make_empty_result(const std::vector<field_metadata>& fields)
+{
+	if constexpr (std::is_same_v<Result, record_batch>) return record_batch(fields);
+	else return Result();
+}
+
+/**
+ * \brief Exports a record batch through the Arrow C Data Interface.
+ * \details The batch is exported as a struct array with one child per column,
+ * and its schema. Buffers are moved, not copied, so the batch is left empty.
+ * The caller (usually an Arrow-based engine) becomes responsible for calling
+ * the release callbacks of both array and schema.
+ */
+inline void export_record_batch(record_batch&& batch, ArrowArray* array, ArrowSchema* schema)
+{
+	std::size_t num_rows = batch.size();
+	std::vector<column> columns = batch.release_columns();
+
+	// Schema
+	export_arrow_schema("+s", "", columns.size(), *schema);
+	for (std::size_t i = 0; i < columns.size(); ++i)
+	{
+		export_arrow_schema(get_arrow_format(columns[i].type()), columns[i].name(), 0, *schema->children[i]);
+	}
+
+	// Array
+	auto* data = new arrow_batch_data{std::vector<ArrowArray>(columns.size()), {}};
+	for (std::size_t i = 0; i < columns.size(); ++i)
+	{
+		export_arrow_column(std::move(columns[i]), data->child_arrays[i]);
+		data->children.push_back(&data->child_arrays[i]);
+	}
+	*array = ArrowArray{
+		std::int64_t(num_rows),
+		0, // null_count
+		0, // offset
+		1, // n_buffers (validity, not present)
+		std::int64_t(columns.size()),
+		data->buffers,
+		data->children.data(),
+		nullptr, // dictionary
+		&release_arrow_batch,
+		data
+	};
+}
+
+}
+
+#endif /* INCLUDE_PSQL_COLUMNAR_H_ */
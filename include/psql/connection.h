@@ -4,9 +4,15 @@
 #include "psql/channel.h"
 #include "psql/connection_params.h"
 #include "psql/auth_md5.h"
+#include "psql/auth_scram.h"
 #include "psql/resultset.h"
 #include "psql/prepared_statement.h"
-#include <stdexcept>
+#include "psql/response.h"
+#include "psql/multi_resultset.h"
+#include "psql/pipeline.h"
+#include "psql/copy_in.h"
+#include "psql/copy_out.h"
+#include <initializer_list>
 
 namespace psql
 {
@@ -16,9 +22,112 @@ class connection
 {
 	using channel_type = channel<Stream>;
 
+	struct handshake_op;
+	struct prepare_statement_op;
+	struct copy_in_op;
+
 	Stream next_layer_;
 	channel_type channel_;
 	int curr_stmt_num_ {0};
+	statement_cache stmt_cache_;
+	std::vector<std::int32_t> param_types_buffer_; // reused by enqueue_execute
+
+	std::string enqueue_prepare(std::string_view statement, const std::vector<std::int32_t>& param_types)
+	{
+		// Generate a name
+		std::string name = "__psql_asio_" + std::to_string(curr_stmt_num_++);
+
+		// Issue a Parse, and a Describe to learn the result types
+		channel_.begin_operation(operation_type::prepare, name, statement);
+		channel_.enqueue(parse_message{
+			string_null(name),
+			string_null(statement),
+			param_types.data(),
+			param_types.data() + param_types.size()
+		});
+		channel_.enqueue(describe_message{
+			'S',
+			string_null(name)
+		});
+		channel_.enqueue(sync_message{});
+		return name;
+	}
+
+	// One-shot execution, using the unnamed statement and portal.
+	// Parse, bind, describe, execute and sync are sent in a single flight.
+	// The server doesn't describe the statement before the bind, so parameters
+	// are declared with the types they are encoded with, and results use text
+	template <typename ForwardIterator>
+	void enqueue_execute(std::string_view statement, ForwardIterator params_first, ForwardIterator params_last)
+	{
+		param_types_buffer_.clear();
+		for (auto it = params_first; it != params_last; ++it)
+		{
+			param_types_buffer_.push_back(natural_type_oid(*it));
+		}
+		channel_.begin_operation(operation_type::execute, std::string_view(), statement);
+		channel_.enqueue(parse_message{
+			string_null(""), // unnamed statement
+			string_null(statement),
+			param_types_buffer_.data(),
+			param_types_buffer_.data() + param_types_buffer_.size()
+		});
+		channel_.enqueue(bind_message<ForwardIterator>{
+			string_null(""), // unnamed portal
+			string_null(""), // unnamed statement
+			params_first,
+			params_last,
+			&channel_.param_buffer(),
+			param_types_buffer_.data()
+		});
+		channel_.enqueue(describe_message{
+			'P',
+			string_null("")
+		});
+		channel_.enqueue(execute_message{
+			string_null("")
+		});
+		channel_.enqueue(sync_message{});
+	}
+
+	void enqueue_query(operation_type type, std::string_view sql)
+	{
+		channel_.begin_operation(type, std::string_view(), sql);
+		channel_.enqueue(query_message{
+			string_null(sql)
+		});
+	}
+
+	// Looks up a statement in the cache. On misses, sets key to the
+	// key the statement should be added with, once prepared
+	std::shared_ptr<const statement_info> find_statement(
+		std::string_view statement,
+		const std::vector<std::int32_t>& param_types,
+		std::string& key
+	)
+	{
+		if (stmt_cache_.capacity() == 0) return nullptr;
+		const std::string& lookup_key = stmt_cache_.make_key(statement, param_types);
+		auto res = stmt_cache_.find(lookup_key);
+		if (!res) key = lookup_key;
+		return res;
+	}
+
+	// Creates the info for a newly prepared statement, adding it to the cache.
+	// Evicted statements are closed with the next request
+	std::shared_ptr<const statement_info> add_statement(
+		std::string&& key,
+		std::string&& name,
+		std::string_view statement,
+		statement_description&& descr
+	)
+	{
+		auto res = std::make_shared<statement_info>(statement_info{std::move(name), std::string(statement), std::move(descr)});
+		stmt_cache_.insert(std::move(key), res, [this](const statement_info& evicted) {
+			channel_.enqueue_lazy_close('S', evicted.name);
+		});
+		return res;
+	}
 public:
 	template <typename... Args>
 	connection(Args&&... args) :
@@ -27,87 +136,807 @@ public:
 	{
 	}
 
+	/// The executor type associated to this object.
+	using executor_type = typename Stream::executor_type;
+
+	/// Retrieves the executor associated to this object.
+	executor_type get_executor() { return next_layer_.get_executor(); }
+
 	Stream& next_layer() { return next_layer_; }
 	const Stream& next_layer() const { return next_layer_; }
 
+	/**
+	 * \brief The transaction status reported by the server when it last became ready for a query.
+	 * \details 'I' if not in a transaction block, 'T' if in a transaction
+	 * block, or 'E' if in a failed transaction block.
+	 */
+	std::uint8_t transaction_status() const noexcept { return channel_.transaction_status(); }
+
+	/**
+	 * \brief Whether the connection can be handed to another user as is.
+	 * \details True if the server has answered every request sent (no
+	 * unread responses, unfinished pipelines or open cursors remain), the
+	 * connection is not in a transaction block and no I/O error has occurred.
+	 */
+	bool idle() const noexcept
+	{
+		return !channel_.broken() && channel_.pending_syncs() == 0 && !channel_.unsynced() &&
+			channel_.transaction_status() == 'I';
+	}
+
+	/**
+	 * \brief Performs the PostgreSQL startup and authentication.
+	 * \details For SSL streams, TLS is negotiated first, as set by params.ssl:
+	 * an SSLRequest is sent over the underlying stream, which must be connected,
+	 * and the TLS handshake performed if the server accepts it. Cached TLS
+	 * sessions are offered to resume them (see ssl_session_cache).
+	 */
 	void handshake(const connection_params& params)
 	{
-		// Startup
-		channel_.write(startup_message{
+		error_code err;
+		error_info info;
+		handshake(params, err, info);
+		check_error_code(err, info);
+	}
+
+	/// Performs the PostgreSQL startup and authentication (sync with error codes version).
+	void handshake(const connection_params& params, error_code& err, error_info& info)
+	{
+		err.clear();
+		info.clear();
+
+		err = handshake_op::check_ssl_mode(params);
+		if (err) return;
+		if (handshake_op::ssl_requested(params))
+		{
+			// Ask for TLS and read the single byte answer, directly from the socket
+			bool accepted = false;
+			channel_.enqueue(ssl_request_message{}, false);
+			channel_.flush(err);
+			if (!err)
+			{
+				handshake_op::read_ssl_response(channel_, err);
+				err = handshake_op::process_ssl_response(channel_, params, err, accepted);
+			}
+			if (!err && accepted)
+			{
+				handshake_op::prepare_ssl_session(channel_);
+				handshake_op::ssl_handshake(channel_, err);
+				channel_.set_ssl_active(!err);
+			}
+			if (err) return;
+		}
+
+		// Startup, then authentication exchanges until ready for query
+		handshake_op::enqueue_startup(channel_, params);
+		scram_client scram;
+		message_view msg;
+		do
+		{
+			msg = channel_.read_message(err);
+			if (!err) err = handshake_op::process_message(channel_, params, scram, msg, &info);
+		} while (!err && msg.type != ready_for_query_message::message_type);
+	}
+
+	/**
+	 * \brief Performs the PostgreSQL startup and authentication (async version).
+	 * \details The handler signature is void(error_code). params must
+	 * be kept alive until the operation completes.
+	 */
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code))
+	async_handshake(const connection_params& params, CompletionToken&& token, error_info* info=nullptr)
+	{
+		conditional_clear(info);
+		return boost::asio::async_compose<CompletionToken, void(error_code)>(
+			handshake_op{channel_, params, info}, token, next_layer_);
+	}
+
+	/// Executes a text query.
+	resultset<Stream> query(std::string_view query_string)
+	{
+		error_code err;
+		error_info info;
+		resultset<Stream> res = query(query_string, err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Executes a text query (sync with error codes version).
+	resultset<Stream> query(std::string_view query_string, error_code& err, error_info& info)
+	{
+		err.clear();
+		info.clear();
+		enqueue_query(operation_type::query, query_string);
+		return read_query_response(channel_, err, info);
+	}
+
+	/**
+	 * \brief Executes a text query (async version).
+	 * \details The handler signature is void(error_code, resultset<Stream>).
+	 * The query string is serialized before this function returns.
+	 */
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, resultset<Stream>))
+	async_query(std::string_view query_string, CompletionToken&& token, error_info* info=nullptr)
+	{
+		conditional_clear(info);
+		enqueue_query(operation_type::query, query_string);
+		return async_read_query_response(channel_, info, std::forward<CompletionToken>(token));
+	}
+
+	/**
+	 * \brief Executes a text query containing several statements, separated by semicolons.
+	 * \details The query is sent in a single message, with the first call to
+	 * next_resultset() or async_next_resultset() on the returned object,
+	 * which yields the result of each statement in order. query() can be used
+	 * too, but returns only the first result.
+	 */
+	multi_resultset<Stream> multi_query(std::string_view query_string)
+	{
+		enqueue_query(operation_type::query, query_string);
+		return multi_resultset<Stream>(channel_);
+	}
+
+	/**
+	 * \brief Executes a parameterized statement once, in a single round trip.
+	 * \details Uses the unnamed statement, so nothing is left on the server
+	 * and there is nothing to close. This also works through proxies that
+	 * share server connections between transactions, where named statements
+	 * can't be used. Parameter types are deduced from the values, and
+	 * results are received in text format. Prefer prepare_statement()
+	 * for statements that are executed repeatedly.
+	 */
+	template <typename ForwardIterator>
+	resultset<Stream> execute(std::string_view statement, ForwardIterator params_first, ForwardIterator params_last)
+	{
+		error_code err;
+		error_info info;
+		resultset<Stream> res = execute(statement, params_first, params_last, err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Executes a parameterized statement once, in a single round trip (sync with error codes version).
+	template <typename ForwardIterator>
+	resultset<Stream> execute(
+		std::string_view statement,
+		ForwardIterator params_first,
+		ForwardIterator params_last,
+		error_code& err,
+		error_info& info
+	)
+	{
+		err.clear();
+		info.clear();
+		enqueue_execute(statement, params_first, params_last);
+		return read_parse_execute_response(channel_, err, info);
+	}
+
+	/// Executes a parameterized statement once, in a single round trip.
+	resultset<Stream> execute(std::string_view statement, std::initializer_list<value> params = {})
+	{
+		return execute(statement, params.begin(), params.end());
+	}
+
+	/// Executes a parameterized statement once, in a single round trip (sync with error codes version).
+	resultset<Stream> execute(
+		std::string_view statement,
+		std::initializer_list<value> params,
+		error_code& err,
+		error_info& info
+	)
+	{
+		return execute(statement, params.begin(), params.end(), err, info);
+	}
+
+	/**
+	 * \brief Executes a parameterized statement once, in a single round trip (async version).
+	 * \details The handler signature is void(error_code, resultset<Stream>).
+	 * The statement and parameters are serialized before this function returns.
+	 */
+	template <typename ForwardIterator, typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, resultset<Stream>))
+	async_execute(
+		std::string_view statement,
+		ForwardIterator params_first,
+		ForwardIterator params_last,
+		CompletionToken&& token,
+		error_info* info=nullptr
+	)
+	{
+		conditional_clear(info);
+		enqueue_execute(statement, params_first, params_last);
+		return async_read_parse_execute_response(channel_, info, std::forward<CompletionToken>(token));
+	}
+
+	/// Executes a parameterized statement once, in a single round trip (async version).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, resultset<Stream>))
+	async_execute(
+		std::string_view statement,
+		std::initializer_list<value> params,
+		CompletionToken&& token,
+		error_info* info=nullptr
+	)
+	{
+		return async_execute(statement, params.begin(), params.end(), std::forward<CompletionToken>(token), info);
+	}
+
+	/**
+	 * \brief Prepares a statement.
+	 * \details param_types optionally declares the type OIDs of the
+	 * first parameters (unspecified_oid lets the server infer a type).
+	 * Parameters are sent in binary format when the type reported by the
+	 * server allows it.
+	 *
+	 * Statements are cached by SQL text and param_types, so preparing the
+	 * same statement again doesn't involve the server. Cached statements
+	 * are closed by the cache when evicted, so they don't need to be closed.
+	 * If the cache is disabled, statements must be closed by the caller.
+	 */
+	prepared_statement<Stream> prepare_statement(
+		std::string_view statement,
+		const std::vector<std::int32_t>& param_types = {}
+	)
+	{
+		error_code err;
+		error_info info;
+		prepared_statement<Stream> res = prepare_statement(statement, param_types, err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Prepares a statement (sync with error codes version).
+	prepared_statement<Stream> prepare_statement(std::string_view statement, error_code& err, error_info& info)
+	{
+		return prepare_statement(statement, {}, err, info);
+	}
+
+	/// Prepares a statement, declaring parameter types (sync with error codes version).
+	prepared_statement<Stream> prepare_statement(
+		std::string_view statement,
+		const std::vector<std::int32_t>& param_types,
+		error_code& err,
+		error_info& info
+	)
+	{
+		err.clear();
+		info.clear();
+		std::string key;
+		if (auto cached = find_statement(statement, param_types, key))
+		{
+			return prepared_statement<Stream>(channel_, std::move(cached));
+		}
+		std::string name = enqueue_prepare(statement, param_types);
+		auto descr = read_prepare_response(channel_, err, info);
+		if (err) return prepared_statement<Stream>();
+		return prepared_statement<Stream>(channel_, add_statement(std::move(key), std::move(name), statement, std::move(descr)));
+	}
+
+	/**
+	 * \brief Prepares a statement (async version).
+	 * \details The handler signature is void(error_code, prepared_statement<Stream>).
+	 * The statement text is serialized before this function returns.
+	 */
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, prepared_statement<Stream>))
+	async_prepare_statement(std::string_view statement, CompletionToken&& token, error_info* info=nullptr)
+	{
+		return async_prepare_statement(statement, {}, std::forward<CompletionToken>(token), info);
+	}
+
+	/// Prepares a statement, declaring parameter types (async version).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, prepared_statement<Stream>))
+	async_prepare_statement(
+		std::string_view statement,
+		const std::vector<std::int32_t>& param_types,
+		CompletionToken&& token,
+		error_info* info=nullptr
+	)
+	{
+		conditional_clear(info);
+		std::string key, name, sql;
+		auto cached = find_statement(statement, param_types, key);
+		if (!cached)
+		{
+			name = enqueue_prepare(statement, param_types);
+			sql = statement;
+		}
+		return boost::asio::async_compose<CompletionToken, void(error_code, prepared_statement<Stream>)>(
+			prepare_statement_op{*this, std::move(key), std::move(name), std::move(sql), std::move(cached), info},
+			token, next_layer_);
+	}
+
+	/// Counters describing the work done by this connection, e.g. bytes, round trips and time spent on I/O.
+	const connection_stats& stats() const noexcept { return channel_.stats(); }
+
+	/// Resets all the counters returned by stats() to zero.
+	void reset_stats() noexcept { channel_.stats() = connection_stats(); }
+
+	/**
+	 * \brief Installs a hook notified of the start and end of each operation, or removes it if nullptr.
+	 * \details The hook is not owned, and must outlive the connection or be
+	 * removed. Must not be called while an operation is in progress.
+	 * See tracing_hook for details.
+	 */
+	void set_tracing_hook(tracing_hook* hook) noexcept { channel_.set_tracing_hook(hook); }
+
+	/**
+	 * \brief Sets the registry used to decode the fields received, and to choose their formats.
+	 * \details By default, default_codec_registry() is used. The registry is not
+	 * owned, and must outlive the connection. Must not be called while an operation
+	 * is in progress. Statements already prepared keep the result formats
+	 * chosen with the previous registry.
+	 */
+	void set_codec_registry(const codec_registry& registry) noexcept { channel_.set_codecs(registry); }
+
+	/// The registry used to decode the fields received.
+	const codec_registry& get_codec_registry() const noexcept { return channel_.codecs(); }
+
+	/// The cache of prepared statements, with its hit and miss counts.
+	const statement_cache& get_statement_cache() const noexcept { return stmt_cache_; }
+
+	/**
+	 * \brief Sets the maximum number of cached statements. Zero disables caching.
+	 * \details Statements evicted as a result are closed with the next request.
+	 * Statements over the new capacity that are still referenced stop being
+	 * cached, and must be closed by calling prepared_statement::close().
+	 */
+	void set_statement_cache_capacity(std::size_t value)
+	{
+		stmt_cache_.set_capacity(value, [this](const statement_info& evicted) {
+			channel_.enqueue_lazy_close('S', evicted.name);
+		});
+	}
+
+	/**
+	 * \brief Creates a pipeline, to send several independent requests at once.
+	 * \details The connection must not be used for anything else until
+	 * all the pipeline's results have been retrieved.
+	 */
+	pipeline<Stream> make_pipeline() noexcept { return pipeline<Stream>(channel_); }
+
+	/**
+	 * \brief Starts a COPY ... FROM STDIN statement.
+	 * \details Data is sent using the returned writer. column_types optionally
+	 * declares the type OIDs of the first columns, used to encode binary rows.
+	 * Undeclared columns must have the type of the values written to them.
+	 * The connection must not be used for anything else until the writer's
+	 * finish() or abort() have been called.
+	 */
+	copy_in_writer<Stream> copy_in(
+		std::string_view statement,
+		const std::vector<std::int32_t>& column_types = {}
+	)
+	{
+		error_code err;
+		error_info info;
+		copy_in_writer<Stream> res = copy_in(statement, column_types, err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Starts a COPY ... FROM STDIN statement (sync with error codes version).
+	copy_in_writer<Stream> copy_in(std::string_view statement, error_code& err, error_info& info)
+	{
+		return copy_in(statement, {}, err, info);
+	}
+
+	/// Starts a COPY ... FROM STDIN statement, declaring column types (sync with error codes version).
+	copy_in_writer<Stream> copy_in(
+		std::string_view statement,
+		const std::vector<std::int32_t>& column_types,
+		error_code& err,
+		error_info& info
+	)
+	{
+		err.clear();
+		info.clear();
+		enqueue_query(operation_type::copy_in, statement);
+		auto msg = channel_.read_message(err);
+		if (err) return copy_in_writer<Stream>();
+		if (msg.type == error_response_message_type)
+		{
+			channel_.handle_error_response(msg, err, info);
+			return copy_in_writer<Stream>();
+		}
+		if (msg.type != copy_in_response_message::message_type)
+		{
+			// Not a COPY ... FROM STDIN
+			channel_.discard_unexpected_response(msg, err);
+			return copy_in_writer<Stream>();
+		}
+		copy_in_response_message response;
+		deserialization_context ctx (msg.body);
+		err = deserialize_message(response, ctx);
+		if (err) return copy_in_writer<Stream>();
+		return copy_in_writer<Stream>(channel_, std::move(response), column_types);
+	}
+
+	/**
+	 * \brief Starts a COPY ... FROM STDIN statement (async version).
+	 * \details The handler signature is void(error_code, copy_in_writer<Stream>).
+	 * The statement is serialized before this function returns.
+	 */
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, copy_in_writer<Stream>))
+	async_copy_in(std::string_view statement, CompletionToken&& token, error_info* info=nullptr)
+	{
+		return async_copy_in(statement, {}, std::forward<CompletionToken>(token), info);
+	}
+
+	/// Starts a COPY ... FROM STDIN statement, declaring column types (async version).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, copy_in_writer<Stream>))
+	async_copy_in(
+		std::string_view statement,
+		const std::vector<std::int32_t>& column_types,
+		CompletionToken&& token,
+		error_info* info=nullptr
+	)
+	{
+		conditional_clear(info);
+		enqueue_query(operation_type::copy_in, statement);
+		return boost::asio::async_compose<CompletionToken, void(error_code, copy_in_writer<Stream>)>(
+			copy_in_op{channel_, column_types, info}, token, next_layer_);
+	}
+
+	/**
+	 * \brief Runs a COPY ... TO STDOUT statement, passing the data to sink.
+	 * \details sink is called with the payload of each CopyData message,
+	 * as a std::string_view into the connection's read buffer, valid only
+	 * during the call. See make_binary_copy_sink() to decode binary data.
+	 * Returns the number of rows copied.
+	 */
+	template <typename Sink>
+	std::uint64_t copy_out(std::string_view statement, Sink&& sink)
+	{
+		error_code err;
+		error_info info;
+		std::uint64_t res = copy_out(statement, std::forward<Sink>(sink), err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Runs a COPY ... TO STDOUT statement, passing the data to sink (sync with error codes version).
+	template <typename Sink>
+	std::uint64_t copy_out(std::string_view statement, Sink&& sink, error_code& err, error_info& info)
+	{
+		err.clear();
+		info.clear();
+		enqueue_query(operation_type::copy_out, statement);
+		return read_copy_out_response(channel_, sink, err, info);
+	}
+
+	/**
+	 * \brief Runs a COPY ... TO STDOUT statement, passing the data to sink (async version).
+	 * \details The handler signature is void(error_code, std::uint64_t), where
+	 * the second argument is the number of rows copied. sink is moved into the operation.
+	 */
+	template <typename Sink, typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, std::uint64_t))
+	async_copy_out(std::string_view statement, Sink&& sink, CompletionToken&& token, error_info* info=nullptr)
+	{
+		conditional_clear(info);
+		enqueue_query(operation_type::copy_out, statement);
+		return async_read_copy_out_response(channel_, std::forward<Sink>(sink), info,
+			std::forward<CompletionToken>(token));
+	}
+};
+
+// Async operation implementations
+template <typename Stream>
+struct connection<Stream>::handshake_op : boost::asio::coroutine
+{
+	channel_type& channel_;
+	connection_params params_;
+	error_info* info_;
+	scram_client scram_;
+	bool ssl_accepted_ {false};
+
+	handshake_op(channel_type& chan, const connection_params& params, error_info* info) noexcept:
+		channel_(chan), params_(params), info_(info) {}
+
+	// Completion of the read of the SSLRequest response
+	template <typename Self>
+	void operator()(Self& self, error_code err, std::size_t)
+	{
+		(*this)(self, err);
+	}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			if (check_ssl_mode(params_))
+			{
+				BOOST_ASIO_CORO_YIELD boost::asio::post(channel_.next_layer().get_executor(), std::move(self));
+				self.complete(check_ssl_mode(params_));
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			if (ssl_requested(params_))
+			{
+				// Ask for TLS and read the single byte answer, directly from the socket
+				channel_.enqueue(ssl_request_message{}, false);
+				BOOST_ASIO_CORO_YIELD channel_.async_flush(std::move(self));
+				if (!err)
+				{
+					BOOST_ASIO_CORO_YIELD async_read_ssl_response(channel_, std::move(self));
+					err = process_ssl_response(channel_, params_, err, ssl_accepted_);
+				}
+				if (!err && ssl_accepted_)
+				{
+					prepare_ssl_session(channel_);
+					BOOST_ASIO_CORO_YIELD async_ssl_handshake(channel_, std::move(self));
+					channel_.set_ssl_active(!err);
+				}
+				if (err)
+				{
+					self.complete(err);
+					BOOST_ASIO_CORO_YIELD break;
+				}
+			}
+
+			// Startup, then authentication exchanges and parameter statuses until
+			// ready for query. The server closes the connection after sending an
+			// error during startup, so there is no need to resync
+			enqueue_startup(channel_, params_);
+			do
+			{
+				BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+				if (!err) err = process_message(channel_, params_, scram_, msg, info_);
+				if (err)
+				{
+					self.complete(err);
+					BOOST_ASIO_CORO_YIELD break;
+				}
+			} while (msg.type != ready_for_query_message::message_type);
+
+			self.complete(error_code());
+		}
+	}
+
+	static void enqueue_startup(channel_type& chan, const connection_params& params)
+	{
+		chan.begin_operation(operation_type::handshake);
+		chan.enqueue(startup_message{
 			196608,
 			string_null("user"),
 			string_null(params.username),
 			string_null("database"),
 			string_null(params.database)
 		}, false);
+	}
 
-		// Auth request
-		authentication_request req;
-		channel_.read(req);
+	// TLS can't be required on streams that can't negotiate it
+	static error_code check_ssl_mode(const connection_params& params) noexcept
+	{
+		if (!is_ssl_stream<Stream>::value && params.ssl == ssl_mode::require)
+		{
+			return make_error_code(errc::ssl_unavailable);
+		}
+		return error_code();
+	}
 
-		// Auth response
-		if (req.auth_type != 5) throw std::runtime_error("Unknown auth type");
-		std::string auth_res = auth_md5(params.username, params.password, req.auth_data.value);
-		channel_.write(password_message{
-			string_null(auth_res)
-		});
+	static bool ssl_requested(const connection_params& params) noexcept
+	{
+		return is_ssl_stream<Stream>::value && params.ssl != ssl_mode::disable;
+	}
 
-		// Read until ready for query
-		std::uint8_t msg_type = 0;
-		while (msg_type != 0x5a)
+	// The SSLRequest response is read into the shared buffer, which is empty
+	// after sending the request. Reading exactly one byte ensures no unencrypted
+	// data sent by a man in the middle is processed after it
+	static void read_ssl_response(channel_type& chan, error_code& err)
+	{
+		if constexpr (is_ssl_stream<Stream>::value)
 		{
-			channel_.read(channel_.shared_buffer(), msg_type);
+			chan.shared_buffer().resize(1);
+			boost::asio::read(chan.next_layer().next_layer(), boost::asio::buffer(chan.shared_buffer()), err);
 		}
 	}
 
-	resultset<Stream> query(std::string_view query_string)
+	template <typename Self>
+	static void async_read_ssl_response(channel_type& chan, Self&& self)
 	{
-		// Issue a query
-		channel_.write(query_message{
-			string_null(query_string)
-		});
+		if constexpr (is_ssl_stream<Stream>::value)
+		{
+			chan.shared_buffer().resize(1);
+			boost::asio::async_read(chan.next_layer().next_layer(), boost::asio::buffer(chan.shared_buffer()),
+				std::forward<Self>(self));
+		}
+	}
 
-		// We may get row descriptions or command completion
-		bytestring meta_buff;
-		std::uint8_t msg_type = 0;
-		channel_.read(meta_buff, msg_type);
-		deserialization_context ctx (boost::asio::buffer(meta_buff));
+	// Checks the SSLRequest response, given the result of reading it
+	static error_code process_ssl_response(
+		channel_type& chan,
+		const connection_params& params,
+		error_code read_err,
+		bool& accepted
+	)
+	{
+		std::uint8_t response = chan.shared_buffer()[0];
+		chan.shared_buffer().clear();
+		if (read_err) return read_err;
+		accepted = response == 'S';
+		if (response == 'N' && params.ssl == ssl_mode::require) return make_error_code(errc::ssl_unavailable);
+		if (response != 'S' && response != 'N') return make_error_code(errc::unexpected_message);
+		return error_code();
+	}
 
-		if (msg_type == row_description::message_type)
+	static void prepare_ssl_session(channel_type& chan)
+	{
+		if constexpr (is_ssl_stream<Stream>::value)
 		{
-			row_description descrs;
-			check_error_code(deserialize_message(descrs, ctx), error_info());
-			return resultset<Stream>(channel_, make_resultset_metadata(descrs, std::move(meta_buff)));
+			ssl_session_cache::global().prepare(chan.next_layer().native_handle(),
+				ssl_session_cache::make_key(chan.next_layer()));
 		}
-		else if (msg_type == 'C') // complete
+	}
+
+	static void ssl_handshake(channel_type& chan, error_code& err)
+	{
+		if constexpr (is_ssl_stream<Stream>::value)
 		{
-			ready_for_query_message ready;
-			channel_.read(ready);
-			return resultset<Stream>(channel_);
+			chan.next_layer().handshake(boost::asio::ssl::stream_base::client, err);
 		}
-		else
+	}
+
+	template <typename Self>
+	static void async_ssl_handshake(channel_type& chan, Self&& self)
+	{
+		if constexpr (is_ssl_stream<Stream>::value)
 		{
-			throw std::runtime_error("Unknown message type");
+			chan.next_layer().async_handshake(boost::asio::ssl::stream_base::client, std::forward<Self>(self));
 		}
 	}
 
-	prepared_statement<Stream> prepare_statement(std::string_view statement)
+	// Handles a message received during startup, enqueuing the responses to auth requests
+	static error_code process_message(
+		channel_type& chan,
+		const connection_params& params,
+		scram_client& scram,
+		const message_view& msg,
+		error_info* info
+	)
 	{
-		// Generate a name
-		std::string name = "__psql_asio_" + std::to_string(curr_stmt_num_++);
+		if (msg.type == error_response_message_type)
+		{
+			conditional_parse_error_response(msg, info);
+			return make_error_code(errc::server_error);
+		}
+		if (msg.type != authentication_request::message_type)
+		{
+			return error_code(); // BackendKeyData or ReadyForQuery
+		}
+		authentication_request req {};
+		deserialization_context ctx (msg.body);
+		error_code err = deserialize_message(req, ctx);
+		if (err) return err;
+		std::string response;
+		switch (req.auth_type)
+		{
+		case auth_type::ok:
+			// Don't let the server skip proving it knows the password
+			if (scram.in_progress()) return make_error_code(errc::server_verification_failed);
+			return error_code();
+		case auth_type::md5_password:
+			response = auth_md5(params.username, params.password, req.auth_data.value);
+			chan.enqueue(password_message{
+				string_null(response)
+			});
+			return error_code();
+		case auth_type::sasl:
+			if (!scram_client::is_offered(req.auth_data.value))
+			{
+				return make_error_code(errc::unsupported_auth_method);
+			}
+			err = make_error_code(scram.start(response));
+			if (!err)
+			{
+				chan.enqueue(sasl_initial_response_message{
+					string_null(scram_client::mechanism),
+					string_lenenc(response)
+				});
+			}
+			return err;
+		case auth_type::sasl_continue:
+			err = make_error_code(scram.process_server_first(
+				req.auth_data.value, params.username, params.password, response));
+			if (!err)
+			{
+				chan.enqueue(sasl_response_message{
+					string_eof(response)
+				});
+			}
+			return err;
+		case auth_type::sasl_final:
+			return make_error_code(scram.process_server_final(req.auth_data.value));
+		default:
+			return make_error_code(errc::unsupported_auth_method);
+		}
+	}
+};
 
-		// Issue a Parse
-		channel_.write(parse_message{
-			string_null(name),
-			string_null(statement)
-		});
-		channel_.write(flush_message{});
+template <typename Stream>
+struct connection<Stream>::prepare_statement_op : boost::asio::coroutine
+{
+	connection<Stream>& conn_;
+	std::string key_;
+	std::string name_;
+	std::string sql_;
+	std::shared_ptr<const statement_info> result_; // set in advance on cache hits
+	error_info* info_;
 
-		// Read response
-		parse_complete_message res;
-		channel_.read(res);
+	prepare_statement_op(
+		connection<Stream>& conn,
+		std::string&& key,
+		std::string&& name,
+		std::string&& sql,
+		std::shared_ptr<const statement_info>&& cached,
+		error_info* info
+	) noexcept:
+		conn_(conn), key_(std::move(key)), name_(std::move(name)), sql_(std::move(sql)),
+		result_(std::move(cached)), info_(info) {}
 
-		return prepared_statement<Stream>(channel_, std::move(name));
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, statement_description descr = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			if (result_)
+			{
+				BOOST_ASIO_CORO_YIELD boost::asio::post(conn_.next_layer_.get_executor(), std::move(self));
+			}
+			else
+			{
+				BOOST_ASIO_CORO_YIELD async_read_prepare_response(conn_.channel_, info_, std::move(self));
+				if (!err) result_ = conn_.add_statement(std::move(key_), std::move(name_), sql_, std::move(descr));
+			}
+			self.complete(err, err ?
+				prepared_statement<Stream>() :
+				prepared_statement<Stream>(conn_.channel_, std::move(result_)));
+		}
+	}
+};
+
+template <typename Stream>
+struct connection<Stream>::copy_in_op : boost::asio::coroutine
+{
+	channel_type& channel_;
+	std::vector<std::int32_t> column_types_;
+	error_info* info_;
+
+	copy_in_op(channel_type& chan, const std::vector<std::int32_t>& column_types, error_info* info):
+		channel_(chan), column_types_(column_types), info_(info) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		copy_in_response_message response;
+
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err && msg.type == error_response_message_type)
+			{
+				BOOST_ASIO_CORO_YIELD channel_.async_handle_error_response(msg, info_, std::move(self));
+			}
+			else if (!err && msg.type != copy_in_response_message::message_type)
+			{
+				BOOST_ASIO_CORO_YIELD channel_.async_discard_unexpected_response(msg, std::move(self));
+			}
+			else if (!err)
+			{
+				deserialization_context ctx (msg.body);
+				err = deserialize_message(response, ctx);
+			}
+			self.complete(err, err ?
+				copy_in_writer<Stream>() :
+				copy_in_writer<Stream>(channel_, std::move(response), std::move(column_types_)));
+		}
 	}
 };
 
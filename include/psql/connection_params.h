@@ -7,11 +7,25 @@ namespace psql
 {
 
 
+/**
+ * \brief Whether to negotiate TLS.
+ * \details TLS is negotiated by connections over a boost::asio::ssl::stream.
+ * Over other streams, disable and enable connect unencrypted, and require
+ * fails with errc::ssl_unavailable.
+ */
+enum class ssl_mode
+{
+	disable, ///< Never use TLS.
+	enable,  ///< Use TLS if the server supports it, or continue unencrypted.
+	require  ///< Use TLS, failing with errc::ssl_unavailable if it can't be used.
+};
+
 struct connection_params
 {
 	std::string_view username;
 	std::string_view password;
 	std::string_view database;
+	ssl_mode ssl {ssl_mode::enable};
 };
 
 }
@@ -0,0 +1,673 @@
+#ifndef INCLUDE_PSQL_CONNECTION_POOL_H_
+#define INCLUDE_PSQL_CONNECTION_POOL_H_
+
+#include "psql/connection.h"
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/post.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace psql
+{
+
+/// Configuration for a connection_pool.
+struct pool_params
+{
+	/// Number of connections kept open, even if they are idle.
+	std::size_t min_size {1};
+
+	/// Maximum number of connections, including the ones being established.
+	std::size_t max_size {16};
+
+	/// Time a checkout waits for a connection before failing with errc::pool_timeout.
+	std::chrono::steady_clock::duration checkout_timeout {std::chrono::seconds(30)};
+
+	/// Connections idle for longer than this are closed, as long as there are more than min_size.
+	std::chrono::steady_clock::duration idle_timeout {std::chrono::minutes(10)};
+
+	/// Connections are closed once they are this old, and replaced if needed. Zero means no limit.
+	std::chrono::steady_clock::duration max_lifetime {std::chrono::hours(1)};
+
+	/// How often idle connections are checked against idle_timeout and max_lifetime.
+	std::chrono::steady_clock::duration sweep_interval {std::chrono::seconds(10)};
+
+	/// Time to wait before establishing connections again after an attempt fails.
+	std::chrono::steady_clock::duration retry_interval {std::chrono::seconds(1)};
+};
+
+// Private, do not use. The index of the idle list used by the calling thread.
+// Threads are spread evenly across lists, in the order they first use a pool
+inline std::size_t pool_home_shard(std::size_t num_shards) noexcept
+{
+	static std::atomic<std::size_t> next_thread_index {0};
+	thread_local std::size_t thread_index = next_thread_index.fetch_add(1, std::memory_order_relaxed);
+	return thread_index % num_shards;
+}
+
+/**
+ * \brief Private, do not use. State shared by a pool, its checked out connections and its background operations.
+ * \details Idle connections are kept in several lists (shards), each with its own
+ * mutex. Threads check connections out from and return them to their own shard,
+ * so a checkout that finds an idle connection only contends with threads using
+ * the same shard. All other state is protected by mtx_, which may be held while
+ * locking a shard, but not the other way around. Timers are only accessed with mtx_ held.
+ */
+template <typename Stream>
+class pool_state : public std::enable_shared_from_this<pool_state<Stream>>
+{
+public:
+	using clock = std::chrono::steady_clock;
+	using executor_type = typename Stream::executor_type;
+	using connect_function = std::function<void(Stream&, std::function<void(error_code)>)>;
+
+	struct node
+	{
+		connection<Stream> conn;
+		clock::time_point created;
+		clock::time_point last_used;
+
+		explicit node(const executor_type& ex): conn(ex), created(clock::now()), last_used(created) {}
+		node(const executor_type& ex, boost::asio::ssl::context& ssl_ctx):
+			conn(ex, ssl_ctx), created(clock::now()), last_used(created) {}
+	};
+	using node_ptr = std::unique_ptr<node>;
+
+	// A checkout waiting for a connection. Woken up by cancelling its timer
+	struct waiter
+	{
+		boost::asio::steady_timer timer;
+		node_ptr result;
+		error_code err;
+
+		explicit waiter(const executor_type& ex): timer(ex) {}
+	};
+private:
+	struct alignas(64) shard
+	{
+		std::mutex mtx;
+		std::vector<node_ptr> idle;
+	};
+
+	executor_type ex_;
+	pool_params params_;
+	std::string username_, password_, database_;
+	connection_params conn_params_; // views into the strings above
+	boost::asio::ssl::context* ssl_ctx_; // for SSL streams
+	connect_function connect_;
+	std::size_t num_shards_;
+	std::unique_ptr<shard[]> shards_;
+	std::atomic<std::size_t> num_waiters_ {0}; // waiters_.size(), readable without locking
+	std::atomic<bool> closed_ {false};
+
+	std::mutex mtx_;
+	std::deque<std::shared_ptr<waiter>> waiters_;
+	std::size_t size_ {0};            // open connections, including the ones being established
+	std::size_t num_connecting_ {0};
+	bool retry_pending_ {false};
+	error_code last_error_;            // of the last failed connection attempt
+	std::string last_error_message_;
+	boost::asio::steady_timer sweep_timer_;
+	boost::asio::steady_timer retry_timer_;
+
+	bool expired(const node& n, clock::time_point now) const noexcept
+	{
+		return params_.max_lifetime != clock::duration::zero() && now - n.created >= params_.max_lifetime;
+	}
+
+	node_ptr pop_shard(shard& s)
+	{
+		if (s.idle.empty()) return nullptr;
+		node_ptr res = std::move(s.idle.back());
+		s.idle.pop_back();
+		return res;
+	}
+
+	void push_shard(shard& s, node_ptr n)
+	{
+		std::lock_guard<std::mutex> lock (s.mtx);
+		s.idle.push_back(std::move(n)); // never reallocates, see constructor
+	}
+
+	// Gets an idle connection, from any shard. Requires mtx_
+	node_ptr pop_any()
+	{
+		for (std::size_t i = 0; i < num_shards_; ++i)
+		{
+			std::lock_guard<std::mutex> lock (shards_[i].mtx);
+			if (node_ptr res = pop_shard(shards_[i])) return res;
+		}
+		return nullptr;
+	}
+
+	// Completes the first waiter. Requires mtx_
+	void wake_first(node_ptr n, error_code err)
+	{
+		std::shared_ptr<waiter> w = std::move(waiters_.front());
+		waiters_.pop_front();
+		--num_waiters_;
+		w->result = std::move(n);
+		w->err = err;
+		w->timer.cancel();
+	}
+
+	// Hands idle connections to waiters. Requires mtx_
+	void serve_waiters()
+	{
+		while (!waiters_.empty())
+		{
+			node_ptr n = pop_any();
+			if (!n) break;
+			wake_first(std::move(n), error_code());
+		}
+	}
+
+	// Starts establishing connections, if there are less than min_size or
+	// not enough for the waiters. Requires mtx_
+	void maybe_connect()
+	{
+		while (
+			!closed_ &&
+			!retry_pending_ &&
+			size_ < params_.max_size &&
+			(size_ < params_.min_size || num_connecting_ < waiters_.size())
+		)
+		{
+			++size_;
+			++num_connecting_;
+			boost::asio::post(ex_, [self = this->shared_from_this()] { self->connect(); });
+		}
+	}
+
+	// Transport connection, then handshake. std::function requires a copyable
+	// handler, so the node is shared until the connection is established
+	void connect()
+	{
+		node_ptr created;
+		if constexpr (is_ssl_stream<Stream>::value) created = std::make_unique<node>(ex_, *ssl_ctx_);
+		else created = std::make_unique<node>(ex_);
+		auto n = std::make_shared<node_ptr>(std::move(created));
+		auto info = std::make_shared<error_info>();
+		auto self = this->shared_from_this();
+		connect_((*n)->conn.next_layer(), [self, n, info](error_code err) {
+			if (err)
+			{
+				self->on_connect(std::move(*n), err, *info);
+				return;
+			}
+			(*n)->conn.async_handshake(self->conn_params_, [self, n, info](error_code err) {
+				self->on_connect(std::move(*n), err, *info);
+			}, info.get());
+		});
+	}
+
+	void on_connect(node_ptr n, error_code err, const error_info& info)
+	{
+		std::lock_guard<std::mutex> lock (mtx_);
+		--num_connecting_;
+		if (err || closed_)
+		{
+			--size_;
+			if (err && !closed_)
+			{
+				last_error_ = err;
+				last_error_message_ = info.message();
+				schedule_retry();
+			}
+			return;
+		}
+		n->created = n->last_used = clock::now();
+		if (!waiters_.empty())
+		{
+			wake_first(std::move(n), error_code());
+		}
+		else
+		{
+			push_shard(shards_[pool_home_shard(num_shards_)], std::move(n));
+		}
+	}
+
+	// Requires mtx_
+	void schedule_retry()
+	{
+		if (retry_pending_) return;
+		retry_pending_ = true;
+		retry_timer_.expires_after(params_.retry_interval);
+		retry_timer_.async_wait([self = this->shared_from_this()](error_code) {
+			std::lock_guard<std::mutex> lock (self->mtx_);
+			self->retry_pending_ = false;
+			self->maybe_connect();
+		});
+	}
+
+	// Requires mtx_
+	void schedule_sweep()
+	{
+		sweep_timer_.expires_after(params_.sweep_interval);
+		sweep_timer_.async_wait([self = this->shared_from_this()](error_code err) {
+			if (!err) self->sweep();
+		});
+	}
+
+	// Closes idle connections that have reached max_lifetime or idle_timeout
+	void sweep()
+	{
+		std::vector<node_ptr> removed;
+		std::lock_guard<std::mutex> lock (mtx_);
+		if (closed_) return;
+		auto now = clock::now();
+		for (std::size_t i = 0; i < num_shards_; ++i)
+		{
+			std::lock_guard<std::mutex> shard_lock (shards_[i].mtx);
+			auto& idle = shards_[i].idle;
+			for (auto it = idle.begin(); it != idle.end();)
+			{
+				bool idle_expired = now - (*it)->last_used >= params_.idle_timeout && size_ > params_.min_size;
+				if (idle_expired || expired(**it, now))
+				{
+					removed.push_back(std::move(*it));
+					it = idle.erase(it);
+					--size_;
+				}
+				else
+				{
+					++it;
+				}
+			}
+		}
+		maybe_connect();
+		schedule_sweep();
+	}
+public:
+	pool_state(
+		const executor_type& ex,
+		const pool_params& params,
+		const connection_params& conn_params,
+		connect_function connect,
+		boost::asio::ssl::context* ssl_ctx = nullptr
+	):
+		ex_(ex),
+		params_(params),
+		username_(conn_params.username),
+		password_(conn_params.password),
+		database_(conn_params.database),
+		conn_params_{username_, password_, database_, conn_params.ssl},
+		ssl_ctx_(ssl_ctx),
+		connect_(std::move(connect)),
+		num_shards_(std::clamp<std::size_t>(std::thread::hardware_concurrency(), 1, std::max<std::size_t>(params.max_size, 1))),
+		shards_(new shard[num_shards_]),
+		sweep_timer_(ex),
+		retry_timer_(ex)
+	{
+		// Returning a connection must not allocate, as it happens in destructors
+		for (std::size_t i = 0; i < num_shards_; ++i)
+		{
+			shards_[i].idle.reserve(params_.max_size);
+		}
+	}
+
+	const executor_type& get_executor() const noexcept { return ex_; }
+	const pool_params& params() const noexcept { return params_; }
+
+	void start()
+	{
+		std::lock_guard<std::mutex> lock (mtx_);
+		maybe_connect();
+		schedule_sweep();
+	}
+
+	// Fast path: an idle connection from the thread's own shard, or from any
+	// other shard that is not locked at the moment. Never waits for other threads
+	// except the ones using the same shard.
+	node_ptr try_checkout()
+	{
+		std::size_t home = pool_home_shard(num_shards_);
+		for (std::size_t i = 0; i < num_shards_; ++i)
+		{
+			shard& s = shards_[(home + i) % num_shards_];
+			std::unique_lock<std::mutex> lock (s.mtx, std::defer_lock);
+			if (i == 0) lock.lock();
+			else if (!lock.try_lock()) continue;
+			node_ptr res = pop_shard(s);
+			lock.unlock();
+			if (!res) continue;
+			if (expired(*res, clock::now()))
+			{
+				discard(std::move(res));
+				--i; // look in the same shard again
+				continue;
+			}
+			return res;
+		}
+		return nullptr;
+	}
+
+	/**
+	 * \brief Slow path: waits for a connection, using w's timer.
+	 * \details The handler is called when a connection is available, the
+	 * checkout times out or the pool is closed. Completing never happens
+	 * from within this function. Checking shards again and registering the
+	 * waiter are done atomically, so no connection released in between is missed.
+	 */
+	template <typename Handler>
+	void async_wait(const std::shared_ptr<waiter>& w, Handler&& handler)
+	{
+		std::lock_guard<std::mutex> lock (mtx_);
+		++num_waiters_; // before looking at the shards, see release()
+		if (closed_)
+		{
+			--num_waiters_;
+			w->err = make_error_code(errc::pool_closed);
+			w->timer.expires_at(clock::time_point::min());
+		}
+		else if (node_ptr n = pop_any())
+		{
+			--num_waiters_;
+			w->result = std::move(n);
+			w->timer.expires_at(clock::time_point::min());
+		}
+		else
+		{
+			waiters_.push_back(w);
+			maybe_connect();
+			w->timer.expires_after(params_.checkout_timeout);
+		}
+		w->timer.async_wait(std::forward<Handler>(handler));
+	}
+
+	// Called once a waiter's timer has completed. Returns the error to report, if any
+	error_code finish_wait(waiter& w, error_info* info)
+	{
+		std::lock_guard<std::mutex> lock (mtx_);
+		if (w.result || w.err) return w.err;
+
+		// Timed out. It's still in the queue
+		auto it = std::find_if(waiters_.begin(), waiters_.end(), [&w](const auto& p) { return p.get() == &w; });
+		if (it != waiters_.end())
+		{
+			waiters_.erase(it);
+			--num_waiters_;
+		}
+		if (last_error_)
+		{
+			conditional_assign(info, error_info("Last connection attempt failed: " + last_error_.message() +
+				(last_error_message_.empty() ? "" : " (" + last_error_message_ + ")")));
+		}
+		return make_error_code(errc::pool_timeout);
+	}
+
+	// Returns a connection to the pool, unless it can't be reused: connections
+	// with responses left unread, in a transaction or broken are closed
+	void release(node_ptr n)
+	{
+		auto now = clock::now();
+		if (closed_ || expired(*n, now) || !n->conn.idle())
+		{
+			discard(std::move(n));
+			return;
+		}
+		n->last_used = now;
+		push_shard(shards_[pool_home_shard(num_shards_)], std::move(n));
+
+		// Either this sees the waiter, or the waiter sees the connection
+		// (whoever locks the shard last), so wake ups can't be lost
+		if (num_waiters_ > 0)
+		{
+			std::lock_guard<std::mutex> lock (mtx_);
+			serve_waiters();
+		}
+	}
+
+	// Closes a connection, opening another one if needed
+	void discard(node_ptr n)
+	{
+		{
+			std::lock_guard<std::mutex> lock (mtx_);
+			--size_;
+			maybe_connect();
+		}
+		n.reset();
+	}
+
+	void close()
+	{
+		std::vector<node_ptr> removed;
+		std::lock_guard<std::mutex> lock (mtx_);
+		if (closed_) return;
+		closed_ = true;
+		sweep_timer_.cancel();
+		retry_timer_.cancel();
+		for (std::size_t i = 0; i < num_shards_; ++i)
+		{
+			std::lock_guard<std::mutex> shard_lock (shards_[i].mtx);
+			for (auto& n: shards_[i].idle) removed.push_back(std::move(n));
+			shards_[i].idle.clear();
+		}
+		size_ -= removed.size();
+		while (!waiters_.empty())
+		{
+			wake_first(nullptr, make_error_code(errc::pool_closed));
+		}
+	}
+
+	std::size_t size()
+	{
+		std::lock_guard<std::mutex> lock (mtx_);
+		return size_;
+	}
+
+	std::size_t idle_size()
+	{
+		std::size_t res = 0;
+		for (std::size_t i = 0; i < num_shards_; ++i)
+		{
+			std::lock_guard<std::mutex> lock (shards_[i].mtx);
+			res += shards_[i].idle.size();
+		}
+		return res;
+	}
+};
+
+/**
+ * \brief A connection checked out from a connection_pool.
+ * \details Returns the connection to the pool when destroyed. A connection
+ * is only reused if it's idle (see connection::idle()): connections returned
+ * with results left unread, in a transaction block or after a network error
+ * are closed instead. Call discard() if an operation failed in a way that may
+ * have left the connection in an unknown state (e.g. an exception while reading rows).
+ */
+template <typename Stream>
+class pooled_connection
+{
+	using state_type = pool_state<Stream>;
+
+	std::shared_ptr<state_type> pool_;
+	typename state_type::node_ptr node_;
+public:
+	/// Default constructor.
+	pooled_connection() = default;
+
+	// Private, do not use
+	pooled_connection(std::shared_ptr<state_type> pool, typename state_type::node_ptr&& node) noexcept:
+		pool_(std::move(pool)), node_(std::move(node)) {}
+
+	pooled_connection(pooled_connection&&) noexcept = default;
+	pooled_connection& operator=(pooled_connection&& rhs) noexcept
+	{
+		if (this != &rhs)
+		{
+			reset();
+			pool_ = std::move(rhs.pool_);
+			node_ = std::move(rhs.node_);
+		}
+		return *this;
+	}
+	~pooled_connection() { reset(); }
+
+	bool valid() const noexcept { return node_ != nullptr; }
+
+	connection<Stream>& get() const noexcept { assert(node_); return node_->conn; }
+	connection<Stream>& operator*() const noexcept { return get(); }
+	connection<Stream>* operator->() const noexcept { return &get(); }
+
+	/// Returns the connection to the pool.
+	void reset() noexcept
+	{
+		if (node_) pool_->release(std::move(node_));
+		pool_.reset();
+	}
+
+	/// Closes the connection instead of returning it to the pool.
+	void discard() noexcept
+	{
+		if (node_) pool_->discard(std::move(node_));
+		pool_.reset();
+	}
+};
+
+/**
+ * \brief A thread-safe pool of connections.
+ * \details Connections are established and authenticated in the background,
+ * so checking one out doesn't involve any handshake, unless all existing
+ * connections are in use. connect is called to establish the transport
+ * (e.g. to connect a TCP socket to the server), and the pool performs the
+ * handshake using conn_params, which are copied. Any member may be called from
+ * any thread. Checked out connections must not be used concurrently, as usual.
+ *
+ * Checking out a connection when one is idle only locks a mutex that is
+ * mostly used by the calling thread. Checkouts that find no idle connection
+ * wait in a queue, served in order, and fail with errc::pool_timeout after
+ * pool_params::checkout_timeout.
+ *
+ * Destroying the pool closes idle connections and fails waiting checkouts with
+ * errc::pool_closed. Checked out connections may outlive the pool.
+ */
+template <typename Stream>
+class connection_pool
+{
+	using state_type = pool_state<Stream>;
+
+	struct checkout_op;
+
+	std::shared_ptr<state_type> state_;
+public:
+	using executor_type = typename state_type::executor_type;
+
+	/// Establishes the transport of a connection, calling the handler once done.
+	using connect_function = typename state_type::connect_function;
+
+	connection_pool(
+		const executor_type& ex,
+		const pool_params& params,
+		const connection_params& conn_params,
+		connect_function connect
+	):
+		state_(std::make_shared<state_type>(ex, params, conn_params, std::move(connect)))
+	{
+		static_assert(!is_ssl_stream<Stream>::value, "Pools of SSL streams need an ssl::context");
+		state_->start();
+	}
+
+	/**
+	 * \brief Constructs a pool of connections over SSL streams, created with ssl_ctx.
+	 * \details ssl_ctx must outlive the pool and its connections. TLS is
+	 * negotiated by the handshake, as set by conn_params.ssl.
+	 */
+	connection_pool(
+		const executor_type& ex,
+		const pool_params& params,
+		const connection_params& conn_params,
+		connect_function connect,
+		boost::asio::ssl::context& ssl_ctx
+	):
+		state_(std::make_shared<state_type>(ex, params, conn_params, std::move(connect), &ssl_ctx))
+	{
+		static_assert(is_ssl_stream<Stream>::value, "The ssl::context is only used by SSL streams");
+		state_->start();
+	}
+	connection_pool(const connection_pool&) = delete;
+	connection_pool(connection_pool&&) = default;
+	connection_pool& operator=(const connection_pool&) = delete;
+	connection_pool& operator=(connection_pool&&) = delete;
+	~connection_pool() { if (state_) state_->close(); }
+
+	/// The executor used for background operations and the pool's connections.
+	executor_type get_executor() const noexcept { return state_->get_executor(); }
+
+	/// The number of open connections, including the ones being established.
+	std::size_t size() const { return state_->size(); }
+
+	/// The number of idle connections.
+	std::size_t idle_size() const { return state_->idle_size(); }
+
+	/// Checks out an idle connection, without waiting. The result is not valid if there is none.
+	pooled_connection<Stream> try_checkout()
+	{
+		return pooled_connection<Stream>(state_, state_->try_checkout());
+	}
+
+	/**
+	 * \brief Checks out a connection, waiting for one if none is idle.
+	 * \details The handler signature is void(error_code, pooled_connection<Stream>).
+	 * If the checkout times out after failing to establish connections, info
+	 * contains the reason.
+	 */
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, pooled_connection<Stream>))
+	async_checkout(CompletionToken&& token, error_info* info=nullptr)
+	{
+		conditional_clear(info);
+		return boost::asio::async_compose<CompletionToken, void(error_code, pooled_connection<Stream>)>(
+			checkout_op{state_, info}, token, state_->get_executor());
+	}
+
+	/// Closes idle connections and fails waiting checkouts. No new connections are established.
+	void close() { state_->close(); }
+};
+
+template <typename Stream>
+struct connection_pool<Stream>::checkout_op : boost::asio::coroutine
+{
+	std::shared_ptr<state_type> pool_;
+	error_info* info_;
+	std::shared_ptr<typename state_type::waiter> waiter_;
+	typename state_type::node_ptr result_;
+
+	checkout_op(std::shared_ptr<state_type> pool, error_info* info) noexcept:
+		pool_(std::move(pool)), info_(info) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			// Fast path
+			result_ = pool_->try_checkout();
+			if (result_)
+			{
+				BOOST_ASIO_CORO_YIELD boost::asio::post(pool_->get_executor(), std::move(self));
+				self.complete(error_code(), pooled_connection<Stream>(pool_, std::move(result_)));
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			// Wait for a connection to be returned or established
+			waiter_ = std::make_shared<typename state_type::waiter>(pool_->get_executor());
+			BOOST_ASIO_CORO_YIELD pool_->async_wait(waiter_, std::move(self));
+			err = pool_->finish_wait(*waiter_, info_);
+			self.complete(err, err ?
+				pooled_connection<Stream>() :
+				pooled_connection<Stream>(pool_, std::move(waiter_->result)));
+		}
+	}
+};
+
+}
+
+#endif /* INCLUDE_PSQL_CONNECTION_POOL_H_ */
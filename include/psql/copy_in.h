@@ -0,0 +1,609 @@
+#ifndef INCLUDE_PSQL_COPY_IN_H_
+#define INCLUDE_PSQL_COPY_IN_H_
+
+#include "psql/channel.h"
+#include "psql/codecs.h"
+#include "psql/typed_row.h"
+#include "psql/deserialize_row.h"
+#include <boost/endian/conversion.hpp>
+#include <algorithm>
+
+namespace psql
+{
+
+// Signature, flags and header extension length of the binary COPY format
+constexpr std::string_view binary_copy_header {"PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0", 19};
+
+// The type used to encode a value in binary COPY when the column type is not known.
+// Binary COPY data carries no types, so values are sent with the width of their own
+// type, as a wider one would corrupt narrower columns. std::uint32_t is sent as oid
+inline std::int32_t copy_type_oid(const value& v) noexcept
+{
+	if (std::holds_alternative<std::string_view>(v)) return text_oid;
+	if (std::holds_alternative<datetime>(v)) return timestamptz_oid; // same representation as timestamp
+	if (std::holds_alternative<std::uint32_t>(v)) return oid_oid;
+	return natural_type_oid(v);
+}
+
+// The same, for a member of a typed row
+template <typename T>
+constexpr std::int32_t copy_type_oid() noexcept
+{
+	if constexpr (std::is_same_v<T, bool>) return bool_oid;
+	else if constexpr (std::is_same_v<T, std::int16_t>) return int2_oid;
+	else if constexpr (std::is_same_v<T, std::int32_t>) return int4_oid;
+	else if constexpr (std::is_same_v<T, std::int64_t>) return int8_oid;
+	else if constexpr (std::is_same_v<T, std::uint32_t>) return oid_oid;
+	else if constexpr (std::is_same_v<T, float>) return float4_oid;
+	else if constexpr (std::is_same_v<T, double>) return float8_oid;
+	else if constexpr (std::is_same_v<T, date>) return date_oid;
+	else if constexpr (std::is_same_v<T, datetime>) return timestamptz_oid;
+	else if constexpr (std::is_same_v<T, time>) return time_oid;
+	else return text_oid; // std::string, std::string_view
+}
+
+template <typename T>
+value member_to_value(const T& member) noexcept
+{
+	if constexpr (std::is_same_v<T, bool> || std::is_same_v<T, std::int16_t>) return value(std::int32_t(member));
+	else if constexpr (std::is_same_v<T, std::string>) return value(std::string_view(member));
+	else return value(member);
+}
+
+// Gets the number of rows from the CommandComplete for a COPY ("COPY <n>")
+inline std::uint64_t parse_copy_count(boost::asio::const_buffer command_complete_body) noexcept
+{
+	command_complete_message msg;
+	deserialization_context ctx (command_complete_body);
+	return deserialize_message(msg, ctx) ? 0 : command_tag_rows(msg.tag.value);
+}
+
+/**
+ * \brief Sends data to the server for a COPY ... FROM STDIN statement.
+ * \details Data is accumulated in CopyData messages of about batch_size()
+ * bytes, which are sent as they fill up. Write operations only wait for I/O
+ * when a batch is sent, so the speed at which data is produced adapts to the
+ * speed at which the server consumes it.
+ *
+ * write() sends data as is, as required for text and CSV formats.
+ * write_row() encodes rows in the binary format (WITH (FORMAT binary)).
+ * Binary data carries no types, so the server reads each value as its column
+ * type. Values are encoded using the column types passed to copy_in(), or
+ * with the width of their own type if none were passed (e.g. int4 for
+ * std::int32_t and oid for std::uint32_t), which must then match the
+ * column's. Strings are sent as is, so they can only be written to string
+ * (or bytea) columns. Rows with a value that can't be encoded for its
+ * column, or with a number of values other than the number of columns,
+ * are rejected without sending anything.
+ *
+ * The operation ends with finish(), or with abort() to cancel the COPY.
+ * If the server finds an error, it is reported by finish(). No other
+ * operation may be performed on the connection until then.
+ */
+template <typename Stream>
+class copy_in_writer
+{
+	static constexpr std::size_t no_message = std::size_t(-1);
+	static constexpr std::size_t copy_data_header_size = 5; // type + length
+
+	struct write_op;
+	struct finish_op;
+	struct abort_op;
+
+	channel<Stream>* channel_ {};
+	copy_in_response_message response_ {};
+	std::vector<std::int32_t> column_types_;
+	std::size_t batch_size_ {default_batch_size};
+	std::size_t message_start_ {no_message}; // where the CopyData being filled starts in the channel's buffer
+	bool header_written_ {false};
+	bool data_written_ {false};
+
+	bytestring& buffer() noexcept { return channel_->shared_buffer(); }
+
+	// Starts a CopyData message, if there is not one being filled
+	void begin_message()
+	{
+		data_written_ = true;
+		if (message_start_ != no_message) return;
+		message_start_ = buffer().size();
+		buffer().insert(buffer().end(), {copy_data_message_type, 0, 0, 0, 0});
+	}
+
+	// Completes the CopyData message being filled, if any, so it can be sent
+	void end_message() noexcept
+	{
+		if (message_start_ == no_message) return;
+		std::uint32_t length = boost::endian::native_to_big(std::uint32_t(buffer().size() - message_start_ - 1));
+		std::memcpy(buffer().data() + message_start_ + 1, &length, sizeof(length));
+		message_start_ = no_message;
+		channel_->on_message_framed();
+	}
+
+	std::size_t payload_size() const noexcept
+	{
+		return message_start_ == no_message ? 0 :
+			channel_->shared_buffer().size() - message_start_ - copy_data_header_size;
+	}
+
+	bool batch_full() const noexcept { return payload_size() >= batch_size_; }
+
+	void append(const void* data, std::size_t size)
+	{
+		const auto* first = static_cast<const std::uint8_t*>(data);
+		buffer().insert(buffer().end(), first, first + size);
+	}
+
+	template <typename T>
+	void append_int(T v)
+	{
+		boost::endian::native_to_big_inplace(v);
+		append(&v, sizeof(v));
+	}
+
+	// Appends as much of data as fits in the current batch, returning the number of bytes consumed
+	std::size_t append_chunk(std::string_view data)
+	{
+		if (data.empty()) return 0;
+		begin_message();
+		std::size_t size = std::min(data.size(), batch_size_ - std::min(batch_size_, payload_size()));
+		append(data.data(), size);
+		return size;
+	}
+
+	std::int32_t column_type(std::size_t index, std::int32_t default_type) const noexcept
+	{
+		return index < column_types_.size() && column_types_[index] != unspecified_oid ?
+			column_types_[index] : default_type;
+	}
+
+	// Encodes a field of a binary row. Strings are sent as is, which is only the
+	// binary representation of string types. Returns false if the value
+	// can't be represented in binary with the given type
+	bool append_field(const value& v, std::int32_t type_oid)
+	{
+		bool is_string = std::holds_alternative<std::string_view>(v);
+		if (is_string && !is_string_type(type_oid)) return false;
+		encoded_param param;
+		encode_param(v, type_oid, param);
+		if (param.format() != binary_format && !is_string) return false;
+		append_int(param.length());
+		append(param.data().data(), param.data().size());
+		return true;
+	}
+
+	template <typename T>
+	bool append_member(const T& member, std::size_t index)
+	{
+		if constexpr (non_optional<T>::is_optional)
+		{
+			if (!member)
+			{
+				append_int(std::int32_t(-1));
+				return true;
+			}
+			return append_member(*member, index);
+		}
+		else
+		{
+			return append_field(member_to_value(member), column_type(index, copy_type_oid<T>()));
+		}
+	}
+
+	template <typename T, std::size_t... I>
+	bool append_members(const T& row, std::index_sequence<I...>)
+	{
+		constexpr auto fields = get_struct_fields<T>::value;
+		return (append_member(row.*std::get<I>(fields), I) && ...);
+	}
+
+	// Encodes a binary row, writing the header first if required. If a field
+	// can't be encoded, the row is discarded and errc::unsupported_type is returned.
+	// Rows with the wrong number of fields are errc::type_mismatch
+	template <typename AppendFields>
+	errc encode_row(std::size_t num_fields, AppendFields&& append_fields)
+	{
+		assert(binary());
+		if (num_fields != response_.column_formats.size()) return errc::type_mismatch;
+		std::size_t old_size = buffer().size();
+		std::size_t old_message_start = message_start_;
+		bool old_header_written = header_written_;
+		bool old_data_written = data_written_;
+
+		begin_message();
+		if (!header_written_)
+		{
+			append(binary_copy_header.data(), binary_copy_header.size());
+			header_written_ = true;
+		}
+		append_int(std::int16_t(num_fields));
+		if (!append_fields())
+		{
+			buffer().resize(old_size);
+			message_start_ = old_message_start;
+			header_written_ = old_header_written;
+			data_written_ = old_data_written;
+			return errc::unsupported_type;
+		}
+		return errc::ok;
+	}
+
+	template <typename ForwardIterator>
+	errc encode_values(ForwardIterator first, ForwardIterator last)
+	{
+		return encode_row(std::distance(first, last), [this, first, last] {
+			std::size_t index = 0;
+			for (auto it = first; it != last; ++it, ++index)
+			{
+				if (!append_field(*it, column_type(index, copy_type_oid(*it)))) return false;
+			}
+			return true;
+		});
+	}
+
+	template <typename T>
+	errc encode_typed(const T& row)
+	{
+		constexpr std::size_t num_fields = std::tuple_size_v<std::decay_t<decltype(get_struct_fields<T>::value)>>;
+		return encode_row(num_fields, [this, &row] {
+			return append_members(row, std::make_index_sequence<num_fields>());
+		});
+	}
+
+	// Completes the data with CopyDone, and the binary trailer if required
+	void enqueue_done()
+	{
+		if (binary() && (header_written_ || !data_written_))
+		{
+			begin_message();
+			if (!header_written_) append(binary_copy_header.data(), binary_copy_header.size());
+			append_int(std::int16_t(-1)); // trailer
+		}
+		end_message();
+		channel_->enqueue(copy_done_message{});
+	}
+
+	void enqueue_fail(std::string_view reason)
+	{
+		// Data in the current message has not been sent yet, and is no longer needed
+		if (message_start_ != no_message)
+		{
+			buffer().resize(message_start_);
+			message_start_ = no_message;
+		}
+		channel_->enqueue(copy_fail_message{
+			string_null(reason)
+		});
+	}
+public:
+	/// The default value for batch_size().
+	static constexpr std::size_t default_batch_size = 64 * 1024;
+
+	/// Default constructor.
+	copy_in_writer() = default;
+
+	// Private, do not use
+	copy_in_writer(channel<Stream>& chan, copy_in_response_message&& response, std::vector<std::int32_t> column_types) noexcept:
+		channel_(&chan), response_(std::move(response)), column_types_(std::move(column_types)) {}
+
+	bool valid() const noexcept { return channel_ != nullptr; }
+
+	/// Whether the server expects binary data (the COPY statement specified FORMAT binary).
+	bool binary() const noexcept { return response_.format == binary_format; }
+
+	/// The format of each column, as reported by the server.
+	const std::vector<std::int16_t>& column_formats() const noexcept { return response_.column_formats; }
+
+	/// The number of bytes of data that are accumulated before sending them.
+	std::size_t batch_size() const noexcept { return batch_size_; }
+	void set_batch_size(std::size_t value) noexcept { batch_size_ = std::max<std::size_t>(value, 1); }
+
+	/// Writes data in the format expected by the server, without any processing.
+	void write(std::string_view data)
+	{
+		error_code err;
+		write(data, err);
+		check_error_code(err, error_info());
+	}
+
+	/// Writes data without any processing (sync with error codes version).
+	void write(std::string_view data, error_code& err)
+	{
+		assert(channel_);
+		err.clear();
+		while (!data.empty() && !err)
+		{
+			data.remove_prefix(append_chunk(data));
+			if (batch_full()) flush(err);
+		}
+	}
+
+	/// Encodes a row of values in binary format. Requires binary().
+	template <typename ForwardIterator>
+	void write_row(ForwardIterator first, ForwardIterator last)
+	{
+		error_code err;
+		write_row(first, last, err);
+		check_error_code(err, error_info());
+	}
+
+	/// Encodes a row of values in binary format (sync with error codes version).
+	template <typename ForwardIterator>
+	void write_row(ForwardIterator first, ForwardIterator last, error_code& err)
+	{
+		assert(channel_);
+		err = make_error_code(encode_values(first, last));
+		if (!err && batch_full()) flush(err);
+	}
+
+	/// Encodes a T object as a row in binary format. Requires binary(). T must specialize get_struct_fields.
+	template <typename T>
+	void write_row(const T& row)
+	{
+		error_code err;
+		write_row(row, err);
+		check_error_code(err, error_info());
+	}
+
+	/// Encodes a T object as a row in binary format (sync with error codes version).
+	template <typename T>
+	void write_row(const T& row, error_code& err)
+	{
+		assert(channel_);
+		err = make_error_code(encode_typed(row));
+		if (!err && batch_full()) flush(err);
+	}
+
+	/// Sends all accumulated data.
+	void flush()
+	{
+		error_code err;
+		flush(err);
+		check_error_code(err, error_info());
+	}
+
+	/// Sends all accumulated data (sync with error codes version).
+	void flush(error_code& err)
+	{
+		assert(channel_);
+		err.clear();
+		end_message();
+		channel_->flush(err);
+	}
+
+	/// Sends any remaining data and ends the COPY. Returns the number of rows copied.
+	std::uint64_t finish()
+	{
+		error_code err;
+		error_info info;
+		std::uint64_t res = finish(err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Sends any remaining data and ends the COPY (sync with error codes version).
+	std::uint64_t finish(error_code& err, error_info& info)
+	{
+		assert(channel_);
+		err.clear();
+		info.clear();
+		enqueue_done();
+		auto msg = channel_->read_message(command_complete_message::message_type, err, info);
+		if (err) return 0;
+		std::uint64_t res = parse_copy_count(msg.body);
+		channel_->read_message(ready_for_query_message::message_type, err, info);
+		return err ? 0 : res;
+	}
+
+	/// Cancels the COPY. No row is inserted.
+	void abort(std::string_view reason)
+	{
+		error_code err;
+		abort(reason, err);
+		check_error_code(err, error_info());
+	}
+
+	/// Cancels the COPY (sync with error codes version).
+	void abort(std::string_view reason, error_code& err)
+	{
+		assert(channel_);
+		err.clear();
+		enqueue_fail(reason);
+		// The server responds with an error, as requested
+		channel_->read_until_ready(err);
+	}
+
+	/**
+	 * \brief Writes data without any processing (async version).
+	 * \details The handler signature is void(error_code). data must be
+	 * kept alive until the operation completes.
+	 */
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code))
+	async_write(std::string_view data, CompletionToken&& token)
+	{
+		assert(channel_);
+		return boost::asio::async_compose<CompletionToken, void(error_code)>(
+			write_op{*this, data, error_code()}, token, channel_->next_layer());
+	}
+
+	/**
+	 * \brief Encodes a row of values in binary format (async version).
+	 * \details The handler signature is void(error_code). The row is
+	 * encoded before this function returns.
+	 */
+	template <typename ForwardIterator, typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code))
+	async_write_row(ForwardIterator first, ForwardIterator last, CompletionToken&& token)
+	{
+		assert(channel_);
+		auto err = make_error_code(encode_values(first, last));
+		return boost::asio::async_compose<CompletionToken, void(error_code)>(
+			write_op{*this, std::string_view(), err}, token, channel_->next_layer());
+	}
+
+	/// Encodes a T object as a row in binary format (async version). The handler signature is void(error_code).
+	template <typename T, typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code))
+	async_write_row(const T& row, CompletionToken&& token)
+	{
+		assert(channel_);
+		auto err = make_error_code(encode_typed(row));
+		return boost::asio::async_compose<CompletionToken, void(error_code)>(
+			write_op{*this, std::string_view(), err}, token, channel_->next_layer());
+	}
+
+	/// Sends all accumulated data (async version). The handler signature is void(error_code).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code))
+	async_flush(CompletionToken&& token)
+	{
+		assert(channel_);
+		end_message();
+		return channel_->async_flush(std::forward<CompletionToken>(token));
+	}
+
+	/**
+	 * \brief Sends any remaining data and ends the COPY (async version).
+	 * \details The handler signature is void(error_code, std::uint64_t),
+	 * where the second argument is the number of rows copied.
+	 */
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, std::uint64_t))
+	async_finish(CompletionToken&& token, error_info* info=nullptr)
+	{
+		assert(channel_);
+		conditional_clear(info);
+		enqueue_done();
+		return boost::asio::async_compose<CompletionToken, void(error_code, std::uint64_t)>(
+			finish_op{*channel_, info}, token, channel_->next_layer());
+	}
+
+	/// Cancels the COPY (async version). The handler signature is void(error_code).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code))
+	async_abort(std::string_view reason, CompletionToken&& token)
+	{
+		assert(channel_);
+		enqueue_fail(reason);
+		return boost::asio::async_compose<CompletionToken, void(error_code)>(
+			abort_op{*channel_}, token, channel_->next_layer());
+	}
+};
+
+template <typename Stream>
+struct copy_in_writer<Stream>::write_op : boost::asio::coroutine
+{
+	copy_in_writer<Stream>& writer_;
+	std::string_view data_;
+	error_code encode_err_;
+	bool has_performed_io_ {false};
+
+	write_op(copy_in_writer<Stream>& writer, std::string_view data, error_code encode_err) noexcept:
+		writer_(writer), data_(data), encode_err_(encode_err) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			if (!encode_err_)
+			{
+				// Send batches as they fill up
+				for (;;)
+				{
+					data_.remove_prefix(writer_.append_chunk(data_));
+					if (!writer_.batch_full()) break;
+					writer_.end_message();
+					has_performed_io_ = true;
+					BOOST_ASIO_CORO_YIELD writer_.channel_->async_flush(std::move(self));
+					if (err)
+					{
+						self.complete(err);
+						BOOST_ASIO_CORO_YIELD break;
+					}
+				}
+			}
+
+			// Don't call the handler from within the initiating function
+			if (!has_performed_io_)
+			{
+				BOOST_ASIO_CORO_YIELD boost::asio::post(writer_.channel_->next_layer().get_executor(), std::move(self));
+			}
+			self.complete(encode_err_);
+		}
+	}
+};
+
+template <typename Stream>
+struct copy_in_writer<Stream>::finish_op : boost::asio::coroutine
+{
+	channel<Stream>& channel_;
+	error_info* info_;
+	std::uint64_t count_ {};
+
+	finish_op(channel<Stream>& chan, error_info* info) noexcept:
+		channel_(chan), info_(info) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			// Command complete. Sends the CopyDone first
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err && msg.type == error_response_message_type)
+			{
+				BOOST_ASIO_CORO_YIELD channel_.async_handle_error_response(msg, info_, std::move(self));
+			}
+			else if (!err && msg.type != command_complete_message::message_type)
+			{
+				err = make_error_code(errc::unexpected_message);
+			}
+			if (err)
+			{
+				self.complete(err, 0);
+				BOOST_ASIO_CORO_YIELD break;
+			}
+			count_ = parse_copy_count(msg.body);
+
+			// Ready for query
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err && msg.type != ready_for_query_message::message_type)
+			{
+				err = make_error_code(errc::unexpected_message);
+			}
+			self.complete(err, err ? 0 : count_);
+		}
+	}
+};
+
+template <typename Stream>
+struct copy_in_writer<Stream>::abort_op : boost::asio::coroutine
+{
+	channel<Stream>& channel_;
+
+	abort_op(channel<Stream>& chan) noexcept: channel_(chan) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			// The server responds with an error, as requested
+			do
+			{
+				BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+				if (err)
+				{
+					self.complete(err);
+					BOOST_ASIO_CORO_YIELD break;
+				}
+			} while (msg.type != ready_for_query_message::message_type);
+			self.complete(error_code());
+		}
+	}
+};
+
+}
+
+#endif /* INCLUDE_PSQL_COPY_IN_H_ */
@@ -0,0 +1,354 @@
+#ifndef INCLUDE_PSQL_COPY_OUT_H_
+#define INCLUDE_PSQL_COPY_OUT_H_
+
+#include "psql/channel.h"
+#include "psql/copy_in.h"
+#include "psql/columnar.h"
+#include "psql/typed_row.h"
+#include <type_traits>
+
+// COPY ... TO STDOUT. The payload of each CopyData message is handed to a
+// sink, a function object called as sink(std::string_view), without copying it.
+// A sink may return an errc to report an error, in which case no more data is
+// passed to it, and the error is reported once the COPY completes.
+
+namespace psql
+{
+
+/**
+ * \brief Field metadata for binary COPY data with the given column types.
+ * \details COPY doesn't describe the types of its columns, so they must
+ * be known in advance to decode binary data (e.g. into a record_batch).
+ */
+inline std::vector<field_metadata> make_copy_fields(
+	const std::vector<std::int32_t>& column_types,
+	const codec_registry& registry = default_codec_registry()
+)
+{
+	std::vector<field_metadata> res;
+	res.reserve(column_types.size());
+	for (std::int32_t type_oid: column_types)
+	{
+		single_row_description descr {};
+		descr.type_oid = type_oid;
+		descr.format = binary_format;
+		res.emplace_back(descr, registry);
+	}
+	return res;
+}
+
+/**
+ * \brief Field metadata for binary COPY data, taking column types from the members of T.
+ * \details Pass the connection's get_codec_registry() if it has custom decoders.
+ */
+template <typename T>
+std::vector<field_metadata> make_copy_fields(const codec_registry& registry = default_codec_registry())
+{
+	constexpr auto fields = get_struct_fields<T>::value;
+	return std::apply([&registry](auto... pmem) {
+		return make_copy_fields({copy_type_oid<non_optional_t<
+			typename member_pointer_traits<decltype(pmem)>::type>>()...}, registry);
+	}, fields);
+}
+
+/**
+ * \brief Splits binary COPY data into tuples.
+ * \details Each tuple has the same layout as a DataRow message body, so it
+ * can be decoded by anything that decodes rows. Tuples split between
+ * chunks are copied into an internal buffer; complete ones are not copied.
+ */
+class binary_copy_parser
+{
+	bytestring pending_; // an incomplete header or tuple, waiting for the next chunk
+	bool header_parsed_ {false};
+	bool finished_ {false};
+
+	// Parses the header and as many complete tuples as possible,
+	// setting consumed to the number of bytes they take
+	template <typename OnTuple>
+	errc parse(const std::uint8_t* first, const std::uint8_t* last, OnTuple& on_tuple, std::size_t& consumed)
+	{
+		const std::uint8_t* it = first;
+		while (it != last)
+		{
+			if (finished_) return errc::extra_bytes;
+			deserialization_context ctx (it, last);
+
+			// Header: signature, flags and header extension
+			if (!header_parsed_)
+			{
+				constexpr std::size_t signature_size = 11;
+				if (!ctx.enough_size(binary_copy_header.size())) break;
+				if (std::memcmp(it, binary_copy_header.data(), signature_size)) return errc::protocol_value_error;
+				ctx.advance(signature_size + 4);
+				std::int32_t extension_size = 0;
+				deserialize(extension_size, ctx);
+				if (extension_size < 0) return errc::protocol_value_error;
+				if (!ctx.enough_size(extension_size)) break;
+				ctx.advance(extension_size);
+				header_parsed_ = true;
+				it = ctx.first();
+				continue;
+			}
+
+			// Tuple, or -1 as trailer
+			std::int16_t num_fields = 0;
+			if (deserialize(num_fields, ctx) != errc::ok) break;
+			if (num_fields == -1)
+			{
+				finished_ = true;
+				it = ctx.first();
+				continue;
+			}
+			if (num_fields < 0) return errc::protocol_value_error;
+			bool complete = true;
+			for (std::int16_t i = 0; i < num_fields && complete; ++i)
+			{
+				std::int32_t size = 0;
+				if (deserialize(size, ctx) != errc::ok) complete = false;
+				else if (size < -1) return errc::protocol_value_error;
+				else if (size == -1) continue; // NULL
+				else if (!ctx.enough_size(size)) complete = false;
+				else ctx.advance(size);
+			}
+			if (!complete) break;
+			auto err = on_tuple(boost::asio::const_buffer(it, ctx.first() - it));
+			if (err != errc::ok) return err;
+			it = ctx.first();
+		}
+		consumed = it - first;
+		return errc::ok;
+	}
+public:
+	/// Parses a chunk of data, calling on_tuple(boost::asio::const_buffer) -> errc for each complete tuple.
+	template <typename OnTuple>
+	errc feed(std::string_view chunk, OnTuple&& on_tuple)
+	{
+		const auto* first = reinterpret_cast<const std::uint8_t*>(chunk.data());
+		const auto* last = first + chunk.size();
+		std::size_t consumed = 0;
+		if (pending_.empty())
+		{
+			auto err = parse(first, last, on_tuple, consumed);
+			if (err != errc::ok) return err;
+			pending_.assign(first + consumed, last);
+		}
+		else
+		{
+			pending_.insert(pending_.end(), first, last);
+			auto err = parse(pending_.data(), pending_.data() + pending_.size(), on_tuple, consumed);
+			if (err != errc::ok) return err;
+			pending_.erase(pending_.begin(), pending_.begin() + consumed);
+		}
+		return errc::ok;
+	}
+
+	/// Whether the trailer has been received.
+	bool finished() const noexcept { return finished_; }
+};
+
+/// A sink that decodes binary COPY data, passing each tuple to on_tuple.
+template <typename OnTuple>
+class binary_copy_sink
+{
+	binary_copy_parser parser_;
+	OnTuple on_tuple_;
+public:
+	explicit binary_copy_sink(OnTuple on_tuple): on_tuple_(std::move(on_tuple)) {}
+
+	errc operator()(std::string_view chunk) { return parser_.feed(chunk, on_tuple_); }
+
+	/// Whether all the data has been received.
+	bool finished() const noexcept { return parser_.finished(); }
+};
+
+/**
+ * \brief A sink that decodes binary COPY data into a record batch.
+ * \details The batch must be created with the column types, using make_copy_fields().
+ * output must be kept alive until the COPY completes.
+ */
+inline auto make_binary_copy_sink(record_batch& output)
+{
+	return binary_copy_sink([&output](boost::asio::const_buffer tuple) {
+		return output.append(tuple);
+	});
+}
+
+/**
+ * \brief A sink that decodes binary COPY data into T objects, appending them to output.
+ * \details T must specialize get_struct_fields. Column types are taken
+ * from the members of T, unless fields is specified. output must be kept
+ * alive until the COPY completes.
+ */
+template <typename T>
+auto make_binary_copy_sink(std::vector<T>& output, const std::vector<field_metadata>& fields = make_copy_fields<T>())
+{
+	static_assert(!row_binding<T>::has_views,
+		"string_view members are only valid until the next row is read. Use std::string instead");
+	return binary_copy_sink([&output, binding = row_binding<T>(fields)](boost::asio::const_buffer tuple) {
+		if (binding.error() != errc::ok) return binding.error();
+		output.emplace_back();
+		return binding.decode(tuple, output.back());
+	});
+}
+
+template <typename Sink>
+errc invoke_copy_sink(Sink& sink, boost::asio::const_buffer data)
+{
+	std::string_view chunk = get_string(static_cast<const std::uint8_t*>(data.data()), data.size());
+	if constexpr (std::is_void_v<std::invoke_result_t<Sink&, std::string_view>>)
+	{
+		sink(chunk);
+		return errc::ok;
+	}
+	else
+	{
+		return sink(chunk);
+	}
+}
+
+// CopyOutResponse, CopyData messages, CopyDone, CommandComplete and ReadyForQuery.
+// Returns the number of rows copied
+template <typename Stream, typename Sink>
+std::uint64_t read_copy_out_response(channel<Stream>& chan, Sink& sink, error_code& err, error_info& info)
+{
+	auto msg = chan.read_message(err);
+	if (err) return 0;
+	if (msg.type == error_response_message_type)
+	{
+		chan.handle_error_response(msg, err, info);
+		return 0;
+	}
+	if (msg.type != copy_out_response_message::message_type)
+	{
+		// Not a COPY ... TO STDOUT
+		chan.discard_unexpected_response(msg, err);
+		return 0;
+	}
+
+	// Copy data is served from the channel's read buffer, without copying it
+	errc sink_err = errc::ok;
+	msg = chan.read_message(err);
+	for (; !err && msg.type == copy_data_message_type; msg = chan.read_message(err))
+	{
+		if (sink_err == errc::ok) sink_err = invoke_copy_sink(sink, msg.body);
+	}
+	if (err || !chan.check_message_type(msg, copy_done_message::message_type, err, info)) return 0;
+
+	msg = chan.read_message(command_complete_message::message_type, err, info);
+	if (err) return 0;
+	std::uint64_t res = parse_copy_count(msg.body);
+	chan.read_message(ready_for_query_message::message_type, err, info);
+	if (!err) err = make_error_code(sink_err);
+	return err ? 0 : res;
+}
+
+template <typename Stream, typename Sink>
+struct read_copy_out_response_op : boost::asio::coroutine
+{
+	channel<Stream>& channel_;
+	Sink sink_;
+	error_info* info_;
+	errc sink_err_ {errc::ok};
+	std::uint64_t count_ {};
+
+	read_copy_out_response_op(channel<Stream>& chan, Sink&& sink, error_info* info):
+		channel_(chan), sink_(std::move(sink)), info_(info) {}
+
+	// Processes a message received while copy data is expected.
+	// Returns false once copy data is complete
+	bool process_data(const message_view& msg, error_code& err)
+	{
+		if (msg.type == copy_data_message_type)
+		{
+			if (sink_err_ == errc::ok) sink_err_ = invoke_copy_sink(sink_, msg.body);
+			return true;
+		}
+		if (msg.type != copy_done_message::message_type && msg.type != error_response_message_type)
+		{
+			err = make_error_code(errc::unexpected_message);
+		}
+		return false;
+	}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			// Copy out response
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err && msg.type == error_response_message_type)
+			{
+				BOOST_ASIO_CORO_YIELD channel_.async_handle_error_response(msg, info_, std::move(self));
+			}
+			else if (!err && msg.type != copy_out_response_message::message_type)
+			{
+				BOOST_ASIO_CORO_YIELD channel_.async_discard_unexpected_response(msg, std::move(self));
+			}
+			if (err)
+			{
+				self.complete(err, 0);
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			// Copy data, until copy done. Messages that have already
+			// been received are processed without going through the executor
+			do
+			{
+				BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+				while (!err && process_data(msg, err) && channel_.read_buffered_message(msg, err))
+				{
+				}
+			} while (!err && msg.type == copy_data_message_type);
+
+			if (!err && msg.type == error_response_message_type)
+			{
+				BOOST_ASIO_CORO_YIELD channel_.async_handle_error_response(msg, info_, std::move(self));
+			}
+			if (err)
+			{
+				self.complete(err, 0);
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			// Command complete
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err && msg.type != command_complete_message::message_type)
+			{
+				err = make_error_code(errc::unexpected_message);
+			}
+			if (err)
+			{
+				self.complete(err, 0);
+				BOOST_ASIO_CORO_YIELD break;
+			}
+			count_ = parse_copy_count(msg.body);
+
+			// Ready for query
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err && msg.type != ready_for_query_message::message_type)
+			{
+				err = make_error_code(errc::unexpected_message);
+			}
+			if (!err && sink_err_ != errc::ok)
+			{
+				err = make_error_code(sink_err_);
+			}
+			self.complete(err, err ? 0 : count_);
+		}
+	}
+};
+
+template <typename Stream, typename Sink, typename CompletionToken>
+BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, std::uint64_t))
+async_read_copy_out_response(channel<Stream>& chan, Sink&& sink, error_info* info, CompletionToken&& token)
+{
+	using op_type = read_copy_out_response_op<Stream, std::decay_t<Sink>>;
+	return boost::asio::async_compose<CompletionToken, void(error_code, std::uint64_t)>(
+		op_type{chan, std::decay_t<Sink>(std::forward<Sink>(sink)), info}, token, chan.next_layer());
+}
+
+}
+
+#endif /* INCLUDE_PSQL_COPY_OUT_H_ */
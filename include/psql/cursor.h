@@ -0,0 +1,461 @@
+#ifndef INCLUDE_PSQL_CURSOR_H_
+#define INCLUDE_PSQL_CURSOR_H_
+
+#include "psql/channel.h"
+#include "psql/response.h"
+#include "psql/rows.h"
+#include "psql/columnar.h"
+#include "psql/typed_row.h"
+
+namespace psql
+{
+
+/**
+ * \brief Reads the rows of a prepared statement in chunks of bounded size.
+ * \details Created by prepared_statement::open_cursor(), which binds the
+ * parameters to a named portal. Each fetch sends an Execute limited to
+ * chunk_size rows, so no more than that many rows are ever received at once,
+ * regardless of the size of the result.
+ *
+ * With prefetching, the next chunk is requested as soon as the current one has
+ * been received, so it's transferred while the application processes the current
+ * one. At most two chunks are held in memory (one by the application and one
+ * in the socket and read buffers).
+ *
+ * The portal belongs to the current transaction. If there is none, an implicit one
+ * lasts until the cursor is closed. The cursor is closed once all rows have been
+ * fetched. Otherwise, close() must be called before any other operation is
+ * performed on the connection.
+ */
+template <typename Stream>
+class cursor
+{
+	template <typename Output, typename Result=Output> struct fetch_op;
+	struct close_op;
+
+	channel<Stream>* channel_ {};
+	std::string name_;
+	resultset_metadata meta_;
+	row_binding_cache bindings_;
+	std::int32_t chunk_size_ {};
+	bool prefetch_ {false};
+	bool execute_pending_ {false}; // an Execute has been sent, and its response hasn't been read
+	bool complete_ {false};        // all rows have been fetched and the portal has been closed
+
+	// Flush instead of Sync, so the implicit transaction (and the portal) stays open
+	void enqueue_execute()
+	{
+		channel_->enqueue(execute_message{
+			string_null(name_),
+			chunk_size_
+		});
+		channel_->enqueue(flush_message{});
+		execute_pending_ = true;
+	}
+
+	void enqueue_close()
+	{
+		channel_->enqueue(close_message{
+			'P',
+			string_null(name_)
+		});
+		channel_->enqueue(sync_message{});
+	}
+
+	void close_portal(error_code& err, error_info& info)
+	{
+		complete_ = true;
+		enqueue_close();
+		read_close_response(*channel_, err, info);
+	}
+
+	// Reads the response to the pending Execute, passing DataRows to on_row.
+	// If request_next, requests the next chunk straight away if the portal was suspended
+	template <typename OnRow>
+	void read_chunk(OnRow&& on_row, bool request_next, error_code& err, error_info& info)
+	{
+		message_view msg = channel_->read_message(err);
+		for (; !err && msg.type == std::uint8_t('D'); msg = channel_->read_message(err)) // data row
+		{
+			on_row(msg);
+		}
+		if (err) return;
+		execute_pending_ = false;
+
+		if (msg.type == portal_suspended_message::message_type)
+		{
+			if (request_next)
+			{
+				enqueue_execute();
+				channel_->flush(err);
+			}
+		}
+		else if (msg.type == std::uint8_t('C')) // complete
+		{
+			close_portal(err, info);
+		}
+		else
+		{
+			// Nothing else can be done with the portal. An error
+			// skips everything until a Sync, so send one
+			complete_ = true;
+			if (msg.type == error_response_message_type)
+			{
+				channel_->enqueue(sync_message{});
+				channel_->handle_error_response(msg, err, info);
+			}
+			else
+			{
+				err = make_error_code(errc::unexpected_message);
+			}
+		}
+	}
+
+	// Reads the next chunk into output, which may be a rows, record_batch or typed_rows object
+	template <typename Output>
+	void fetch_into(Output& output, error_code& err, error_info& info)
+	{
+		decode_timer timer (channel_->stats());
+		errc append_err = errc::ok;
+		if (!complete_)
+		{
+			if (!execute_pending_) enqueue_execute();
+
+			// Rows that can't be stored are skipped, so the connection remains usable
+			read_chunk([&](const message_view& msg) {
+				if (append_err == errc::ok) append_err = append_data_row(output, msg.body);
+				++channel_->stats().rows_decoded;
+			}, prefetch_, err, info);
+		}
+		if (!err) err = make_error_code(append_err);
+		if (!err) err = make_error_code(output.finish(meta_.fields()));
+	}
+public:
+	/// Default constructor.
+	cursor() = default;
+
+	// Private, do not use. The first Execute has already been sent
+	cursor(channel<Stream>& chan, std::string name, resultset_metadata&& meta, std::int32_t chunk_size, bool prefetch):
+		channel_(&chan), name_(std::move(name)), meta_(std::move(meta)),
+		chunk_size_(chunk_size), prefetch_(prefetch), execute_pending_(true) {}
+
+	bool valid() const noexcept { return channel_ != nullptr; }
+
+	/// Whether all rows have been fetched, or the cursor has been closed.
+	bool complete() const noexcept { return complete_; }
+
+	/// The maximum number of rows returned by each fetch.
+	std::int32_t chunk_size() const noexcept { return chunk_size_; }
+
+	const std::vector<field_metadata>& fields() const noexcept { return meta_.fields(); }
+
+	/**
+	 * \brief Fetches the next chunk of rows.
+	 * \details Returns at most chunk_size() rows. An empty object
+	 * is returned once all rows have been fetched, or on error.
+	 */
+	rows fetch_next()
+	{
+		error_code err;
+		error_info info;
+		rows res = fetch_next(err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Fetches the next chunk of rows (sync with error codes version).
+	rows fetch_next(error_code& err, error_info& info)
+	{
+		assert(channel_);
+		err.clear();
+		info.clear();
+		rows res;
+		fetch_into(res, err, info);
+		return err ? rows() : std::move(res);
+	}
+
+	/// Fetches the next chunk of rows into T objects. T must specialize get_struct_fields.
+	template <typename T>
+	std::vector<T> fetch_next()
+	{
+		error_code err;
+		error_info info;
+		std::vector<T> res = fetch_next<T>(err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Fetches the next chunk of rows into T objects (sync with error codes version).
+	template <typename T>
+	std::vector<T> fetch_next(error_code& err, error_info& info)
+	{
+		assert(channel_);
+		info.clear();
+		typed_rows<T> res = bindings_.make_typed_rows<T>(meta_.fields());
+		err = make_error_code(res.finish(meta_.fields()));
+		if (!err) fetch_into(res, err, info);
+		return err ? std::vector<T>() : res.release();
+	}
+
+	/**
+	 * \brief Fetches the next chunk of rows, decoding them by column.
+	 * \details The batch always has the cursor's columns, even when it
+	 * holds no rows because the cursor was complete or the operation failed.
+	 */
+	record_batch fetch_next_columns()
+	{
+		error_code err;
+		error_info info;
+		record_batch res = fetch_next_columns(err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Fetches the next chunk of rows, decoding them by column (sync with error codes version).
+	record_batch fetch_next_columns(error_code& err, error_info& info)
+	{
+		assert(channel_);
+		err.clear();
+		info.clear();
+		record_batch res (meta_.fields());
+		fetch_into(res, err, info);
+		return err ? make_empty_result<record_batch>(meta_.fields()) : std::move(res);
+	}
+
+	/**
+	 * \brief Closes the portal without fetching the remaining rows.
+	 * \details Does nothing if the cursor is already complete. Rows
+	 * of a chunk that has already been requested are discarded.
+	 */
+	void close()
+	{
+		error_code err;
+		error_info info;
+		close(err, info);
+		check_error_code(err, info);
+	}
+
+	/// Closes the portal without fetching the remaining rows (sync with error codes version).
+	void close(error_code& err, error_info& info)
+	{
+		assert(channel_);
+		err.clear();
+		info.clear();
+		if (complete_) return;
+		if (execute_pending_) read_chunk([](const message_view&) {}, false, err, info);
+		if (!err && !complete_) close_portal(err, info);
+	}
+
+	/// Fetches the next chunk of rows (async version). The handler signature is void(error_code, rows).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, rows))
+	async_fetch_next(CompletionToken&& token, error_info* info=nullptr)
+	{
+		assert(channel_);
+		conditional_clear(info);
+		return boost::asio::async_compose<CompletionToken, void(error_code, rows)>(
+			fetch_op<rows>{*this, info, rows()}, token, channel_->next_layer());
+	}
+
+	/// Fetches the next chunk of rows into T objects (async version).
+	/// The handler signature is void(error_code, std::vector<T>).
+	template <typename T, typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, std::vector<T>))
+	async_fetch_next(CompletionToken&& token, error_info* info=nullptr)
+	{
+		assert(channel_);
+		conditional_clear(info);
+		return boost::asio::async_compose<CompletionToken, void(error_code, std::vector<T>)>(
+			fetch_op<typed_rows<T>, std::vector<T>>{*this, info, bindings_.make_typed_rows<T>(meta_.fields())},
+			token, channel_->next_layer());
+	}
+
+	/// Fetches the next chunk of rows, decoding them by column (async version).
+	/// The handler signature is void(error_code, record_batch).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, record_batch))
+	async_fetch_next_columns(CompletionToken&& token, error_info* info=nullptr)
+	{
+		assert(channel_);
+		conditional_clear(info);
+		return boost::asio::async_compose<CompletionToken, void(error_code, record_batch)>(
+			fetch_op<record_batch>{*this, info, record_batch(meta_.fields())}, token, channel_->next_layer());
+	}
+
+	/// Closes the portal without fetching the remaining rows (async version).
+	/// The handler signature is void(error_code).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code))
+	async_close(CompletionToken&& token, error_info* info=nullptr)
+	{
+		assert(channel_);
+		conditional_clear(info);
+		return boost::asio::async_compose<CompletionToken, void(error_code)>(
+			close_op{*this, info}, token, channel_->next_layer());
+	}
+};
+
+template <typename Stream>
+template <typename Output, typename Result>
+struct cursor<Stream>::fetch_op : boost::asio::coroutine
+{
+	cursor<Stream>& cursor_;
+	error_info* info_;
+	Output output_; // rows, record_batch or typed_rows<T>
+	errc output_err_ {errc::ok};
+
+	fetch_op(cursor<Stream>& obj, error_info* info, Output&& output) noexcept:
+		cursor_(obj), info_(info), output_(std::move(output)) {}
+
+	Result empty_result() const { return make_empty_result<Result>(cursor_.meta_.fields()); }
+
+	// Stores msg if it's a DataRow. Returns false otherwise
+	bool process_row(const message_view& msg)
+	{
+		if (msg.type != std::uint8_t('D')) return false;
+		if (output_err_ == errc::ok) output_err_ = append_data_row(output_, msg.body);
+		++cursor_.channel_->stats().rows_decoded;
+		return true;
+	}
+
+	template <typename Self>
+	void complete(Self& self, error_code err)
+	{
+		if (!err) err = make_error_code(output_err_);
+		if (!err) err = make_error_code(output_.finish(cursor_.meta_.fields()));
+		if (err) self.complete(err, empty_result());
+		else if constexpr (std::is_same_v<Output, Result>) self.complete(err, std::move(output_));
+		else self.complete(err, output_.release());
+	}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		auto& chan = *cursor_.channel_;
+
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			if (cursor_.complete_)
+			{
+				BOOST_ASIO_CORO_YIELD boost::asio::post(chan.next_layer().get_executor(), std::move(self));
+				complete(self, error_code());
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			// Rows, until the portal is suspended or complete. Messages that
+			// have already been received are processed without going through the executor
+			if (!cursor_.execute_pending_) cursor_.enqueue_execute();
+			do
+			{
+				BOOST_ASIO_CORO_YIELD chan.async_read_message(std::move(self));
+				{
+					decode_timer timer (chan.stats());
+					while (!err && process_row(msg) && chan.read_buffered_message(msg, err))
+					{
+					}
+				}
+			} while (!err && msg.type == std::uint8_t('D'));
+			if (err)
+			{
+				self.complete(err, empty_result());
+				BOOST_ASIO_CORO_YIELD break;
+			}
+			cursor_.execute_pending_ = false;
+
+			if (msg.type == portal_suspended_message::message_type)
+			{
+				if (cursor_.prefetch_)
+				{
+					cursor_.enqueue_execute();
+					BOOST_ASIO_CORO_YIELD chan.async_flush(std::move(self));
+				}
+			}
+			else if (msg.type == std::uint8_t('C')) // complete
+			{
+				cursor_.complete_ = true;
+				cursor_.enqueue_close();
+				BOOST_ASIO_CORO_YIELD async_read_close_response(chan, info_, std::move(self));
+			}
+			else if (msg.type == error_response_message_type)
+			{
+				cursor_.complete_ = true;
+				chan.enqueue(sync_message{});
+				BOOST_ASIO_CORO_YIELD chan.async_handle_error_response(msg, info_, std::move(self));
+			}
+			else
+			{
+				cursor_.complete_ = true;
+				err = make_error_code(errc::unexpected_message);
+			}
+			complete(self, err);
+		}
+	}
+};
+
+template <typename Stream>
+struct cursor<Stream>::close_op : boost::asio::coroutine
+{
+	cursor<Stream>& cursor_;
+	error_info* info_;
+
+	close_op(cursor<Stream>& obj, error_info* info) noexcept:
+		cursor_(obj), info_(info) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		auto& chan = *cursor_.channel_;
+
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			if (cursor_.complete_)
+			{
+				BOOST_ASIO_CORO_YIELD boost::asio::post(chan.next_layer().get_executor(), std::move(self));
+				self.complete(error_code());
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			// Discard the rows of a chunk that has already been requested
+			if (cursor_.execute_pending_)
+			{
+				do
+				{
+					BOOST_ASIO_CORO_YIELD chan.async_read_message(std::move(self));
+					while (!err && msg.type == std::uint8_t('D') && chan.read_buffered_message(msg, err))
+					{
+					}
+				} while (!err && msg.type == std::uint8_t('D'));
+				if (err)
+				{
+					self.complete(err);
+					BOOST_ASIO_CORO_YIELD break;
+				}
+				cursor_.execute_pending_ = false;
+
+				if (msg.type == error_response_message_type)
+				{
+					cursor_.complete_ = true;
+					chan.enqueue(sync_message{});
+					BOOST_ASIO_CORO_YIELD chan.async_handle_error_response(msg, info_, std::move(self));
+					self.complete(err);
+					BOOST_ASIO_CORO_YIELD break;
+				}
+				else if (msg.type != portal_suspended_message::message_type && msg.type != std::uint8_t('C'))
+				{
+					cursor_.complete_ = true;
+					self.complete(make_error_code(errc::unexpected_message));
+					BOOST_ASIO_CORO_YIELD break;
+				}
+			}
+
+			cursor_.complete_ = true;
+			cursor_.enqueue_close();
+			BOOST_ASIO_CORO_YIELD async_read_close_response(chan, info_, std::move(self));
+			self.complete(err);
+		}
+	}
+};
+
+}
+
+#endif /* INCLUDE_PSQL_CURSOR_H_ */
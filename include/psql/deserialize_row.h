@@ -5,85 +5,88 @@
 #include "psql/value.h"
 #include "psql/messages.h"
 #include "psql/metadata.h"
+#include "psql/codecs.h"
 #include <vector>
 
 namespace psql
 {
 
-constexpr std::int32_t int2_oid = 21;
-constexpr std::int32_t int4_oid = 23;
-constexpr std::int32_t varchar_oid = 1043;
-
 inline void check_error_code(errc err)
 {
 	if (err != errc::ok)
 		throw boost::system::system_error(make_error_code(err));
 }
 
-inline value deserialize_single(
+// Decodes a non-NULL field, using the decoder resolved for its column
+inline errc deserialize_single(
 	std::string_view from,
-	const field_metadata& meta
-)
+	const field_metadata& meta,
+	value& output
+) noexcept
 {
-	if (meta.format() == 0) // text
-	{
-		if (meta.type_oid() == int2_oid || meta.type_oid() == int4_oid)
-		{
-			return value(std::stoi(std::string(from)));
-		}
-		else if (meta.type_oid() == varchar_oid)
-		{
-			return value(from);
-		}
-		else
-		{
-			throw std::runtime_error("Unknown type OID");
-		}
-	}
-	else // binary
-	{
-		throw std::runtime_error("Unsupported binary format");
-	}
+	return meta.decoder()(from, output);
 }
 
-inline std::vector<value> deserialize_row(
+// Deserializes a DataRow message into output, which must
+// have space for meta.size() values
+inline errc deserialize_row(
 	const std::vector<field_metadata>& meta,
-	const bytestring& buffer
-)
+	boost::asio::const_buffer buffer,
+	value* output
+) noexcept
 {
 	// Context
-	deserialization_context ctx (buffer.data(), buffer.data() + buffer.size());
+	deserialization_context ctx (buffer);
 
 	// Field count
 	std::int16_t field_count = 0;
 	auto err = deserialize(field_count, ctx);
-	check_error_code(err);
-	assert(field_count == meta.size());
+	if (err != errc::ok) return err;
+	if (std::size_t(field_count) != meta.size()) return errc::protocol_value_error;
 
 	// Each field
-	std::vector<value> res;
-	res.reserve(field_count);
 	for (int i = 0; i < field_count; ++i)
 	{
 		std::int32_t size = 0;
 		err = deserialize(size, ctx);
-		check_error_code(err);
+		if (err != errc::ok) return err;
 		if (size == -1)
 		{
 			// NULL
-			res.push_back(value(nullptr));
+			output[i] = nullptr;
 		}
 		else
 		{
-			if (!ctx.enough_size(size))
-				throw boost::system::system_error(make_error_code(errc::incomplete_message));
+			if (size < 0 || !ctx.enough_size(size)) return errc::incomplete_message;
 			std::string_view buff = get_string(ctx.first(), size);
-			res.push_back(deserialize_single(buff, meta[i]));
+			err = deserialize_single(buff, meta[i], output[i]);
+			if (err != errc::ok) return err;
 			ctx.advance(size);
 		}
 	}
-	if (!ctx.empty())
-		throw boost::system::system_error(make_error_code(errc::extra_bytes));
+	if (!ctx.empty()) return errc::extra_bytes;
+	return errc::ok;
+}
+
+// Deserializes a DataRow message into output. The vector's
+// capacity is reused between rows
+inline errc deserialize_row(
+	const std::vector<field_metadata>& meta,
+	boost::asio::const_buffer buffer,
+	std::vector<value>& output
+) noexcept
+{
+	output.resize(meta.size());
+	return deserialize_row(meta, buffer, output.data());
+}
+
+inline std::vector<value> deserialize_row(
+	const std::vector<field_metadata>& meta,
+	boost::asio::const_buffer buffer
+)
+{
+	std::vector<value> res;
+	check_error_code(deserialize_row(meta, buffer, res));
 	return res;
 }
 
@@ -3,6 +3,9 @@
 
 #include <boost/system/error_code.hpp>
 #include <boost/system/system_error.hpp>
+#include <ostream>
+#include <string>
+#include <string_view>
 
 namespace psql
 {
@@ -14,12 +17,31 @@ enum class errc : int
 	ok,
 	incomplete_message,
 	protocol_value_error,
-	extra_bytes
+	extra_bytes,
+	server_error,
+	unexpected_message,
+	unsupported_type,
+	unsupported_auth_method,
+	type_mismatch,
+	unexpected_null,
+	pool_timeout,
+	pool_closed,
+	server_verification_failed,
+	crypto_error,
+	ssl_unavailable
 };
 
+/**
+ * \brief Additional information about an error.
+ * \details For errors reported by the server, holds the fields of its
+ * ErrorResponse (SQLSTATE, message, detail...), which can be inspected
+ * without throwing or parsing strings. Passing the same object to many
+ * operations reuses its memory, so reporting errors doesn't allocate.
+ */
 class error_info
 {
-	std::string msg_;
+	std::string msg_;    // for server errors, the SQLSTATE and the server message
+	std::string fields_; // the ErrorResponse body: (field type, value, '\0') sequence, then '\0'
 public:
 	/// Default constructor.
 	error_info() = default;
@@ -31,12 +53,94 @@ public:
 	const std::string& message() const noexcept { return msg_; }
 
 	/// Sets the error message.
-	void set_message(std::string&& err) { msg_ = std::move(err); }
+	void set_message(std::string&& err) { msg_ = std::move(err); fields_.clear(); }
+
+	/**
+	 * \brief Stores the fields of an ErrorResponse, given its body.
+	 * \details The message becomes "<SQLSTATE>: <server message>".
+	 * Returns false if the body is malformed.
+	 */
+	bool assign_server_error(std::string_view body)
+	{
+		// Each field is a type byte and a null-terminated string. Empty terminates
+		bool valid = !body.empty() && body.back() == '\0';
+		for (std::size_t pos = 0; valid && body[pos] != '\0';)
+		{
+			std::size_t end = body.find('\0', pos + 1);
+			valid = end != std::string_view::npos && end + 1 < body.size();
+			pos = end + 1;
+		}
+		if (!valid)
+		{
+			msg_.assign("Malformed error response");
+			fields_.clear();
+			return false;
+		}
+		fields_.assign(body);
+		msg_.assign(sqlstate());
+		msg_.append(": ");
+		msg_.append(server_message());
+		return true;
+	}
+
+	/// Whether this object holds an error reported by the server.
+	bool is_server_error() const noexcept { return !fields_.empty(); }
 
-	/// Restores the object to its initial state.
-	void clear() noexcept { msg_.clear(); }
+	/// The value of an ErrorResponse field, given its type code (e.g. 'C'), or empty if it was not sent.
+	std::string_view field(char type) const noexcept
+	{
+		std::string_view fields = fields_;
+		for (std::size_t pos = 0; pos < fields.size() && fields[pos] != '\0';)
+		{
+			std::size_t end = fields.find('\0', pos + 1);
+			if (fields[pos] == type) return fields.substr(pos + 1, end - pos - 1);
+			pos = end + 1;
+		}
+		return std::string_view();
+	}
+
+	/// The severity (ERROR, FATAL...), not localized when the server supports it.
+	std::string_view severity() const noexcept
+	{
+		std::string_view res = field('V');
+		return res.empty() ? field('S') : res;
+	}
+
+	/// The SQLSTATE code (e.g. "23505" for unique violations). See the sqlstate namespace.
+	std::string_view sqlstate() const noexcept { return field('C'); }
+
+	/// The primary error message sent by the server.
+	std::string_view server_message() const noexcept { return field('M'); }
+
+	/// An optional secondary message with more details.
+	std::string_view detail() const noexcept { return field('D'); }
+
+	/// An optional suggestion on how to fix the problem.
+	std::string_view hint() const noexcept { return field('H'); }
+
+	/// The schema, table, column and constraint the error is associated with, if any.
+	std::string_view schema_name() const noexcept { return field('s'); }
+	std::string_view table_name() const noexcept { return field('t'); }
+	std::string_view column_name() const noexcept { return field('c'); }
+	std::string_view constraint_name() const noexcept { return field('n'); }
+
+	/// Restores the object to its initial state, keeping its memory.
+	void clear() noexcept { msg_.clear(); fields_.clear(); }
 };
 
+/// SQLSTATE codes of errors that applications commonly expect and handle.
+namespace sqlstate
+{
+constexpr std::string_view unique_violation = "23505";
+constexpr std::string_view foreign_key_violation = "23503";
+constexpr std::string_view not_null_violation = "23502";
+constexpr std::string_view check_violation = "23514";
+constexpr std::string_view serialization_failure = "40001";
+constexpr std::string_view deadlock_detected = "40P01";
+constexpr std::string_view lock_not_available = "55P03";
+constexpr std::string_view query_canceled = "57014";
+}
+
 /**
  * \relates error_info
  * \brief Compare two error_info objects.
@@ -61,6 +165,19 @@ inline const char* error_to_string(errc error) noexcept
 	{
 	case errc::ok: return "no error";
 	case errc::incomplete_message: return "The message read was incomplete (not enough bytes to fully decode it)";
+	case errc::protocol_value_error: return "A message contained an invalid value";
+	case errc::extra_bytes: return "The message read contained extra bytes at the end";
+	case errc::server_error: return "The server returned an error response";
+	case errc::unexpected_message: return "Received a message of an unexpected type";
+	case errc::unsupported_type: return "The type of a field is not supported";
+	case errc::unsupported_auth_method: return "The authentication method requested by the server is not supported";
+	case errc::type_mismatch: return "The fields in the resultset don't match the members of the output type";
+	case errc::unexpected_null: return "A NULL value was received for a member that can't represent it";
+	case errc::pool_timeout: return "Timed out waiting for a connection from the pool";
+	case errc::pool_closed: return "The connection pool has been closed";
+	case errc::server_verification_failed: return "The server failed to prove that it knows the password";
+	case errc::crypto_error: return "A cryptographic operation failed";
+	case errc::ssl_unavailable: return "TLS is required, but the server or the stream doesn't support it";
 	default: return "<unknown error>";
 	}
 }
@@ -68,7 +185,7 @@ inline const char* error_to_string(errc error) noexcept
 class psql_error_category_t : public boost::system::error_category
 {
 public:
-	const char* name() const noexcept final override { return "mysql"; }
+	const char* name() const noexcept final override { return "psql"; }
 	std::string message(int ev) const final override
 	{
 		return error_to_string(static_cast<errc>(ev));
@@ -0,0 +1,103 @@
+#ifndef INCLUDE_PSQL_INSTRUMENTATION_H_
+#define INCLUDE_PSQL_INSTRUMENTATION_H_
+
+#include "psql/error.h"
+#include <chrono>
+#include <cstdint>
+#include <string_view>
+
+namespace psql
+{
+
+/**
+ * \brief Counters describing the work done by a connection.
+ * \details Always maintained; updating them costs a few increments per
+ * message, plus reading the clock around each socket operation and each
+ * multi-row fetch.
+ */
+struct connection_stats
+{
+	/// Bytes and protocol messages sent to and received from the server.
+	std::uint64_t bytes_sent {0};
+	std::uint64_t bytes_received {0};
+	std::uint64_t messages_sent {0};
+	std::uint64_t messages_received {0};
+
+	/**
+	 * \brief Write and read operations on the socket.
+	 * \details Each write sends all the enqueued messages, so it is a single
+	 * system call unless the socket buffer fills up. Each read gets as
+	 * much data as is available, up to the read buffer size.
+	 */
+	std::uint64_t write_calls {0};
+	std::uint64_t read_calls {0};
+
+	/// Reads that had to wait for the server's response to data just sent.
+	std::uint64_t round_trips {0};
+
+	/// Rows received in DataRow messages and handed to the application.
+	std::uint64_t rows_decoded {0};
+
+	/// NoticeResponse, ParameterStatus and NotificationResponse messages, which are discarded.
+	std::uint64_t async_messages_skipped {0};
+
+	/// Time spent in socket operations: for sync ones, blocked in the call; for async ones, until completion.
+	std::chrono::nanoseconds io_time {0};
+
+	/**
+	 * \brief Time spent parsing and decoding rows, excluding socket operations.
+	 * \details Measured by multi-row fetches (fetch_many(), fetch_all(),
+	 * fetch_columns(), cursor fetches and their async versions).
+	 * fetch_one() is not measured, as row_view fields are decoded on access.
+	 */
+	std::chrono::nanoseconds decode_time {0};
+};
+
+/// The kind of request an operation sends to the server.
+enum class operation_type : std::uint8_t
+{
+	handshake,
+	query,           ///< A text query, including multi-statement ones.
+	execute,         ///< A one-shot parameterized statement, using the unnamed statement.
+	prepare,         ///< Preparing a statement (only sent on statement cache misses).
+	execute_prepared,
+	open_cursor,     ///< Ends when the cursor is closed or runs out of rows.
+	close_statement,
+	copy_in,
+	copy_out
+};
+
+/// Describes an operation, as passed to a tracing_hook.
+struct operation_info
+{
+	operation_type type;
+	std::string_view statement_name; ///< The prepared statement's name, if any.
+	std::string_view sql;            ///< The SQL text, if any.
+};
+
+/**
+ * \brief Receives notifications about the operations performed by a connection.
+ * \details Install one with connection::set_tracing_hook(), e.g. to feed a
+ * tracing system or latency histograms. on_operation_start() is called when
+ * the request is queued for sending, and on_operation_end() when the server
+ * signals it has finished processing it (its ReadyForQuery is received), so
+ * the interval includes fetching the results. For pipelines, requests start
+ * when added, and end in order. If the connection fails, pending operations
+ * end with the error that caused it.
+ *
+ * The info strings are only valid during the call. Requests that need no
+ * round trip (like statement cache hits) are not reported. Hooks must not
+ * throw or use the connection. When no hook is installed, no work is done
+ * besides checking a pointer.
+ */
+class tracing_hook
+{
+public:
+	virtual ~tracing_hook() = default;
+	virtual void on_operation_start(const operation_info& info) noexcept = 0;
+	virtual void on_operation_end(const operation_info& info, error_code err) noexcept = 0;
+};
+
+}
+
+#endif /* INCLUDE_PSQL_INSTRUMENTATION_H_ */
@@ -2,10 +2,21 @@
 #define INCLUDE_PSQL_MESSAGES_H_
 
 #include "psql/serialization.h"
+#include "psql/codecs.h"
+#include <charconv>
+#include <variant>
+#include <string>
 
 namespace psql
 {
 
+/// A backend message, as a view into the channel's read buffer.
+struct message_view
+{
+	std::uint8_t type {};
+	boost::asio::const_buffer body;
+};
+
 // Generic utils
 template <std::uint8_t msg_type>
 struct empty_message
@@ -45,6 +56,33 @@ struct get_struct_fields<startup_message>
 	);
 };
 
+// Sent instead of the startup message to ask for TLS. The server
+// answers with a single byte: 'S' to proceed, or 'N'
+struct ssl_request_message
+{
+	std::int32_t request_code = 80877103;
+
+	static constexpr std::uint8_t message_type = 0;
+};
+
+template <>
+struct get_struct_fields<ssl_request_message>
+{
+	static constexpr auto value = std::make_tuple(
+		&ssl_request_message::request_code
+	);
+};
+
+// Values of authentication_request::auth_type
+namespace auth_type
+{
+constexpr std::int32_t ok = 0;
+constexpr std::int32_t md5_password = 5;
+constexpr std::int32_t sasl = 10;          // auth_data: the mechanism names
+constexpr std::int32_t sasl_continue = 11; // auth_data: a server challenge
+constexpr std::int32_t sasl_final = 12;    // auth_data: the server's outcome
+}
+
 struct authentication_request
 {
 	std::int32_t auth_type;
@@ -77,6 +115,39 @@ struct get_struct_fields<password_message>
 	);
 };
 
+// SASL messages share the password message type
+struct sasl_initial_response_message
+{
+	string_null mechanism;
+	string_lenenc data;
+
+	static constexpr std::uint8_t message_type = std::uint8_t('p');
+};
+
+template <>
+struct get_struct_fields<sasl_initial_response_message>
+{
+	static constexpr auto value = std::make_tuple(
+		&sasl_initial_response_message::mechanism,
+		&sasl_initial_response_message::data
+	);
+};
+
+struct sasl_response_message
+{
+	string_eof data;
+
+	static constexpr std::uint8_t message_type = std::uint8_t('p');
+};
+
+template <>
+struct get_struct_fields<sasl_response_message>
+{
+	static constexpr auto value = std::make_tuple(
+		&sasl_response_message::data
+	);
+};
+
 // Row description
 struct single_row_description
 {
@@ -166,28 +237,101 @@ struct get_struct_fields<ready_for_query_message>
 	);
 };
 
+// CommandComplete. The tag is the command name, followed by the number
+// of rows it processed for most commands (e.g. "INSERT 0 5", "UPDATE 3")
+struct command_complete_message
+{
+	string_null tag;
+
+	static constexpr std::uint8_t message_type = std::uint8_t('C');
+};
+
+template <>
+struct get_struct_fields<command_complete_message>
+{
+	static constexpr auto value = std::make_tuple(
+		&command_complete_message::tag
+	);
+};
+
+// The number of rows in a command tag, or zero for commands that don't report it
+inline std::uint64_t command_tag_rows(std::string_view tag) noexcept
+{
+	std::string_view count = tag.substr(tag.rfind(' ') + 1);
+	std::uint64_t res = 0;
+	std::from_chars(count.data(), count.data() + count.size(), res);
+	return res;
+}
+
+// Sent instead of CommandComplete for an empty query string
+using empty_query_response_message = empty_message<'I'>;
+
 // Extended query
 struct parse_message
 {
 	string_null name;
 	string_null statement;
-	std::int16_t num_params = 0; // pre-specified parameter types, not supported yet
+	const std::int32_t* param_types_begin = nullptr; // pre-specified parameter types (0 = unspecified)
+	const std::int32_t* param_types_end = nullptr;
+	// std::int16_t num_params; && std::int32_t param_types[]
 
 	static constexpr std::uint8_t message_type = std::uint8_t('P');
 };
 
 template <>
-struct get_struct_fields<parse_message>
+struct serialization_traits<parse_message, serialization_tag::none>
 {
-	static constexpr auto value = std::make_tuple(
-		&parse_message::name,
-		&parse_message::statement,
-		&parse_message::num_params
-	);
+	static inline std::size_t get_size_(const parse_message& input, const serialization_context& ctx) noexcept
+	{
+		return get_size(input.name, ctx) +
+			get_size(input.statement, ctx) +
+			2 + // num_params
+			4 * (input.param_types_end - input.param_types_begin);
+	}
+
+	static inline void serialize_(const parse_message& input, serialization_context& ctx) noexcept
+	{
+		serialize(input.name, ctx);
+		serialize(input.statement, ctx);
+		serialize(std::int16_t(input.param_types_end - input.param_types_begin), ctx);
+		for (auto it = input.param_types_begin; it != input.param_types_end; ++it)
+		{
+			serialize(*it, ctx);
+		}
+	}
 };
 
 using parse_complete_message = empty_message<'1'>;
 
+struct parameter_description_message
+{
+	std::vector<std::int32_t> type_oids;
+
+	static constexpr std::uint8_t message_type = std::uint8_t('t');
+};
+
+template <>
+struct serialization_traits<parameter_description_message, serialization_tag::none> :
+	noop_serialize<parameter_description_message>
+{
+	static inline errc deserialize_(parameter_description_message& output, deserialization_context& ctx)
+	{
+		// Statements may have up to 65535 parameters
+		std::uint16_t num_params = 0;
+		auto err = deserialize(num_params, ctx);
+		if (err != errc::ok) return err;
+		if (!ctx.enough_size(std::size_t(num_params) * sizeof(std::int32_t))) return errc::incomplete_message;
+
+		output.type_oids.resize(num_params);
+		for (auto& oid: output.type_oids)
+		{
+			err = deserialize(oid, ctx);
+			if (err != errc::ok) return err;
+		}
+		return errc::ok;
+	}
+};
+
 template <typename ForwardIterator>
 struct bind_message
 {
@@ -195,9 +339,13 @@ struct bind_message
 	string_null statement_name;
 	ForwardIterator params_begin;
 	ForwardIterator params_end;
-	// std::int16_t num_format_codes = 0; // not supported
-	// std::int16_t num_params; && std::int32_t param length (-1 for NULL), string_null param_value
-	// std::int16_t num_output_format_codes = 0;
+	std::vector<encoded_param>* encoded_params; // scratch, reused across messages (see channel::param_buffer())
+	const std::int32_t* param_types = nullptr; // one per parameter; if nullptr, natural_type_oid() is used
+	const std::int16_t* output_formats_begin = nullptr; // no format codes means all text
+	const std::int16_t* output_formats_end = nullptr;
+	// std::int16_t num_format_codes; && std::int16_t format_codes[] (one per parameter)
+	// std::int16_t num_params; && std::int32_t param length (-1 for NULL), param_value
+	// std::int16_t num_output_format_codes; && std::int16_t output_format_codes[]
 	static constexpr std::uint8_t message_type = std::uint8_t('B');
 };
 
@@ -206,63 +354,62 @@ struct serialization_traits<bind_message<ForwardIterator>, serialization_tag::no
 {
 	using msg_type = bind_message<ForwardIterator>;
 
-	static std::size_t get_size_(const msg_type& input, const serialization_context& ctx)
+	// Each parameter is encoded once, by get_size_, into the scratch buffer,
+	// and serialize_ (which always follows it) copies the results
+	static std::size_t get_size_(const msg_type& input, const serialization_context& ctx) noexcept
 	{
+		std::size_t num_params = std::distance(input.params_begin, input.params_end);
 		std::size_t res =
 			get_size(input.portal_name, ctx) +
 			get_size(input.statement_name, ctx) +
 			2 + // num_format_codes
+			2 * num_params +
 			2 + // num_params
-			2;  // num_output_format_codes
-		for (auto it = input.params_begin; it != input.params_end; ++it)
+			4 * num_params + // param lengths
+			2 + // num_output_format_codes
+			2 * (input.output_formats_end - input.output_formats_begin);
+		auto& encoded = *input.encoded_params;
+		encoded.resize(num_params);
+		std::size_t index = 0;
+		for (auto it = input.params_begin; it != input.params_end; ++it, ++index)
 		{
-			res += std::visit([](auto v) {
-				using T = decltype(v);
-				if constexpr (std::is_arithmetic_v<T>)
-				{
-					return std::size_t(std::to_string(v).size() + 4); // length
-				}
-				else if constexpr (std::is_same_v<T, std::string_view>)
-				{
-					return std::size_t(v.size() + 4); // length
-				}
-				else // NULL
-				{
-					return std::size_t(4);
-				}
-			}, *it);
+			encoded_param& param = encoded[index];
+			param.reset();
+			std::int32_t type_oid = input.param_types ? input.param_types[index] : natural_type_oid(*it);
+			encode_param(*it, type_oid, param);
+			res += param.data().size();
 		}
 		return res;
 	}
 
-	static void serialize_(const msg_type& input, serialization_context& ctx)
+	static void serialize_(const msg_type& input, serialization_context& ctx) noexcept
 	{
+		const auto& encoded = *input.encoded_params;
+		auto num_params = std::int16_t(encoded.size());
 		serialize(input.portal_name, ctx);
 		serialize(input.statement_name, ctx);
-		serialize(std::int16_t(0), ctx); // format codes
-		serialize(std::int16_t(std::distance(input.params_begin, input.params_end)), ctx);
-		for (auto it = input.params_begin; it != input.params_end; ++it)
+
+		// Parameter format codes
+		serialize(num_params, ctx);
+		for (const auto& param: encoded)
+		{
+			serialize(param.format(), ctx);
+		}
+
+		// Parameter values
+		serialize(num_params, ctx);
+		for (const auto& param: encoded)
 		{
-			std::visit([&ctx](auto v) {
-				using T = decltype(v);
-				if constexpr (std::is_arithmetic_v<T>)
-				{
-					auto s = std::to_string(v);
-					//serialize(std::int32_t(s.size()), ctx);
-					serialize(string_lenenc(s), ctx);
-				}
-				else if constexpr (std::is_same_v<T, std::string_view>)
-				{
-					//serialize(std::int32_t(v.size()), ctx);
-					serialize(string_lenenc(v), ctx);
-				}
-				else // NULL
-				{
-					serialize(std::int32_t(-1), ctx);
-				}
-			}, *it);
+			serialize(param.length(), ctx);
+			ctx.write(param.data().data(), param.data().size());
+		}
+
+		// Result format codes
+		serialize(std::int16_t(input.output_formats_end - input.output_formats_begin), ctx);
+		for (auto it = input.output_formats_begin; it != input.output_formats_end; ++it)
+		{
+			serialize(*it, ctx);
 		}
-		serialize(std::int16_t(0), ctx); // output format codes
 	}
 };
 
@@ -285,6 +432,10 @@ struct get_struct_fields<execute_message>
 	);
 };
 
+// Sent instead of CommandComplete when an Execute with max_rows
+// stops before the portal has returned all its rows
+using portal_suspended_message = empty_message<'s'>;
+
 struct describe_message
 {
 	std::uint8_t type; // 'P' for Portal, 'S' for statement
@@ -321,10 +472,91 @@ struct get_struct_fields<close_message>
 
 using close_complete = empty_message<'3'>;
 
+// Copy
+// CopyInResponse and CopyOutResponse
+template <std::uint8_t msg_type>
+struct copy_response_message
+{
+	std::uint8_t format; // overall format: 0 for text (including CSV), 1 for binary
+	std::vector<std::int16_t> column_formats;
+
+	static constexpr std::uint8_t message_type = msg_type;
+};
+
+template <std::uint8_t msg_type>
+struct serialization_traits<copy_response_message<msg_type>, serialization_tag::none> :
+	noop_serialize<copy_response_message<msg_type>>
+{
+	static inline errc deserialize_(copy_response_message<msg_type>& output, deserialization_context& ctx)
+	{
+		std::uint16_t num_columns = 0;
+		auto err = deserialize(output.format, ctx);
+		if (err != errc::ok) return err;
+		err = deserialize(num_columns, ctx);
+		if (err != errc::ok) return err;
+		if (!ctx.enough_size(std::size_t(num_columns) * sizeof(std::int16_t))) return errc::incomplete_message;
+
+		output.column_formats.resize(num_columns);
+		for (auto& format: output.column_formats)
+		{
+			err = deserialize(format, ctx);
+			if (err != errc::ok) return err;
+		}
+		return errc::ok;
+	}
+};
+
+using copy_in_response_message = copy_response_message<'G'>;
+using copy_out_response_message = copy_response_message<'H'>;
+
+// CopyData messages are written directly into the channel's buffer, and
+// read directly from it, to avoid copying their payload
+constexpr std::uint8_t copy_data_message_type = std::uint8_t('d');
+
+using copy_done_message = empty_message<'c'>;
+
+struct copy_fail_message
+{
+	string_null message;
+
+	static constexpr std::uint8_t message_type = std::uint8_t('f');
+};
+
+template <>
+struct get_struct_fields<copy_fail_message>
+{
+	static constexpr auto value = std::make_tuple(
+		&copy_fail_message::message
+	);
+};
+
+// Errors. The fields are parsed by error_info, straight from the message body
+constexpr std::uint8_t error_response_message_type = std::uint8_t('E');
+
+
+// Asynchronous messages: the server may send them at any time, including in
+// the middle of a response, so they are not part of any response
+constexpr std::uint8_t notice_response_message_type = std::uint8_t('N');
+constexpr std::uint8_t parameter_status_message_type = std::uint8_t('S');
+constexpr std::uint8_t notification_response_message_type = std::uint8_t('A');
+
+inline bool is_async_message(std::uint8_t msg_type) noexcept
+{
+	return msg_type == notice_response_message_type ||
+		msg_type == parameter_status_message_type ||
+		msg_type == notification_response_message_type;
+}
 
 using flush_message = empty_message<'H'>;
 using sync_message = empty_message<'S'>;
 
+// Parse, Bind, Describe, Execute and Close: frontend messages of an extended
+// query, which the server doesn't finish processing until a Sync
+constexpr bool is_extended_query_message(std::uint8_t msg_type) noexcept
+{
+	return msg_type == 'P' || msg_type == 'B' || msg_type == 'D' || msg_type == 'E' || msg_type == 'C';
+}
+
 }
 
 #endif /* INCLUDE_PSQL_MESSAGES_H_ */
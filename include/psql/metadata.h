@@ -3,20 +3,27 @@
 
 #include "psql/messages.h"
 #include "psql/types.h"
+#include "psql/codec_registry.h"
+#include <algorithm>
 
 namespace psql
 {
 
 class field_metadata
 {
-	single_row_description msg_;
+	single_row_description msg_ {};
+	value_decoder decoder_ {&decode_unsupported};
 public:
 	field_metadata() = default;
-	field_metadata(const single_row_description& msg) noexcept: msg_(msg) {};
+	field_metadata(const single_row_description& msg, const codec_registry& registry) noexcept:
+		msg_(msg), decoder_(registry.get_decoder(msg.type_oid, msg.format)) {};
 
 	std::string_view field_name() const noexcept { return msg_.name.value; }
 	std::int32_t type_oid() const noexcept { return msg_.type_oid; }
 	std::int16_t format() const noexcept { return msg_.format; }
+
+	/// The function that decodes this field's values, resolved when the metadata was received.
+	value_decoder decoder() const noexcept { return decoder_; }
 };
 
 
@@ -36,19 +43,123 @@ public:
 	const auto& fields() const noexcept { return fields_; }
 };
 
-resultset_metadata make_resultset_metadata(
+inline resultset_metadata make_resultset_metadata(
 	const row_description& msg,
-	bytestring&& buffer
+	bytestring&& buffer,
+	const codec_registry& registry = default_codec_registry()
 )
 {
 	std::vector<field_metadata> m;
+	m.reserve(msg.rows.size());
 	for (const auto& single: msg.rows)
 	{
-		m.push_back(field_metadata(single));
+		m.push_back(field_metadata(single, registry));
 	}
 	return resultset_metadata(std::move(buffer), std::move(m));
 }
 
+// Parses a RowDescription message body. The body is copied, so
+// the resulting metadata does not depend on the channel's read buffer.
+// Field decoders are resolved with registry
+inline error_code make_resultset_metadata(
+	boost::asio::const_buffer row_description_body,
+	resultset_metadata& output,
+	const codec_registry& registry = default_codec_registry()
+)
+{
+	const auto* first = static_cast<const std::uint8_t*>(row_description_body.data());
+	bytestring buffer (first, first + row_description_body.size());
+	deserialization_context ctx (boost::asio::buffer(buffer));
+	row_description descr;
+	auto err = deserialize_message(descr, ctx);
+	if (!err)
+	{
+		output = make_resultset_metadata(descr, std::move(buffer), registry);
+	}
+	return err;
+}
+
+inline resultset_metadata make_resultset_metadata(
+	boost::asio::const_buffer row_description_body,
+	const codec_registry& registry = default_codec_registry()
+)
+{
+	resultset_metadata res;
+	check_error_code(make_resultset_metadata(row_description_body, res, registry), error_info());
+	return res;
+}
+
+// What we know about a prepared statement, from Describe (statement)
+struct statement_description
+{
+	// Parameter types, as reported by the server
+	std::vector<std::int32_t> param_types;
+
+	// Result format codes to request when binding the statement
+	std::vector<std::int16_t> result_formats;
+};
+
+// Requests binary format for all the columns that can be decoded in binary,
+// and text for the rest. Uses a single format code if possible.
+// bytea is always requested in text, as simple queries return it, so its values
+// are the server's escaped text (e.g. \x0102) whichever way a statement is run
+inline std::vector<std::int16_t> choose_result_formats(
+	const row_description& descr,
+	const codec_registry& registry
+)
+{
+	auto use_binary = [&registry](const single_row_description& field) {
+		return field.type_oid != bytea_oid && registry.is_binary_supported(field.type_oid);
+	};
+	bool all_binary = std::all_of(descr.rows.begin(), descr.rows.end(), use_binary);
+	if (descr.rows.empty()) return {};
+	if (all_binary) return { binary_format };
+	std::vector<std::int16_t> res;
+	res.reserve(descr.rows.size());
+	for (const auto& field: descr.rows)
+	{
+		res.push_back(use_binary(field) ? binary_format : text_format);
+	}
+	return res;
+}
+
+// Processes the ParameterDescription in the response to a Describe (statement)
+inline error_code process_statement_params(const message_view& msg, statement_description& output)
+{
+	if (msg.type != parameter_description_message::message_type)
+	{
+		return make_error_code(errc::unexpected_message);
+	}
+	parameter_description_message params;
+	deserialization_context ctx (msg.body);
+	auto err = deserialize_message(params, ctx);
+	output.param_types = std::move(params.type_oids);
+	return err;
+}
+
+// Processes the RowDescription or NoData in the response to a Describe (statement).
+// Result formats are chosen with the registry that will decode the results
+inline error_code process_statement_fields(
+	const message_view& msg,
+	const codec_registry& registry,
+	statement_description& output
+)
+{
+	if (msg.type == row_description::message_type)
+	{
+		row_description descr;
+		deserialization_context ctx (msg.body);
+		auto err = deserialize_message(descr, ctx);
+		if (err) return err;
+		output.result_formats = choose_result_formats(descr, registry);
+	}
+	else if (msg.type != no_data_message::message_type)
+	{
+		return make_error_code(errc::unexpected_message);
+	}
+	return error_code();
+}
+
 }
 
 #endif /* INCLUDE_PSQL_METADATA_H_ */
@@ -0,0 +1,205 @@
+#ifndef INCLUDE_PSQL_MULTI_RESULTSET_H_
+#define INCLUDE_PSQL_MULTI_RESULTSET_H_
+
+#include "psql/channel.h"
+#include "psql/resultset.h"
+
+namespace psql
+{
+
+/**
+ * \brief The results of a simple query containing several statements.
+ * \details Statements are executed in order, and each one yields a
+ * resultset, retrieved by calling next_resultset() until it returns nullptr.
+ * Statements without rows (e.g. DDL or DML) yield a complete resultset,
+ * with its command tag and number of affected rows. Rows that are not
+ * fetched are discarded when the next resultset is requested.
+ *
+ * If a statement fails, the following ones are not executed, and the
+ * error is reported when its resultset is requested. Unless the query
+ * contains explicit transaction control statements, all the statements
+ * run in a single transaction, so no changes are applied in this case.
+ *
+ * The connection must not be used for anything else until next_resultset()
+ * has returned nullptr.
+ */
+template <typename Stream>
+class multi_resultset
+{
+	struct next_resultset_op;
+
+	channel<Stream>* channel_;
+	resultset<Stream> current_;
+	bool done_ {false};
+
+	// Processes the first message of a resultset, or the ReadyForQuery that ends the response
+	error_code process_head(const message_view& msg)
+	{
+		if (msg.type == row_description::message_type)
+		{
+			resultset_metadata meta;
+			auto err = make_resultset_metadata(msg.body, meta, channel_->codecs());
+			current_ = resultset<Stream>(*channel_, std::move(meta), true);
+			done_ = false;
+			return err;
+		}
+		else if (msg.type == command_complete_message::message_type)
+		{
+			current_ = resultset<Stream>(*channel_, resultset_metadata(), true);
+			done_ = false;
+			return current_.process_complete(msg);
+		}
+		else if (msg.type == empty_query_response_message::message_type)
+		{
+			current_ = resultset<Stream>(*channel_, std::string_view(), true);
+			done_ = false;
+			return error_code();
+		}
+		else if (msg.type == ready_for_query_message::message_type)
+		{
+			return error_code();
+		}
+		return make_error_code(errc::unexpected_message);
+	}
+public:
+	/// Default constructor.
+	multi_resultset(): channel_(nullptr) {}
+
+	// Private, do not use
+	multi_resultset(channel<Stream>& chan) noexcept: channel_(&chan) {}
+
+	bool valid() const noexcept { return channel_ != nullptr; }
+
+	/// Whether all the resultsets have been retrieved.
+	bool complete() const noexcept { return done_; }
+
+	/**
+	 * \brief Retrieves the resultset of the next statement.
+	 * \details Returns nullptr once all resultsets have been retrieved.
+	 * The resultset remains valid until the next call.
+	 */
+	resultset<Stream>* next_resultset()
+	{
+		error_code err;
+		error_info info;
+		resultset<Stream>* res = next_resultset(err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Retrieves the resultset of the next statement (sync with error codes version).
+	resultset<Stream>* next_resultset(error_code& err, error_info& info)
+	{
+		assert(channel_);
+		err.clear();
+		info.clear();
+		if (done_) return nullptr;
+
+		// Errors end the response, so consider it done until we know otherwise
+		done_ = true;
+
+		// Discard the rows that were not fetched
+		message_view msg;
+		while (current_.valid() && current_.read_row_message(msg, err, info))
+		{
+		}
+		if (err) return nullptr;
+
+		msg = channel_->read_message(err);
+		if (!err && msg.type == error_response_message_type) channel_->handle_error_response(msg, err, info);
+		if (!err) err = process_head(msg);
+		return err || done_ ? nullptr : &current_;
+	}
+
+	/**
+	 * \brief Retrieves the resultset of the next statement (async version).
+	 * \details The handler signature is void(error_code, resultset<Stream>*).
+	 * The pointer is nullptr once all resultsets have been retrieved.
+	 */
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, resultset<Stream>*))
+	async_next_resultset(CompletionToken&& token, error_info* info=nullptr)
+	{
+		assert(channel_);
+		conditional_clear(info);
+		return boost::asio::async_compose<CompletionToken, void(error_code, resultset<Stream>*)>(
+			next_resultset_op{*this, info}, token, channel_->next_layer());
+	}
+};
+
+template <typename Stream>
+struct multi_resultset<Stream>::next_resultset_op : boost::asio::coroutine
+{
+	multi_resultset<Stream>& obj_;
+	error_info* info_;
+
+	next_resultset_op(multi_resultset<Stream>& obj, error_info* info) noexcept:
+		obj_(obj), info_(info) {}
+
+	// Processes a message while discarding rows. Returns false once the resultset is complete
+	bool process_skipped(const message_view& msg, error_code& err)
+	{
+		if (msg.type == command_complete_message::message_type)
+		{
+			err = obj_.current_.process_complete(msg);
+			return false;
+		}
+		if (msg.type == std::uint8_t('D')) return true; // data row
+		if (msg.type != error_response_message_type)
+		{
+			err = make_error_code(errc::unexpected_message);
+		}
+		return false;
+	}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			if (obj_.done_)
+			{
+				BOOST_ASIO_CORO_YIELD boost::asio::post(obj_.channel_->next_layer().get_executor(), std::move(self));
+				self.complete(error_code(), nullptr);
+				BOOST_ASIO_CORO_YIELD break;
+			}
+			obj_.done_ = true;
+
+			// Discard the rows that were not fetched. Messages that have already
+			// been received are processed without going through the executor
+			while (obj_.current_.valid() && !obj_.current_.complete())
+			{
+				BOOST_ASIO_CORO_YIELD obj_.channel_->async_read_message(std::move(self));
+				while (!err && process_skipped(msg, err) && obj_.channel_->read_buffered_message(msg, err))
+				{
+				}
+				if (!err && msg.type == error_response_message_type)
+				{
+					obj_.current_.complete_ = true;
+					BOOST_ASIO_CORO_YIELD obj_.channel_->async_handle_error_response(msg, info_, std::move(self));
+				}
+				if (err)
+				{
+					self.complete(err, nullptr);
+					BOOST_ASIO_CORO_YIELD break;
+				}
+			}
+
+			// Next resultset, or end of response
+			BOOST_ASIO_CORO_YIELD obj_.channel_->async_read_message(std::move(self));
+			if (!err && msg.type == error_response_message_type)
+			{
+				BOOST_ASIO_CORO_YIELD obj_.channel_->async_handle_error_response(msg, info_, std::move(self));
+			}
+			else if (!err)
+			{
+				err = obj_.process_head(msg);
+			}
+			self.complete(err, err || obj_.done_ ? nullptr : &obj_.current_);
+		}
+	}
+};
+
+}
+
+#endif /* INCLUDE_PSQL_MULTI_RESULTSET_H_ */
@@ -0,0 +1,37 @@
+#ifndef INCLUDE_PSQL_OIDS_H_
+#define INCLUDE_PSQL_OIDS_H_
+
+#include <cstdint>
+
+namespace psql
+{
+
+// Type OIDs of built-in types, as defined in pg_type.h
+constexpr std::int32_t unspecified_oid = 0;
+constexpr std::int32_t bool_oid = 16;
+constexpr std::int32_t bytea_oid = 17;
+constexpr std::int32_t char_oid = 18;
+constexpr std::int32_t name_oid = 19;
+constexpr std::int32_t int8_oid = 20;
+constexpr std::int32_t int2_oid = 21;
+constexpr std::int32_t int4_oid = 23;
+constexpr std::int32_t text_oid = 25;
+constexpr std::int32_t oid_oid = 26;
+constexpr std::int32_t json_oid = 114;
+constexpr std::int32_t float4_oid = 700;
+constexpr std::int32_t float8_oid = 701;
+constexpr std::int32_t bpchar_oid = 1042;
+constexpr std::int32_t varchar_oid = 1043;
+constexpr std::int32_t date_oid = 1082;
+constexpr std::int32_t time_oid = 1083;
+constexpr std::int32_t timestamp_oid = 1114;
+constexpr std::int32_t timestamptz_oid = 1184;
+constexpr std::int32_t numeric_oid = 1700;
+
+// Format codes
+constexpr std::int16_t text_format = 0;
+constexpr std::int16_t binary_format = 1;
+
+}
+
+#endif /* INCLUDE_PSQL_OIDS_H_ */
@@ -0,0 +1,199 @@
+#ifndef INCLUDE_PSQL_PIPELINE_H_
+#define INCLUDE_PSQL_PIPELINE_H_
+
+#include "psql/channel.h"
+#include "psql/resultset.h"
+#include "psql/response.h"
+#include "psql/prepared_statement.h"
+#include <vector>
+
+namespace psql
+{
+
+/**
+ * \brief Queues several independent requests on a connection and sends them together.
+ * \details Requests are added with add_query() and add_execute(), and sent
+ * with a single write by send(). Each request ends with its own Sync
+ * (simple queries have an implicit one), so an error in a request
+ * does not affect the others. Results are retrieved in order by calling
+ * next_result() once per request. A result that is not fully read
+ * is discarded when the next one is requested.
+ *
+ * No other operation may be performed on the connection until all results
+ * have been retrieved. As with any pipelining client, sending a very large
+ * number of requests at once may fill both socket buffers and block, so
+ * keep pipelines reasonably sized (e.g. less than a few MB of requests).
+ */
+template <typename Stream>
+class pipeline
+{
+	enum class request_type : std::uint8_t
+	{
+		query,
+		execute
+	};
+
+	struct next_result_op;
+
+	channel<Stream>* channel_;
+	std::vector<request_type> requests_;
+	std::size_t first_ready_count_ {0}; // channel's ready_count() when the first request was added
+	std::size_t next_result_ {0};
+
+	void add_request(request_type type)
+	{
+		if (requests_.empty())
+		{
+			first_ready_count_ = channel_->ready_count();
+		}
+		requests_.push_back(type);
+	}
+
+	// Number of ReadyForQuery that must have been received before
+	// the response to the next request starts
+	std::size_t next_ready_count() const noexcept { return first_ready_count_ + next_result_; }
+public:
+	// Private, do not use
+	pipeline(channel<Stream>& chan) noexcept: channel_(&chan) {}
+
+	/// Adds a text query. The query string is serialized immediately.
+	void add_query(std::string_view query_string)
+	{
+		add_request(request_type::query);
+		channel_->begin_operation(operation_type::query, std::string_view(), query_string);
+		channel_->enqueue(query_message{
+			string_null(query_string)
+		});
+	}
+
+	/// Adds a prepared statement execution. The parameters are serialized immediately.
+	template <typename ForwardIterator>
+	void add_execute(const prepared_statement<Stream>& stmt, ForwardIterator params_first, ForwardIterator params_last)
+	{
+		assert(stmt.valid());
+		add_request(request_type::execute);
+		stmt.enqueue_execute(params_first, params_last);
+	}
+
+	/// The number of requests added to the pipeline.
+	std::size_t size() const noexcept { return requests_.size(); }
+
+	/// Whether there are results that have not been retrieved by next_result() yet.
+	bool has_next_result() const noexcept { return next_result_ < requests_.size(); }
+
+	/// Sends all added requests using a single write.
+	void send()
+	{
+		error_code err;
+		send(err);
+		check_error_code(err, error_info());
+	}
+
+	/// Sends all added requests using a single write (sync with error codes version).
+	void send(error_code& err)
+	{
+		err.clear();
+		channel_->flush(err);
+	}
+
+	/// Sends all added requests using a single write (async version). The handler signature is void(error_code).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code))
+	async_send(CompletionToken&& token)
+	{
+		return channel_->async_flush(std::forward<CompletionToken>(token));
+	}
+
+	/**
+	 * \brief Retrieves the result of the next request.
+	 * \details If the request failed, an exception is thrown, and the
+	 * results of the following requests can still be retrieved.
+	 */
+	resultset<Stream> next_result()
+	{
+		error_code err;
+		error_info info;
+		resultset<Stream> res = next_result(err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Retrieves the result of the next request (sync with error codes version).
+	resultset<Stream> next_result(error_code& err, error_info& info)
+	{
+		assert(has_next_result());
+		err.clear();
+		info.clear();
+
+		// Discard the rest of the previous result, if any
+		while (channel_->ready_count() < next_ready_count() && !err)
+		{
+			channel_->read_message(err);
+		}
+		if (err) return resultset<Stream>();
+
+		request_type type = requests_[next_result_++];
+		return type == request_type::query ?
+			read_query_response(*channel_, err, info) :
+			read_execute_response(*channel_, err, info);
+	}
+
+	/// Retrieves the result of the next request (async version).
+	/// The handler signature is void(error_code, resultset<Stream>).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, resultset<Stream>))
+	async_next_result(CompletionToken&& token, error_info* info=nullptr)
+	{
+		assert(has_next_result());
+		conditional_clear(info);
+		return boost::asio::async_compose<CompletionToken, void(error_code, resultset<Stream>)>(
+			next_result_op{*this, info}, token, channel_->next_layer());
+	}
+};
+
+template <typename Stream>
+struct pipeline<Stream>::next_result_op : boost::asio::coroutine
+{
+	pipeline<Stream>& pipeline_;
+	error_info* info_;
+
+	next_result_op(pipeline<Stream>& obj, error_info* info) noexcept:
+		pipeline_(obj), info_(info) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			// Discard the rest of the previous result, if any
+			while (pipeline_.channel_->ready_count() < pipeline_.next_ready_count())
+			{
+				BOOST_ASIO_CORO_YIELD pipeline_.channel_->async_read_message(std::move(self));
+				if (err)
+				{
+					self.complete(err, resultset<Stream>());
+					BOOST_ASIO_CORO_YIELD break;
+				}
+			}
+
+			if (pipeline_.requests_[pipeline_.next_result_++] == request_type::query)
+			{
+				BOOST_ASIO_CORO_YIELD async_read_query_response(*pipeline_.channel_, info_, std::move(self));
+			}
+			else
+			{
+				BOOST_ASIO_CORO_YIELD async_read_execute_response(*pipeline_.channel_, info_, std::move(self));
+			}
+		}
+	}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err, resultset<Stream> result)
+	{
+		self.complete(err, std::move(result));
+	}
+};
+
+}
+
+#endif /* INCLUDE_PSQL_PIPELINE_H_ */
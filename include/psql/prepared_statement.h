@@ -2,88 +2,305 @@
 #define INCLUDE_PSQL_PREPARED_STATEMENT_H_
 
 #include "psql/channel.h"
+#include "psql/resultset.h"
+#include "psql/response.h"
+#include "psql/cursor.h"
+#include "psql/statement_cache.h"
 
 namespace psql
 {
 
+template <typename Stream>
+class pipeline;
+
 template <typename Stream>
 class prepared_statement
 {
+	friend class pipeline<Stream>;
+
+	struct open_cursor_op;
+	struct close_op;
+
 	channel<Stream>* channel_ {};
-	std::string name_;
+	std::shared_ptr<const statement_info> info_;
 
 	template <typename ForwardIterator>
 	void check_num_params(ForwardIterator first, ForwardIterator last, error_code& err, error_info& info) const;
+
+	template <typename ForwardIterator>
+	void enqueue_bind(ForwardIterator params_first, ForwardIterator params_last, std::string_view portal_name) const
+	{
+		// Parameters are encoded according to the types reported by the server.
+		// If the number of parameters is wrong, the server will report an error
+		const statement_description& descr = info_->descr;
+		bool param_types_ok = std::size_t(std::distance(params_first, params_last)) == descr.param_types.size();
+
+		channel_->enqueue(bind_message<ForwardIterator>{
+			string_null(portal_name),
+			string_null(info_->name),
+			params_first,
+			params_last,
+			&channel_->param_buffer(),
+			param_types_ok ? descr.param_types.data() : nullptr,
+			descr.result_formats.data(),
+			descr.result_formats.data() + descr.result_formats.size()
+		});
+		channel_->enqueue(describe_message{
+			'P',
+			string_null(portal_name)
+		});
+	}
+
+	template <typename ForwardIterator>
+	void enqueue_execute(ForwardIterator params_first, ForwardIterator params_last) const
+	{
+		// Bind, describe, execute and sync are sent in a single flight,
+		// so the whole operation costs a single round trip
+		channel_->begin_operation(operation_type::execute_prepared, info_->name, info_->sql);
+		enqueue_bind(params_first, params_last, ""); // unnamed portal
+		channel_->enqueue(execute_message{
+			string_null("") // unnamed portal
+		});
+		channel_->enqueue(sync_message{});
+	}
+
+	// The portal takes the statement's name, as they live in different namespaces.
+	// The first chunk is requested together with the bind. A Flush is used instead
+	// of a Sync, which would end the implicit transaction the portal lives in
+	template <typename ForwardIterator>
+	void enqueue_open_cursor(ForwardIterator params_first, ForwardIterator params_last, std::int32_t chunk_size) const
+	{
+		channel_->begin_operation(operation_type::open_cursor, info_->name, info_->sql);
+		enqueue_bind(params_first, params_last, info_->name);
+		channel_->enqueue(execute_message{
+			string_null(info_->name),
+			chunk_size
+		});
+		channel_->enqueue(flush_message{});
+	}
+
+	void enqueue_close() const
+	{
+		channel_->begin_operation(operation_type::close_statement, info_->name, info_->sql);
+		channel_->enqueue(close_message{
+			'S',
+			string_null(info_->name)
+		});
+		channel_->enqueue(sync_message{});
+	}
 public:
 	/// Default constructor.
 	prepared_statement() = default;
 
 	// Private. Do not use.
-	prepared_statement(channel<Stream>& chan, std::string&& name) noexcept:
-		channel_(&chan), name_(std::move(name)) {}
+	prepared_statement(channel<Stream>& chan, std::shared_ptr<const statement_info> info) noexcept:
+		channel_(&chan), info_(std::move(info)) {}
 
 	bool valid() const noexcept { return channel_ != nullptr; }
 
+	const std::string& name() const noexcept { return info_->name; }
+
+	/// The parameter type OIDs, as reported by the server.
+	const std::vector<std::int32_t>& param_types() const noexcept { return info_->descr.param_types; }
+
+	/// Whether the statement belongs to the connection's statement cache, which closes it when needed.
+	bool cached() const noexcept { return info_->cached; }
+
 	/// Executes a statement (iterator, sync with exceptions version).
 	template <typename ForwardIterator>
 	resultset<Stream> execute(ForwardIterator params_first, ForwardIterator params_last) const
 	{
-		// Bind
-		channel_->write(bind_message<ForwardIterator>{
-			string_null(""), // unnamed portal
-			string_null(name_),
-			params_first,
-			params_last
-		});
-		channel_->write(flush_message{});
-		bind_complete_message bind_complete;
-		channel_->read(bind_complete);
+		error_code err;
+		error_info info;
+		resultset<Stream> res = execute(params_first, params_last, err, info);
+		check_error_code(err, info);
+		return res;
+	}
 
-		// Issue a describe to get metadata
-		channel_->write(describe_message{
-			'P',
-			string_null("")
-		});
-		channel_->write(flush_message{});
-
-		// We may get either 'no data' or a row_description
-		std::uint8_t msg_type = 0;
-		bytestring meta_buffer;
-		channel_->read(meta_buffer, msg_type);
-		deserialization_context ctx (boost::asio::buffer(meta_buffer));
-		resultset_metadata meta;
-		if (msg_type == row_description::message_type)
-		{
-			row_description descr;
-			check_error_code(deserialize_message(descr, ctx), error_info());
-			meta = make_resultset_metadata(descr, std::move(meta_buffer));
-		}
-		else if (msg_type != no_data_message::message_type)
-		{
-			throw std::runtime_error("Unknown message type");
-		}
+	/// Executes a statement (iterator, sync with error codes version).
+	template <typename ForwardIterator>
+	resultset<Stream> execute(
+		ForwardIterator params_first,
+		ForwardIterator params_last,
+		error_code& err,
+		error_info& info
+	) const
+	{
+		assert(channel_);
+		err.clear();
+		info.clear();
+		enqueue_execute(params_first, params_last);
+		return read_execute_response(*channel_, err, info);
+	}
 
-		// Execute
-		channel_->write(execute_message{
-			string_null("") // unnamed portal
-		});
-		channel_->write(sync_message{});
+	/**
+	 * \brief Executes a statement (iterator, async version).
+	 * \details The handler signature is void(error_code, resultset<Stream>).
+	 * The parameters are serialized before this function returns, so
+	 * they don't need to be kept alive until the operation completes.
+	 */
+	template <typename ForwardIterator, typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, resultset<Stream>))
+	async_execute(
+		ForwardIterator params_first,
+		ForwardIterator params_last,
+		CompletionToken&& token,
+		error_info* info=nullptr
+	) const
+	{
+		assert(channel_);
+		conditional_clear(info);
+		enqueue_execute(params_first, params_last);
+		return async_read_execute_response(*channel_, info, std::forward<CompletionToken>(token));
+	}
 
-		return resultset<Stream>(*channel_, std::move(meta));
+	/**
+	 * \brief Executes a statement, returning a cursor to fetch its rows in chunks.
+	 * \details Each fetch on the cursor returns at most chunk_size rows, which
+	 * must be greater than zero. If prefetch is true, each chunk is requested
+	 * as soon as the previous one has been received. A statement may have a
+	 * single open cursor at a time.
+	 */
+	template <typename ForwardIterator>
+	cursor<Stream> open_cursor(
+		ForwardIterator params_first,
+		ForwardIterator params_last,
+		std::int32_t chunk_size,
+		bool prefetch=false
+	) const
+	{
+		error_code err;
+		error_info info;
+		cursor<Stream> res = open_cursor(params_first, params_last, chunk_size, prefetch, err, info);
+		check_error_code(err, info);
+		return res;
 	}
 
+	/// Executes a statement, returning a cursor to fetch its rows in chunks (sync with error codes version).
+	template <typename ForwardIterator>
+	cursor<Stream> open_cursor(
+		ForwardIterator params_first,
+		ForwardIterator params_last,
+		std::int32_t chunk_size,
+		bool prefetch,
+		error_code& err,
+		error_info& info
+	) const
+	{
+		assert(channel_);
+		assert(chunk_size > 0);
+		err.clear();
+		info.clear();
+		enqueue_open_cursor(params_first, params_last, chunk_size);
+		resultset_metadata meta = read_bind_response(*channel_, true, err, info);
+		return err ? cursor<Stream>() : cursor<Stream>(*channel_, info_->name, std::move(meta), chunk_size, prefetch);
+	}
+
+	/**
+	 * \brief Executes a statement, returning a cursor to fetch its rows in chunks (async version).
+	 * \details The handler signature is void(error_code, cursor<Stream>).
+	 * The parameters are serialized before this function returns.
+	 */
+	template <typename ForwardIterator, typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, cursor<Stream>))
+	async_open_cursor(
+		ForwardIterator params_first,
+		ForwardIterator params_last,
+		std::int32_t chunk_size,
+		bool prefetch,
+		CompletionToken&& token,
+		error_info* info=nullptr
+	) const
+	{
+		assert(channel_);
+		assert(chunk_size > 0);
+		conditional_clear(info);
+		enqueue_open_cursor(params_first, params_last, chunk_size);
+		return boost::asio::async_compose<CompletionToken, void(error_code, cursor<Stream>)>(
+			open_cursor_op{*channel_, info_->name, chunk_size, prefetch, info}, token, channel_->next_layer());
+	}
+
+	/// Closes the statement. Does nothing for cached statements, which are closed by the cache.
 	void close()
+	{
+		error_code err;
+		error_info info;
+		close(err, info);
+		check_error_code(err, info);
+	}
+
+	/// Closes the statement (sync with error codes version).
+	void close(error_code& err, error_info& info)
 	{
 		assert(channel_);
+		err.clear();
+		info.clear();
+		if (cached()) return;
+		enqueue_close();
+		read_close_response(*channel_, err, info);
+	}
 
-		channel_->write(close_message{
-			'S',
-			string_null(name_)
-		});
-		channel_->write(flush_message{});
+	/// Closes the statement (async version). The handler signature is void(error_code).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code))
+	async_close(CompletionToken&& token, error_info* info=nullptr)
+	{
+		assert(channel_);
+		conditional_clear(info);
+		if (!cached()) enqueue_close();
+		return boost::asio::async_compose<CompletionToken, void(error_code)>(
+			close_op{*channel_, info, cached()}, token, channel_->next_layer());
+	}
+};
+
+template <typename Stream>
+struct prepared_statement<Stream>::open_cursor_op
+{
+	channel<Stream>& channel_;
+	std::string name_;
+	std::int32_t chunk_size_;
+	bool prefetch_;
+	error_info* info_;
+
+	template <typename Self>
+	void operator()(Self& self)
+	{
+		async_read_bind_response(channel_, info_, true, std::move(self));
+	}
 
-		close_complete res;
-		channel_->read(res);
+	template <typename Self>
+	void operator()(Self& self, error_code err, resultset_metadata meta)
+	{
+		self.complete(err, err ? cursor<Stream>() :
+			cursor<Stream>(channel_, std::move(name_), std::move(meta), chunk_size_, prefetch_));
+	}
+};
+
+template <typename Stream>
+struct prepared_statement<Stream>::close_op : boost::asio::coroutine
+{
+	channel<Stream>& channel_;
+	error_info* info_;
+	bool cached_;
+
+	close_op(channel<Stream>& chan, error_info* info, bool cached) noexcept:
+		channel_(chan), info_(info), cached_(cached) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			if (cached_)
+			{
+				BOOST_ASIO_CORO_YIELD boost::asio::post(channel_.next_layer().get_executor(), std::move(self));
+			}
+			else
+			{
+				BOOST_ASIO_CORO_YIELD async_read_close_response(channel_, info_, std::move(self));
+			}
+			self.complete(err);
+		}
 	}
 };
 
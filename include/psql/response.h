@@ -0,0 +1,453 @@
+#ifndef INCLUDE_PSQL_RESPONSE_H_
+#define INCLUDE_PSQL_RESPONSE_H_
+
+#include "psql/channel.h"
+#include "psql/resultset.h"
+
+// Reading the first part of a response, up to the point where rows can be fetched.
+// Shared by connection, prepared_statement and pipeline
+
+namespace psql
+{
+
+// Simple query: RowDescription, or CommandComplete or EmptyQueryResponse.
+// Only the first result is returned. Any further ones, from queries
+// with several statements, are skipped (see multi_resultset)
+template <typename Stream>
+resultset<Stream> read_query_response(channel<Stream>& chan, error_code& err, error_info& info)
+{
+	auto msg = chan.read_message(err);
+	if (err) return resultset<Stream>();
+	if (msg.type == row_description::message_type)
+	{
+		resultset_metadata meta;
+		err = make_resultset_metadata(msg.body, meta, chan.codecs());
+		return err ? resultset<Stream>() : resultset<Stream>(chan, std::move(meta));
+	}
+	else if (msg.type == empty_query_response_message::message_type)
+	{
+		chan.finish_response(err, info);
+		return err ? resultset<Stream>() : resultset<Stream>(chan, std::string_view(), true);
+	}
+	else if (chan.check_message_type(msg, command_complete_message::message_type, err, info))
+	{
+		std::string_view tag;
+		err = parse_command_tag(msg, tag);
+		if (err) return resultset<Stream>();
+		resultset<Stream> res (chan, tag);
+		chan.finish_response(err, info);
+		return err ? resultset<Stream>() : std::move(res);
+	}
+	return resultset<Stream>();
+}
+
+// Bind + Describe (portal): BindComplete, then RowDescription or NoData.
+// If the request wasn't followed by a Sync, sync_on_error must be set,
+// so the server is ready for a new query after an error
+template <typename Stream>
+resultset_metadata read_bind_response(channel<Stream>& chan, bool sync_on_error, error_code& err, error_info& info)
+{
+	// Bind complete. If any of the requests failed, the server skips
+	// everything until the sync, and we get an error here
+	auto msg = chan.read_message(err);
+	if (err) return resultset_metadata();
+	if (sync_on_error && msg.type == error_response_message_type)
+	{
+		chan.enqueue(sync_message{});
+	}
+	if (!chan.check_message_type(msg, bind_complete_message::message_type, err, info)) return resultset_metadata();
+
+	// We may get either 'no data' or a row_description
+	msg = chan.read_message(err);
+	resultset_metadata meta;
+	if (err) return meta;
+	if (msg.type == row_description::message_type)
+	{
+		err = make_resultset_metadata(msg.body, meta, chan.codecs());
+	}
+	else
+	{
+		chan.check_message_type(msg, no_data_message::message_type, err, info);
+	}
+	return meta;
+}
+
+// Bind + Describe + Execute + Sync: BindComplete, then RowDescription or NoData
+template <typename Stream>
+resultset<Stream> read_execute_response(channel<Stream>& chan, error_code& err, error_info& info)
+{
+	// DataRows, CommandComplete and ReadyForQuery are read by the resultset
+	resultset_metadata meta = read_bind_response(chan, false, err, info);
+	return err ? resultset<Stream>() : resultset<Stream>(chan, std::move(meta));
+}
+
+// Parse + Bind + Describe (portal) + Execute + Sync, for one-shot queries
+// using the unnamed statement: ParseComplete, then as read_execute_response
+template <typename Stream>
+resultset<Stream> read_parse_execute_response(channel<Stream>& chan, error_code& err, error_info& info)
+{
+	chan.read_message(parse_complete_message::message_type, err, info);
+	return err ? resultset<Stream>() : read_execute_response(chan, err, info);
+}
+
+// Parse + Describe (statement) + Sync: ParseComplete, ParameterDescription,
+// RowDescription or NoData, and ReadyForQuery
+template <typename Stream>
+statement_description read_prepare_response(channel<Stream>& chan, error_code& err, error_info& info)
+{
+	statement_description res;
+	chan.read_message(parse_complete_message::message_type, err, info);
+	if (err) return res;
+	auto msg = chan.read_message(err);
+	if (!err) err = process_statement_params(msg, res);
+	if (!err) msg = chan.read_message(err);
+	if (!err) err = process_statement_fields(msg, chan.codecs(), res);
+	if (!err) chan.read_message(ready_for_query_message::message_type, err, info);
+	return res;
+}
+
+// Close + Sync: CloseComplete and ReadyForQuery
+template <typename Stream>
+void read_close_response(channel<Stream>& chan, error_code& err, error_info& info)
+{
+	chan.read_message(close_complete::message_type, err, info);
+	if (!err) chan.read_message(ready_for_query_message::message_type, err, info);
+}
+
+// Async versions. The handler signature is void(error_code, resultset<Stream>),
+// void(error_code, resultset_metadata) for bind or void(error_code, statement_description) for prepare
+template <typename Stream>
+struct read_query_response_op : boost::asio::coroutine
+{
+	channel<Stream>& channel_;
+	error_info* info_;
+	resultset_metadata meta_;
+	resultset<Stream> result_; // for statements without rows
+
+	read_query_response_op(channel<Stream>& chan, error_info* info) noexcept:
+		channel_(chan), info_(info) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			// We may get row descriptions or command completion
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (err)
+			{
+				self.complete(err, resultset<Stream>());
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			if (msg.type == row_description::message_type)
+			{
+				err = make_resultset_metadata(msg.body, meta_, channel_.codecs());
+				self.complete(err, err ? resultset<Stream>() : resultset<Stream>(channel_, std::move(meta_)));
+			}
+			else if (msg.type == error_response_message_type)
+			{
+				BOOST_ASIO_CORO_YIELD channel_.async_handle_error_response(msg, info_, std::move(self));
+				self.complete(err, resultset<Stream>());
+			}
+			else if (msg.type == command_complete_message::message_type ||
+				msg.type == empty_query_response_message::message_type)
+			{
+				// Further results are skipped
+				if (msg.type == command_complete_message::message_type)
+				{
+					std::string_view tag;
+					err = parse_command_tag(msg, tag);
+					result_ = resultset<Stream>(channel_, tag);
+				}
+				else
+				{
+					result_ = resultset<Stream>(channel_, std::string_view(), true);
+				}
+				if (!err)
+				{
+					BOOST_ASIO_CORO_YIELD channel_.async_finish_response(info_, std::move(self));
+				}
+				self.complete(err, err ? resultset<Stream>() : std::move(result_));
+			}
+			else
+			{
+				self.complete(make_error_code(errc::unexpected_message), resultset<Stream>());
+			}
+		}
+	}
+};
+
+template <typename Stream>
+struct read_bind_response_op : boost::asio::coroutine
+{
+	channel<Stream>& channel_;
+	error_info* info_;
+	bool sync_on_error_;
+	resultset_metadata meta_;
+
+	read_bind_response_op(channel<Stream>& chan, error_info* info, bool sync_on_error) noexcept:
+		channel_(chan), info_(info), sync_on_error_(sync_on_error) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			// Bind complete. If any of the requests failed, the server skips
+			// everything until the sync, and we get an error here
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err && msg.type == error_response_message_type)
+			{
+				if (sync_on_error_) channel_.enqueue(sync_message{});
+				BOOST_ASIO_CORO_YIELD channel_.async_handle_error_response(msg, info_, std::move(self));
+			}
+			else if (!err && msg.type != bind_complete_message::message_type)
+			{
+				err = make_error_code(errc::unexpected_message);
+			}
+			if (err)
+			{
+				self.complete(err, resultset_metadata());
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			// We may get either 'no data' or a row_description
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err)
+			{
+				if (msg.type == row_description::message_type)
+				{
+					err = make_resultset_metadata(msg.body, meta_, channel_.codecs());
+				}
+				else if (msg.type != no_data_message::message_type)
+				{
+					err = make_error_code(errc::unexpected_message);
+				}
+			}
+			if (err)
+			{
+				self.complete(err, resultset_metadata());
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			self.complete(error_code(), std::move(meta_));
+		}
+	}
+};
+
+template <typename Stream>
+struct read_execute_response_op
+{
+	channel<Stream>& channel_;
+	error_info* info_;
+
+	template <typename Self>
+	void operator()(Self& self)
+	{
+		async_read_bind_response(channel_, info_, false, std::move(self));
+	}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err, resultset_metadata meta)
+	{
+		self.complete(err, err ? resultset<Stream>() : resultset<Stream>(channel_, std::move(meta)));
+	}
+};
+
+template <typename Stream>
+struct read_parse_execute_response_op : boost::asio::coroutine
+{
+	channel<Stream>& channel_;
+	error_info* info_;
+
+	read_parse_execute_response_op(channel<Stream>& chan, error_info* info) noexcept:
+		channel_(chan), info_(info) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			// Parse complete. If parsing failed, the server skips
+			// everything until the sync, and we get an error here
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err && msg.type == error_response_message_type)
+			{
+				BOOST_ASIO_CORO_YIELD channel_.async_handle_error_response(msg, info_, std::move(self));
+			}
+			else if (!err && msg.type != parse_complete_message::message_type)
+			{
+				err = make_error_code(errc::unexpected_message);
+			}
+			if (err)
+			{
+				self.complete(err, resultset<Stream>());
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			// The rest is the same as for a prepared statement
+			BOOST_ASIO_CORO_YIELD async_read_execute_response(channel_, info_, std::move(self));
+		}
+	}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err, resultset<Stream> result)
+	{
+		self.complete(err, std::move(result));
+	}
+};
+
+template <typename Stream>
+struct read_prepare_response_op : boost::asio::coroutine
+{
+	channel<Stream>& channel_;
+	error_info* info_;
+	statement_description descr_;
+
+	read_prepare_response_op(channel<Stream>& chan, error_info* info) noexcept:
+		channel_(chan), info_(info) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			// Parse complete. If parsing failed, the server skips
+			// everything until the sync, and we get an error here
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err && msg.type == error_response_message_type)
+			{
+				BOOST_ASIO_CORO_YIELD channel_.async_handle_error_response(msg, info_, std::move(self));
+			}
+			else if (!err && msg.type != parse_complete_message::message_type)
+			{
+				err = make_error_code(errc::unexpected_message);
+			}
+			if (err)
+			{
+				self.complete(err, statement_description());
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			// Parameter description
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err) err = process_statement_params(msg, descr_);
+			if (err)
+			{
+				self.complete(err, statement_description());
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			// Row description or no data
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err) err = process_statement_fields(msg, channel_.codecs(), descr_);
+			if (err)
+			{
+				self.complete(err, statement_description());
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			// Ready for query
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err && msg.type != ready_for_query_message::message_type)
+			{
+				err = make_error_code(errc::unexpected_message);
+			}
+			self.complete(err, std::move(descr_));
+		}
+	}
+};
+
+template <typename Stream>
+struct read_close_response_op : boost::asio::coroutine
+{
+	channel<Stream>& channel_;
+	error_info* info_;
+
+	read_close_response_op(channel<Stream>& chan, error_info* info) noexcept:
+		channel_(chan), info_(info) {}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			// Close complete
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err && msg.type == error_response_message_type)
+			{
+				BOOST_ASIO_CORO_YIELD channel_.async_handle_error_response(msg, info_, std::move(self));
+			}
+			else if (!err && msg.type != close_complete::message_type)
+			{
+				err = make_error_code(errc::unexpected_message);
+			}
+			if (err)
+			{
+				self.complete(err);
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			// Ready for query
+			BOOST_ASIO_CORO_YIELD channel_.async_read_message(std::move(self));
+			if (!err && msg.type != ready_for_query_message::message_type)
+			{
+				err = make_error_code(errc::unexpected_message);
+			}
+			self.complete(err);
+		}
+	}
+};
+
+template <typename Stream, typename CompletionToken>
+BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, resultset<Stream>))
+async_read_query_response(channel<Stream>& chan, error_info* info, CompletionToken&& token)
+{
+	return boost::asio::async_compose<CompletionToken, void(error_code, resultset<Stream>)>(
+		read_query_response_op<Stream>{chan, info}, token, chan.next_layer());
+}
+
+template <typename Stream, typename CompletionToken>
+BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, resultset_metadata))
+async_read_bind_response(channel<Stream>& chan, error_info* info, bool sync_on_error, CompletionToken&& token)
+{
+	return boost::asio::async_compose<CompletionToken, void(error_code, resultset_metadata)>(
+		read_bind_response_op<Stream>{chan, info, sync_on_error}, token, chan.next_layer());
+}
+
+template <typename Stream, typename CompletionToken>
+BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, resultset<Stream>))
+async_read_execute_response(channel<Stream>& chan, error_info* info, CompletionToken&& token)
+{
+	return boost::asio::async_compose<CompletionToken, void(error_code, resultset<Stream>)>(
+		read_execute_response_op<Stream>{chan, info}, token, chan.next_layer());
+}
+
+template <typename Stream, typename CompletionToken>
+BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, resultset<Stream>))
+async_read_parse_execute_response(channel<Stream>& chan, error_info* info, CompletionToken&& token)
+{
+	return boost::asio::async_compose<CompletionToken, void(error_code, resultset<Stream>)>(
+		read_parse_execute_response_op<Stream>{chan, info}, token, chan.next_layer());
+}
+
+template <typename Stream, typename CompletionToken>
+BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, statement_description))
+async_read_prepare_response(channel<Stream>& chan, error_info* info, CompletionToken&& token)
+{
+	return boost::asio::async_compose<CompletionToken, void(error_code, statement_description)>(
+		read_prepare_response_op<Stream>{chan, info}, token, chan.next_layer());
+}
+
+template <typename Stream, typename CompletionToken>
+BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code))
+async_read_close_response(channel<Stream>& chan, error_info* info, CompletionToken&& token)
+{
+	return boost::asio::async_compose<CompletionToken, void(error_code)>(
+		read_close_response_op<Stream>{chan, info}, token, chan.next_layer());
+}
+
+}
+
+#endif /* INCLUDE_PSQL_RESPONSE_H_ */
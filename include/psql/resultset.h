@@ -2,59 +2,537 @@
 #define INCLUDE_PSQL_RESULTSET_H_
 
 #include "psql/channel.h"
-#include "psql/row.h"
-#include "psql/deserialize_row.h"
+#include "psql/row_view.h"
+#include "psql/rows.h"
+#include "psql/columnar.h"
+#include "psql/typed_row.h"
+#include <limits>
 
 namespace psql
 {
 
+template <typename Stream>
+class multi_resultset;
+
+// Gets the command tag from a CommandComplete message
+inline error_code parse_command_tag(const message_view& msg, std::string_view& output)
+{
+	command_complete_message complete;
+	deserialization_context ctx (msg.body);
+	auto err = deserialize_message(complete, ctx);
+	output = complete.tag.value;
+	return err;
+}
+
 template <typename StreamType>
 class resultset
 {
 	using channel_type = channel<StreamType>;
 
+	friend class multi_resultset<StreamType>;
+
+	template <typename Row> struct fetch_one_op;
+	template <typename Output, typename Result=Output> struct fetch_many_op;
+
 	channel_type* channel_;
 	resultset_metadata meta_;
-	row current_row_;
-	bytestring buffer_;
+	row_view current_row_;
 	bool complete_ {false};
+	bool multi_ {false}; // part of a multi_resultset, so the response goes on after CommandComplete
+	bool empty_query_ {false};
+	std::string command_tag_;
+
+	row_binding_cache bindings_;
+
+	template <typename T>
+	const row_binding<T>& get_binding() { return bindings_.get<T>(meta_.fields()); }
+
+	template <typename T>
+	typed_rows<T> make_typed_rows() { return bindings_.make_typed_rows<T>(meta_.fields()); }
+
+	// Processes the CommandComplete that ends the resultset
+	error_code process_complete(const message_view& msg)
+	{
+		complete_ = true;
+		std::string_view tag;
+		auto err = parse_command_tag(msg, tag);
+		command_tag_ = tag;
+		return err;
+	}
+
+	errc process_row(const message_view& msg, const row_view*& output)
+	{
+		++channel_->stats().rows_decoded;
+		auto err = current_row_.reset(meta_.fields(), msg.body);
+		output = err == errc::ok ? &current_row_ : nullptr;
+		return err;
+	}
+
+	template <typename T>
+	errc process_row(const message_view& msg, std::optional<T>& output)
+	{
+		++channel_->stats().rows_decoded;
+		const auto& binding = get_binding<T>();
+		auto err = binding.error();
+		if (err == errc::ok) err = binding.decode(msg.body, output.emplace());
+		if (err != errc::ok) output.reset();
+		return err;
+	}
+
+	// Reads at most count rows into output, which may be a rows, record_batch or typed_rows object
+	template <typename Output>
+	void fetch_into(std::size_t count, Output& output, error_code& err, error_info& info)
+	{
+		decode_timer timer (channel_->stats());
+		message_view msg;
+		while (output.size() < count && read_row_message(msg, err, info))
+		{
+			err = make_error_code(append_data_row(output, msg.body));
+			if (err) return;
+			++channel_->stats().rows_decoded;
+		}
+		if (!err) err = make_error_code(output.finish(meta_.fields()));
+	}
+
+	// Reads the next DataRow into msg. Returns false if the resultset is complete, or on error
+	bool read_row_message(message_view& msg, error_code& err, error_info& info)
+	{
+		assert(channel_);
+		if (complete_) return false;
+
+		// Read message. This is served from the channel's read buffer
+		// most of the time, without performing any I/O
+		msg = channel_->read_message(err);
+		if (err) return false;
+
+		// Check for end of resultset. Anything after it belongs
+		// to other statements, or to the multi_resultset
+		if (msg.type == command_complete_message::message_type)
+		{
+			err = process_complete(msg);
+			if (!err && !multi_) channel_->finish_response(err, info);
+			return false;
+		}
+		else if (msg.type == error_response_message_type)
+		{
+			complete_ = true;
+			channel_->handle_error_response(msg, err, info);
+			return false;
+		}
+		return true;
+	}
 public:
 	/// Default constructor.
 	resultset(): channel_(nullptr) {};
 
 	// Private, do not use
-	resultset(channel_type& channel, resultset_metadata&& meta):
-		channel_(&channel), meta_(std::move(meta)) {};
-	resultset(channel_type& channel) : channel_(&channel), complete_(true) {};
+	resultset(channel_type& channel, resultset_metadata&& meta, bool multi=false):
+		channel_(&channel), meta_(std::move(meta)), multi_(multi) {};
+	resultset(channel_type& channel, std::string_view command_tag, bool empty_query=false):
+		channel_(&channel), complete_(true), empty_query_(empty_query), command_tag_(command_tag) {};
+
+	bool valid() const noexcept { return channel_ != nullptr; }
+	bool complete() const noexcept { return complete_; }
+
+	/**
+	 * \brief The tag the server completed the statement with, e.g. "INSERT 0 5".
+	 * \details Empty until the resultset is complete.
+	 */
+	std::string_view command_tag() const noexcept { return command_tag_; }
+
+	/// The number of rows returned or affected by the statement, once the resultset is complete.
+	std::uint64_t affected_rows() const noexcept { return command_tag_rows(command_tag_); }
 
+	/// Whether the statement was empty, in which case there is no command tag.
+	bool empty_query() const noexcept { return empty_query_; }
+
+	/**
+	 * \brief Fetches a single row.
+	 * \details Returns nullptr once the resultset is complete. Fields are
+	 * decoded on access. The row remains valid until the next fetch operation.
+	 */
+	const row_view* fetch_one()
+	{
+		error_code err;
+		error_info info;
+		const row_view* res = fetch_one(err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Fetches a single row (sync with error codes version).
+	const row_view* fetch_one(error_code& err, error_info& info)
+	{
+		err.clear();
+		info.clear();
+		const row_view* res = nullptr;
+		message_view msg;
+		if (read_row_message(msg, err, info)) err = make_error_code(process_row(msg, res));
+		return res;
+	}
+
+	/**
+	 * \brief Fetches a single row into a T object.
+	 * \details T must specialize get_struct_fields. Returns an empty optional
+	 * once the resultset is complete. string_view members remain valid
+	 * until the next fetch operation.
+	 */
+	template <typename T>
+	std::optional<T> fetch_one()
+	{
+		error_code err;
+		error_info info;
+		std::optional<T> res = fetch_one<T>(err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Fetches a single row into a T object (sync with error codes version).
+	template <typename T>
+	std::optional<T> fetch_one(error_code& err, error_info& info)
+	{
+		info.clear();
+		std::optional<T> res;
+		err = make_error_code(get_binding<T>().error());
+		if (err) return res;
+		message_view msg;
+		if (read_row_message(msg, err, info)) err = make_error_code(process_row(msg, res));
+		return res;
+	}
+
+	/**
+	 * \brief Fetches at most count rows.
+	 * \details The returned object owns the row contents, so it
+	 * remains valid after further operations on this resultset.
+	 * On error, no rows are returned.
+	 */
+	rows fetch_many(std::size_t count)
+	{
+		error_code err;
+		error_info info;
+		rows res = fetch_many(count, err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Fetches at most count rows (sync with error codes version).
+	rows fetch_many(std::size_t count, error_code& err, error_info& info)
+	{
+		err.clear();
+		info.clear();
+		rows res;
+		fetch_into(count, res, err, info);
+		return err ? rows() : std::move(res);
+	}
+
+	/// Fetches all remaining rows.
+	rows fetch_all() { return fetch_many(std::numeric_limits<std::size_t>::max()); }
+
+	/// Fetches all remaining rows (sync with error codes version).
+	rows fetch_all(error_code& err, error_info& info) { return fetch_many(std::numeric_limits<std::size_t>::max(), err, info); }
+
+	/// Fetches at most count rows into T objects. T must specialize get_struct_fields.
+	template <typename T>
+	std::vector<T> fetch_many(std::size_t count)
+	{
+		error_code err;
+		error_info info;
+		std::vector<T> res = fetch_many<T>(count, err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Fetches at most count rows into T objects (sync with error codes version).
+	template <typename T>
+	std::vector<T> fetch_many(std::size_t count, error_code& err, error_info& info)
+	{
+		info.clear();
+		typed_rows<T> res = make_typed_rows<T>();
+		err = make_error_code(res.finish(meta_.fields()));
+		if (!err) fetch_into(count, res, err, info);
+		return err ? std::vector<T>() : res.release();
+	}
+
+	/// Fetches all remaining rows into T objects.
+	template <typename T>
+	std::vector<T> fetch_all() { return fetch_many<T>(std::numeric_limits<std::size_t>::max()); }
+
+	/// Fetches all remaining rows into T objects (sync with error codes version).
+	template <typename T>
+	std::vector<T> fetch_all(error_code& err, error_info& info)
+	{
+		return fetch_many<T>(std::numeric_limits<std::size_t>::max(), err, info);
+	}
+
+	/**
+	 * \brief Fetches at most count rows, decoding them by column.
+	 * \details The representation of each column is chosen from its type.
+	 * The batch can be exported with export_record_batch(). It always
+	 * has the resultset's columns, even when it holds no rows because
+	 * the resultset was complete or the operation failed.
+	 */
+	record_batch fetch_columns(std::size_t count)
+	{
+		error_code err;
+		error_info info;
+		record_batch res = fetch_columns(count, err, info);
+		check_error_code(err, info);
+		return res;
+	}
+
+	/// Fetches at most count rows, decoding them by column (sync with error codes version).
+	record_batch fetch_columns(std::size_t count, error_code& err, error_info& info)
+	{
+		err.clear();
+		info.clear();
+		record_batch res (meta_.fields());
+		fetch_into(count, res, err, info);
+		return err ? make_empty_result<record_batch>(meta_.fields()) : std::move(res);
+	}
 
-	const row* fetch_one()
+	/**
+	 * \brief Fetches a single row (async version).
+	 * \details The handler signature is void(error_code, const row_view*).
+	 * The row pointer is nullptr once the resultset is complete, and
+	 * remains valid until the next fetch operation.
+	 */
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, const row_view*))
+	async_fetch_one(CompletionToken&& token, error_info* info=nullptr)
 	{
 		assert(channel_);
-		if (complete_) return nullptr;
+		conditional_clear(info);
+		return boost::asio::async_compose<CompletionToken, void(error_code, const row_view*)>(
+			fetch_one_op<row_view>{*this, info}, token, channel_->next_layer());
+	}
+
+	/**
+	 * \brief Fetches a single row into a T object (async version).
+	 * \details The handler signature is void(error_code, std::optional<T>).
+	 * The optional is empty once the resultset is complete.
+	 */
+	template <typename T, typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, std::optional<T>))
+	async_fetch_one(CompletionToken&& token, error_info* info=nullptr)
+	{
+		assert(channel_);
+		conditional_clear(info);
+		return boost::asio::async_compose<CompletionToken, void(error_code, std::optional<T>)>(
+			fetch_one_op<T>{*this, info}, token, channel_->next_layer());
+	}
+
+	/// Fetches at most count rows (async version). The handler signature is void(error_code, rows).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, rows))
+	async_fetch_many(std::size_t count, CompletionToken&& token, error_info* info=nullptr)
+	{
+		assert(channel_);
+		conditional_clear(info);
+		return boost::asio::async_compose<CompletionToken, void(error_code, rows)>(
+			fetch_many_op<rows>{*this, count, info, rows()}, token, channel_->next_layer());
+	}
+
+	/// Fetches all remaining rows (async version). The handler signature is void(error_code, rows).
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, rows))
+	async_fetch_all(CompletionToken&& token, error_info* info=nullptr)
+	{
+		return async_fetch_many(std::numeric_limits<std::size_t>::max(), std::forward<CompletionToken>(token), info);
+	}
+
+	/// Fetches at most count rows into T objects (async version).
+	/// The handler signature is void(error_code, std::vector<T>).
+	template <typename T, typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, std::vector<T>))
+	async_fetch_many(std::size_t count, CompletionToken&& token, error_info* info=nullptr)
+	{
+		assert(channel_);
+		conditional_clear(info);
+		return boost::asio::async_compose<CompletionToken, void(error_code, std::vector<T>)>(
+			fetch_many_op<typed_rows<T>, std::vector<T>>{*this, count, info, make_typed_rows<T>()},
+			token, channel_->next_layer());
+	}
+
+	/// Fetches all remaining rows into T objects (async version).
+	/// The handler signature is void(error_code, std::vector<T>).
+	template <typename T, typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, std::vector<T>))
+	async_fetch_all(CompletionToken&& token, error_info* info=nullptr)
+	{
+		return async_fetch_many<T>(std::numeric_limits<std::size_t>::max(), std::forward<CompletionToken>(token), info);
+	}
+
+	/// Fetches at most count rows, decoding them by column (async version).
+	/// The handler signature is void(error_code, record_batch). As in
+	/// the sync version, the batch has the resultset's columns even on error.
+	template <typename CompletionToken>
+	BOOST_ASIO_INITFN_AUTO_RESULT_TYPE(CompletionToken, void(error_code, record_batch))
+	async_fetch_columns(std::size_t count, CompletionToken&& token, error_info* info=nullptr)
+	{
+		assert(channel_);
+		conditional_clear(info);
+		return boost::asio::async_compose<CompletionToken, void(error_code, record_batch)>(
+			fetch_many_op<record_batch>{*this, count, info, record_batch(meta_.fields())},
+			token, channel_->next_layer());
+	}
+
+	const std::vector<field_metadata>& fields() const noexcept { return meta_.fields(); }
+};
+
+template <typename StreamType>
+template <typename Row>
+struct resultset<StreamType>::fetch_one_op : boost::asio::coroutine
+{
+	// const row_view* for untyped rows, std::optional<T> for typed ones
+	using result_type = std::conditional_t<std::is_same_v<Row, row_view>, const row_view*, std::optional<Row>>;
+
+	resultset<StreamType>& resultset_;
+	error_info* info_;
 
-		// Read message
-		std::uint8_t msg_type = 0;
-		channel_->read(buffer_, msg_type);
+	fetch_one_op(resultset<StreamType>& obj, error_info* info) noexcept:
+		resultset_(obj), info_(info) {}
 
-		// Check for end of resultset
-		if (msg_type == std::uint8_t('C')) // Complete
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
 		{
-			channel_->read(buffer_, msg_type);
-			if (msg_type != std::uint8_t('Z')) // Ready for query
+			if (resultset_.complete_)
 			{
-				throw std::runtime_error("Expected ready for query");
+				BOOST_ASIO_CORO_YIELD boost::asio::post(resultset_.channel_->next_layer().get_executor(), std::move(self));
+				self.complete(error_code(), result_type());
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			BOOST_ASIO_CORO_YIELD resultset_.channel_->async_read_message(std::move(self));
+			if (err)
+			{
+				self.complete(err, result_type());
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			if (msg.type == command_complete_message::message_type)
+			{
+				err = resultset_.process_complete(msg);
+				if (!err && !resultset_.multi_)
+				{
+					BOOST_ASIO_CORO_YIELD resultset_.channel_->async_finish_response(info_, std::move(self));
+				}
+				self.complete(err, result_type());
+			}
+			else if (msg.type == error_response_message_type)
+			{
+				resultset_.complete_ = true;
+				BOOST_ASIO_CORO_YIELD resultset_.channel_->async_handle_error_response(msg, info_, std::move(self));
+				self.complete(err, result_type());
+			}
+			else
+			{
+				result_type res {};
+				err = make_error_code(resultset_.process_row(msg, res));
+				self.complete(err, std::move(res));
 			}
-			complete_ = true;
-			return nullptr;
 		}
+	}
+};
+
+template <typename StreamType>
+template <typename Output, typename Result>
+struct resultset<StreamType>::fetch_many_op : boost::asio::coroutine
+{
+	resultset<StreamType>& resultset_;
+	std::size_t count_;
+	error_info* info_;
+	Output output_; // rows, record_batch or typed_rows<T>
+
+	fetch_many_op(resultset<StreamType>& obj, std::size_t count, error_info* info, Output&& output) noexcept:
+		resultset_(obj), count_(count), info_(info), output_(std::move(output)) {}
 
-		// We got an actual row, deserialize it
-		current_row_ = row(deserialize_row(meta_.fields(), buffer_));
-		return &current_row_;
+	Result release_result()
+	{
+		if constexpr (std::is_same_v<Output, Result>) return std::move(output_);
+		else return output_.release();
 	}
 
-	const std::vector<field_metadata>& fields() const noexcept { return meta_.fields(); }
+	Result empty_result() const { return make_empty_result<Result>(resultset_.meta_.fields()); }
+
+	template <typename Self>
+	void complete(Self& self, error_code err)
+	{
+		if (!err)
+		{
+			err = make_error_code(output_.finish(resultset_.meta_.fields()));
+		}
+		self.complete(err, err ? empty_result() : release_result());
+	}
+
+	// Appends msg to the output, unless it ends the rows (CommandComplete or
+	// ErrorResponse) or can't be decoded. Returns whether it was appended
+	bool append_row(const message_view& msg, error_code& err)
+	{
+		if (msg.type == command_complete_message::message_type || msg.type == error_response_message_type)
+		{
+			return false;
+		}
+		err = make_error_code(append_data_row(output_, msg.body));
+		if (err) return false;
+		++resultset_.channel_->stats().rows_decoded;
+		return true;
+	}
+
+	template <typename Self>
+	void operator()(Self& self, error_code err = {}, message_view msg = {})
+	{
+		BOOST_ASIO_CORO_REENTER(*this)
+		{
+			if (resultset_.complete_ || count_ == 0)
+			{
+				BOOST_ASIO_CORO_YIELD boost::asio::post(resultset_.channel_->next_layer().get_executor(), std::move(self));
+				self.complete(error_code(), release_result());
+				BOOST_ASIO_CORO_YIELD break;
+			}
+
+			// Rows that have already been received are decoded
+			// without going through the executor
+			while (output_.size() < count_)
+			{
+				BOOST_ASIO_CORO_YIELD resultset_.channel_->async_read_message(std::move(self));
+				if (!err)
+				{
+					decode_timer timer (resultset_.channel_->stats());
+					while (append_row(msg, err) && output_.size() < count_ &&
+						resultset_.channel_->read_buffered_message(msg, err))
+					{
+					}
+				}
+				if (err)
+				{
+					self.complete(err, empty_result());
+					BOOST_ASIO_CORO_YIELD break;
+				}
+
+				if (msg.type == command_complete_message::message_type)
+				{
+					err = resultset_.process_complete(msg);
+					if (!err && !resultset_.multi_)
+					{
+						BOOST_ASIO_CORO_YIELD resultset_.channel_->async_finish_response(info_, std::move(self));
+					}
+					complete(self, err);
+					BOOST_ASIO_CORO_YIELD break;
+				}
+				else if (msg.type == error_response_message_type)
+				{
+					resultset_.complete_ = true;
+					BOOST_ASIO_CORO_YIELD resultset_.channel_->async_handle_error_response(msg, info_, std::move(self));
+					self.complete(err, empty_result());
+					BOOST_ASIO_CORO_YIELD break;
+				}
+			}
+
+			complete(self, error_code());
+		}
+	}
 };
 
 }
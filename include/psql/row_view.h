@@ -0,0 +1,111 @@
+#ifndef INCLUDE_PSQL_ROW_VIEW_H_
+#define INCLUDE_PSQL_ROW_VIEW_H_
+
+#include "psql/deserialize_row.h"
+#include <vector>
+#include <stdexcept>
+#include <cassert>
+
+namespace psql
+{
+
+/**
+ * \brief A row, as a view into a DataRow message.
+ * \details Only the position of each field within the message is recorded
+ * when the row is read. Fields are decoded into values when accessed, so
+ * unused columns cost nothing. The view is valid until the next row is fetched.
+ */
+class row_view
+{
+	struct field_location
+	{
+		std::int32_t offset; // from the start of the message body
+		std::int32_t length; // -1 for NULL
+	};
+
+	const std::vector<field_metadata>* meta_ {};
+	const std::uint8_t* data_ {};
+	std::vector<field_location> fields_; // capacity is reused between rows
+public:
+	row_view() = default;
+
+	// Private, do not use. Parses a DataRow message body,
+	// recording the location of each field
+	errc reset(const std::vector<field_metadata>& meta, boost::asio::const_buffer body) noexcept
+	{
+		meta_ = &meta;
+		data_ = static_cast<const std::uint8_t*>(body.data());
+		fields_.clear();
+
+		deserialization_context ctx (body);
+		std::int16_t field_count = 0;
+		auto err = deserialize(field_count, ctx);
+		if (err != errc::ok) return err;
+		if (std::size_t(field_count) != meta.size()) return errc::protocol_value_error;
+
+		fields_.resize(field_count);
+		for (auto& field: fields_)
+		{
+			err = deserialize(field.length, ctx);
+			if (err != errc::ok) return err;
+			field.offset = std::int32_t(ctx.first() - data_);
+			if (field.length == -1) continue; // NULL
+			if (field.length < 0 || !ctx.enough_size(field.length)) return errc::incomplete_message;
+			ctx.advance(field.length);
+		}
+		if (!ctx.empty()) return errc::extra_bytes;
+		return errc::ok;
+	}
+
+	/// The number of fields in the row.
+	std::size_t size() const noexcept { return fields_.size(); }
+
+	/// Whether the i-th field is NULL.
+	bool is_null(std::size_t i) const noexcept { assert(i < size()); return fields_[i].length == -1; }
+
+	/// The undecoded bytes of the i-th field, in the format given by its metadata.
+	std::string_view raw(std::size_t i) const noexcept
+	{
+		assert(i < size() && !is_null(i));
+		return get_string(data_ + fields_[i].offset, fields_[i].length);
+	}
+
+	/// Decodes the i-th field into output.
+	errc get(std::size_t i, value& output) const noexcept
+	{
+		assert(i < size());
+		if (is_null(i))
+		{
+			output = nullptr;
+			return errc::ok;
+		}
+		return deserialize_single(raw(i), (*meta_)[i], output);
+	}
+
+	/// Decodes the i-th field. Throws on error.
+	value at(std::size_t i) const
+	{
+		if (i >= size()) throw std::out_of_range("row_view::at");
+		value res;
+		check_error_code(get(i, res));
+		return res;
+	}
+
+	/// Decodes the i-th field. Throws on error.
+	value operator[](std::size_t i) const { return at(i); }
+
+	/// Decodes all fields. Prefer at() when only some fields are needed.
+	std::vector<value> values() const
+	{
+		std::vector<value> res (size());
+		for (std::size_t i = 0; i < size(); ++i)
+		{
+			check_error_code(get(i, res[i]));
+		}
+		return res;
+	}
+};
+
+}
+
+#endif /* INCLUDE_PSQL_ROW_VIEW_H_ */
@@ -0,0 +1,119 @@
+#ifndef INCLUDE_PSQL_ROWS_H_
+#define INCLUDE_PSQL_ROWS_H_
+
+#include "psql/deserialize_row.h"
+#include "psql/types.h"
+#include <vector>
+#include <cassert>
+#include <type_traits>
+
+namespace psql
+{
+
+/// A non-owning view over the values of a single row within a rows object.
+class values_view
+{
+	const value* first_ {};
+	std::size_t size_ {};
+public:
+	values_view() = default;
+	values_view(const value* first, std::size_t size) noexcept: first_(first), size_(size) {}
+
+	const value* begin() const noexcept { return first_; }
+	const value* end() const noexcept { return first_ + size_; }
+	std::size_t size() const noexcept { return size_; }
+	bool empty() const noexcept { return size_ == 0; }
+	const value& operator[](std::size_t i) const noexcept { assert(i < size_); return first_[i]; }
+};
+
+/**
+ * \brief A set of rows that owns its memory.
+ * \details The raw contents of all rows are stored in a single buffer, and all
+ * values in a single array, so the number of allocations grows logarithmically
+ * with the number of rows. Strings point into the internal buffer and remain
+ * valid while the object is alive, even if it is moved (e.g. to another thread).
+ * Not copyable, as copies would share the source's buffer.
+ */
+class rows
+{
+	bytestring buffer_;                 // DataRow message bodies, one after another
+	std::vector<std::size_t> offsets_;  // where each row starts in buffer_, while rows are being read
+	std::vector<value> values_;
+	std::size_t num_fields_ {};
+	std::size_t num_rows_ {};
+public:
+	rows() = default;
+
+	rows(const rows&) = delete;
+	rows& operator=(const rows&) = delete;
+	rows(rows&&) noexcept = default;
+	rows& operator=(rows&&) noexcept = default;
+
+	// Private, do not use. Stores a DataRow message body, to be decoded by finish()
+	void append(boost::asio::const_buffer body)
+	{
+		const auto* first = static_cast<const std::uint8_t*>(body.data());
+		offsets_.push_back(buffer_.size());
+		buffer_.insert(buffer_.end(), first, first + body.size());
+		++num_rows_;
+	}
+
+	// Private, do not use. Decodes all rows stored by append(). Values can't
+	// be created while rows are appended, as the buffer may be reallocated.
+	errc finish(const std::vector<field_metadata>& meta)
+	{
+		num_fields_ = meta.size();
+		values_.resize(num_rows_ * num_fields_);
+		for (std::size_t i = 0; i < num_rows_; ++i)
+		{
+			std::size_t row_end = i + 1 < num_rows_ ? offsets_[i + 1] : buffer_.size();
+			auto err = deserialize_row(
+				meta,
+				boost::asio::buffer(buffer_.data() + offsets_[i], row_end - offsets_[i]),
+				values_.data() + i * num_fields_
+			);
+			if (err != errc::ok) return err;
+		}
+		offsets_ = std::vector<std::size_t>();
+		return errc::ok;
+	}
+
+	/// The number of rows.
+	std::size_t size() const noexcept { return num_rows_; }
+
+	/// Whether there are no rows.
+	bool empty() const noexcept { return num_rows_ == 0; }
+
+	/// The number of fields in each row.
+	std::size_t num_fields() const noexcept { return num_fields_; }
+
+	/// The values of the i-th row.
+	values_view operator[](std::size_t i) const noexcept
+	{
+		assert(i < num_rows_);
+		return values_view(values_.data() + i * num_fields_, num_fields_);
+	}
+
+	/// All values, row after row.
+	const std::vector<value>& values() const noexcept { return values_; }
+};
+
+// Private, do not use. Appends a DataRow message body to a rows, record_batch
+// or typed_rows object. Only the latter two decode it, so only they can fail
+template <typename Output>
+errc append_data_row(Output& output, boost::asio::const_buffer body)
+{
+	if constexpr (std::is_void_v<decltype(output.append(body))>)
+	{
+		output.append(body);
+		return errc::ok;
+	}
+	else
+	{
+		return output.append(body);
+	}
+}
+
+}
+
+#endif /* INCLUDE_PSQL_ROWS_H_ */
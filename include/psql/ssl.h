@@ -0,0 +1,184 @@
+#ifndef INCLUDE_PSQL_SSL_H_
+#define INCLUDE_PSQL_SSL_H_
+
+#include <boost/asio/ssl/context.hpp>
+#include <boost/asio/ssl/stream.hpp>
+#include <openssl/ssl.h>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+
+namespace psql
+{
+
+/// Whether Stream is a boost::asio::ssl::stream, on which the handshake negotiates TLS.
+template <typename Stream>
+struct is_ssl_stream : std::false_type {};
+
+template <typename Stream>
+struct is_ssl_stream<boost::asio::ssl::stream<Stream>> : std::true_type {};
+
+/**
+ * \brief Client TLS sessions, so reconnects resume them instead of performing a full TLS handshake.
+ * \details A resumed handshake skips sending and verifying the server's
+ * certificate chain, and with TLS 1.2 the key exchange too. Sessions are
+ * stored as the server sends them (with TLS 1.3, as tickets received after
+ * the handshake) and offered to the next connection to the same server with
+ * the same ssl::context (see make_key()). Arbitrary sessions are evicted when
+ * the cache is full. Thread safe.
+ *
+ * Sessions are only stored for the ssl::context objects passed to enable().
+ * The cache must outlive the SSL streams it is used with.
+ */
+class ssl_session_cache
+{
+	struct session_deleter
+	{
+		void operator()(SSL_SESSION* session) const noexcept { SSL_SESSION_free(session); }
+	};
+	using session_ptr = std::unique_ptr<SSL_SESSION, session_deleter>;
+
+	// Attached to each SSL object by prepare(): where its new sessions are stored
+	struct ssl_data
+	{
+		ssl_session_cache* cache;
+		std::string key;
+	};
+
+	mutable std::mutex mtx_;
+	std::unordered_map<std::string, session_ptr> entries_;
+	std::size_t capacity_;
+	std::uint64_t hits_ {0};
+	std::uint64_t misses_ {0};
+
+	static int ssl_data_index()
+	{
+		static const int res = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr,
+			[](void*, void* ptr, CRYPTO_EX_DATA*, int, long, void*) { delete static_cast<ssl_data*>(ptr); });
+		return res;
+	}
+
+	// OpenSSL's new session callback. Cached sessions are copies, and copies are
+	// offered to connections: OpenSSL marks a connection's session as not
+	// resumable when it is freed without a TLS shutdown, as connections usually are
+	static int on_new_session(SSL* ssl, SSL_SESSION* session)
+	{
+		auto* data = static_cast<ssl_data*>(SSL_get_ex_data(ssl, ssl_data_index()));
+		SSL_SESSION* copy = data ? SSL_SESSION_dup(session) : nullptr;
+		if (copy) data->cache->insert(data->key, copy);
+		return 0; // OpenSSL keeps ownership of session
+	}
+public:
+	static constexpr std::size_t default_capacity = 256;
+
+	explicit ssl_session_cache(std::size_t capacity = default_capacity) noexcept: capacity_(capacity) {}
+
+	/// The cache used by connections.
+	static ssl_session_cache& global() noexcept
+	{
+		static ssl_session_cache res;
+		return res;
+	}
+
+	/**
+	 * \brief Makes the connections using ctx store their sessions in the cache they were prepared with.
+	 * \details Call once, while setting up the context, before creating streams with it.
+	 */
+	static void enable(boost::asio::ssl::context& ctx) noexcept
+	{
+		SSL_CTX_set_session_cache_mode(ctx.native_handle(), SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx.native_handle(), &on_new_session);
+	}
+
+	/**
+	 * \brief The key identifying the server a stream is connected to. Call after setting the SNI host name, if any.
+	 * \details Made of the ssl::context, the SNI host name and the remote
+	 * endpoint. Including the context ensures sessions established with
+	 * different verification settings are never mixed.
+	 */
+	template <typename Stream>
+	static std::string make_key(boost::asio::ssl::stream<Stream>& stream)
+	{
+		SSL_CTX* ctx = SSL_get_SSL_CTX(stream.native_handle());
+		std::string res (reinterpret_cast<const char*>(&ctx), sizeof(ctx));
+		const char* host = SSL_get_servername(stream.native_handle(), TLSEXT_NAMETYPE_host_name);
+		if (host) res += host;
+		res.push_back('\0');
+		boost::system::error_code err;
+		auto endpoint = stream.lowest_layer().remote_endpoint(err);
+		if (!err) res.append(reinterpret_cast<const char*>(endpoint.data()), endpoint.size());
+		return res;
+	}
+
+	/**
+	 * \brief Prepares an SSL object for its handshake.
+	 * \details Offers the session cached for key, if any, and arranges for the
+	 * sessions the server sends to be stored under key. Updates hit and miss counts.
+	 */
+	void prepare(SSL* ssl, std::string key)
+	{
+		{
+			std::lock_guard<std::mutex> guard (mtx_);
+			auto it = entries_.find(key);
+			session_ptr copy (it != entries_.end() ? SSL_SESSION_dup(it->second.get()) : nullptr);
+			if (copy && SSL_SESSION_is_resumable(copy.get()))
+			{
+				++hits_;
+				SSL_set_session(ssl, copy.get()); // takes its own reference
+			}
+			else
+			{
+				++misses_;
+			}
+		}
+		delete static_cast<ssl_data*>(SSL_get_ex_data(ssl, ssl_data_index()));
+		SSL_set_ex_data(ssl, ssl_data_index(), new ssl_data{this, std::move(key)});
+	}
+
+	/// Stores a session, replacing the one for the same key. Takes ownership of session.
+	void insert(const std::string& key, SSL_SESSION* session)
+	{
+		session_ptr ptr (session);
+		std::lock_guard<std::mutex> guard (mtx_);
+		if (capacity_ == 0) return;
+		auto it = entries_.find(key);
+		if (it != entries_.end())
+		{
+			it->second = std::move(ptr);
+			return;
+		}
+		if (entries_.size() >= capacity_) entries_.erase(entries_.begin());
+		entries_.emplace(key, std::move(ptr));
+	}
+
+	/// Changes the maximum number of sessions, evicting them if needed. Zero disables caching.
+	void set_capacity(std::size_t value)
+	{
+		std::lock_guard<std::mutex> guard (mtx_);
+		capacity_ = value;
+		while (entries_.size() > capacity_) entries_.erase(entries_.begin());
+	}
+
+	/// Removes all sessions, e.g. after changing the trusted certificates.
+	void clear() noexcept
+	{
+		std::lock_guard<std::mutex> guard (mtx_);
+		entries_.clear();
+	}
+
+	std::size_t capacity() const noexcept { std::lock_guard<std::mutex> guard (mtx_); return capacity_; }
+	std::size_t size() const noexcept { std::lock_guard<std::mutex> guard (mtx_); return entries_.size(); }
+
+	/// The number of TLS handshakes that offered a cached session. The server may still refuse it.
+	std::uint64_t hits() const noexcept { std::lock_guard<std::mutex> guard (mtx_); return hits_; }
+
+	/// The number of TLS handshakes that had no session to offer.
+	std::uint64_t misses() const noexcept { std::lock_guard<std::mutex> guard (mtx_); return misses_; }
+};
+
+}
+
+#endif /* INCLUDE_PSQL_SSL_H_ */
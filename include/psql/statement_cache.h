@@ -0,0 +1,159 @@
+#ifndef INCLUDE_PSQL_STATEMENT_CACHE_H_
+#define INCLUDE_PSQL_STATEMENT_CACHE_H_
+
+#include "psql/metadata.h"
+#include <cstring>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace psql
+{
+
+/// A statement prepared on the server. Shared by all copies of a prepared_statement.
+struct statement_info
+{
+	std::string name;
+	std::string sql; // reported to tracing hooks
+	statement_description descr;
+	bool cached {false}; // owned by a statement_cache, which closes it when evicted
+};
+
+/**
+ * \brief Prepared statements of a connection, keyed by SQL text and declared parameter types.
+ * \details Least recently used statements are evicted when the cache is full,
+ * except the ones still referenced by some prepared_statement object.
+ * The connection closes evicted statements lazily, sending the Close message
+ * together with its next request.
+ */
+class statement_cache
+{
+	struct entry
+	{
+		std::shared_ptr<statement_info> info;
+		std::list<const std::string*>::iterator lru_pos;
+	};
+
+	std::unordered_map<std::string, entry> entries_;
+	std::list<const std::string*> lru_; // keys in entries_, most recently used first
+	std::string key_buffer_; // reused, so lookups don't allocate
+	std::size_t capacity_;
+	std::uint64_t hits_ {0};
+	std::uint64_t misses_ {0};
+	std::uint64_t evictions_ {0};
+public:
+	static constexpr std::size_t default_capacity = 256;
+
+	explicit statement_cache(std::size_t capacity = default_capacity) noexcept: capacity_(capacity) {}
+
+	/// The key for a statement. Parameter types are part of it, as they change the statement.
+	const std::string& make_key(std::string_view statement, const std::vector<std::int32_t>& param_types)
+	{
+		key_buffer_.assign(statement);
+		key_buffer_.push_back('\0');
+		std::size_t types_offset = key_buffer_.size();
+		key_buffer_.resize(types_offset + param_types.size() * sizeof(std::int32_t));
+		if (!param_types.empty())
+		{
+			std::memcpy(&key_buffer_[types_offset], param_types.data(), param_types.size() * sizeof(std::int32_t));
+		}
+		return key_buffer_;
+	}
+
+	/// Looks up a statement, marking it as the most recently used. Updates hit and miss counts.
+	std::shared_ptr<const statement_info> find(const std::string& key)
+	{
+		auto it = entries_.find(key);
+		if (it == entries_.end())
+		{
+			++misses_;
+			return nullptr;
+		}
+		++hits_;
+		lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+		return it->second.info;
+	}
+
+	/**
+	 * \brief Adds a statement, evicting others if needed.
+	 * \details on_evict is called with the statement_info of each evicted statement.
+	 * Does nothing if the capacity is zero, or if the key is already present.
+	 */
+	template <typename OnEvict>
+	void insert(std::string key, std::shared_ptr<statement_info> info, OnEvict&& on_evict)
+	{
+		if (capacity_ == 0) return;
+		info->cached = true;
+		auto [it, inserted] = entries_.try_emplace(std::move(key), entry{std::move(info), {}});
+		if (!inserted) return;
+		lru_.push_front(&it->first);
+		it->second.lru_pos = lru_.begin();
+		evict(on_evict);
+	}
+
+	/// Evicts least recently used statements until the cache is not over capacity.
+	template <typename OnEvict>
+	void evict(OnEvict&& on_evict)
+	{
+		auto pos = lru_.end();
+		while (entries_.size() > capacity_ && pos != lru_.begin())
+		{
+			--pos;
+			auto it = entries_.find(**pos);
+			if (it->second.info.use_count() > 1) continue; // still referenced
+			on_evict(*it->second.info);
+			pos = lru_.erase(pos);
+			entries_.erase(it);
+			++evictions_;
+		}
+	}
+
+	/**
+	 * \brief Changes the maximum number of statements, evicting them if needed.
+	 * \details Statements that can't be evicted because they are still referenced
+	 * are removed from the cache, and stop being cached. They are then closed by
+	 * prepared_statement::close(), like statements prepared with caching disabled.
+	 */
+	template <typename OnEvict>
+	void set_capacity(std::size_t value, OnEvict&& on_evict)
+	{
+		capacity_ = value;
+		evict(on_evict);
+		while (entries_.size() > capacity_)
+		{
+			auto it = entries_.find(*lru_.back());
+			it->second.info->cached = false;
+			lru_.pop_back();
+			entries_.erase(it);
+		}
+	}
+
+	/// Removes all statements, without closing them (e.g. when the connection is lost).
+	void clear() noexcept
+	{
+		entries_.clear();
+		lru_.clear();
+	}
+
+	/// The maximum number of statements. Zero disables caching.
+	std::size_t capacity() const noexcept { return capacity_; }
+
+	/// The number of statements in the cache.
+	std::size_t size() const noexcept { return entries_.size(); }
+
+	/// The number of prepares served from the cache.
+	std::uint64_t hits() const noexcept { return hits_; }
+
+	/// The number of prepares that required a round trip to the server.
+	std::uint64_t misses() const noexcept { return misses_; }
+
+	/// The number of statements evicted (and closed).
+	std::uint64_t evictions() const noexcept { return evictions_; }
+};
+
+}
+
+#endif /* INCLUDE_PSQL_STATEMENT_CACHE_H_ */
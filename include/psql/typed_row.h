@@ -0,0 +1,478 @@
+#ifndef INCLUDE_PSQL_TYPED_ROW_H_
+#define INCLUDE_PSQL_TYPED_ROW_H_
+
+#include "psql/metadata.h"
+#include "psql/codecs.h"
+#include "psql/serialization.h"
+#include <optional>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+// Decoding rows straight into user structs. A struct is described by
+// specializing get_struct_fields, as done for protocol messages:
+//
+//   struct employee { std::int32_t id; std::string name; std::optional<double> salary; };
+//   template <> struct psql::get_struct_fields<employee> {
+//       static constexpr auto value = std::make_tuple(&employee::id, &employee::name, &employee::salary);
+//   };
+//
+// Members are bound to columns by position. Use std::optional for columns that may be NULL.
+
+namespace psql
+{
+
+// Decodes a single non-NULL field into a member
+template <typename T>
+using field_decoder = errc(*)(std::string_view, T&) noexcept;
+
+template <typename T>
+errc decode_string_field(std::string_view from, T& output) noexcept
+{
+	output = T(from);
+	return errc::ok;
+}
+
+template <bool has_offset>
+errc decode_text_datetime_field(std::string_view from, datetime& output) noexcept
+{
+	return read_text_datetime(from, has_offset, output);
+}
+
+// Stores a value returned by a codec_registry decoder into a member.
+// Integers are converted if they fit, and strings may be copied
+template <typename T>
+errc value_to_field(const value& from, T& output) noexcept
+{
+	return std::visit([&output](auto v) {
+		using V = decltype(v);
+		if constexpr (std::is_same_v<V, T>)
+		{
+			output = v;
+			return errc::ok;
+		}
+		else if constexpr (std::is_same_v<V, std::string_view> && std::is_constructible_v<T, std::string_view>)
+		{
+			output = T(v);
+			return errc::ok;
+		}
+		else if constexpr (std::is_integral_v<V> && std::is_integral_v<T> && !std::is_same_v<T, bool>)
+		{
+			if (!is_in_range(v, std::numeric_limits<T>::min(), std::numeric_limits<T>::max())) return errc::type_mismatch;
+			output = T(v);
+			return errc::ok;
+		}
+		else
+		{
+			return errc::type_mismatch;
+		}
+	}, from);
+}
+
+// Whether the binary representation of a type is its raw bytes
+inline bool is_string_type(std::int32_t type_oid) noexcept
+{
+	switch (type_oid)
+	{
+	case bytea_oid:
+	case char_oid:
+	case name_oid:
+	case text_oid:
+	case json_oid:
+	case bpchar_oid:
+	case varchar_oid:
+		return true;
+	default:
+		return false;
+	}
+}
+
+template <typename T>
+field_decoder<T> select_decoder(std::int16_t format, field_decoder<T> text, field_decoder<T> binary) noexcept
+{
+	return format == text_format ? text : binary;
+}
+
+/**
+ * \brief Describes how a member type is decoded.
+ * \details get_decoder() returns the function that decodes a field with
+ * the given type OID and format, or nullptr if the member can't hold it.
+ * Integer members accept any integer column that fits in them.
+ */
+template <typename T>
+struct field_traits;
+
+template <>
+struct field_traits<bool>
+{
+	static field_decoder<bool> get_decoder(std::int32_t type_oid, std::int16_t format) noexcept
+	{
+		if (type_oid != bool_oid) return nullptr;
+		return select_decoder<bool>(format, &read_text_bool, &read_binary_number<std::uint8_t, bool>);
+	}
+};
+
+template <>
+struct field_traits<std::int16_t>
+{
+	static field_decoder<std::int16_t> get_decoder(std::int32_t type_oid, std::int16_t format) noexcept
+	{
+		if (type_oid != int2_oid) return nullptr;
+		return select_decoder<std::int16_t>(format, &parse_text_number<std::int16_t>,
+			&read_binary_number<std::int16_t>);
+	}
+};
+
+template <>
+struct field_traits<std::int32_t>
+{
+	static field_decoder<std::int32_t> get_decoder(std::int32_t type_oid, std::int16_t format) noexcept
+	{
+		field_decoder<std::int32_t> text = &parse_text_number<std::int32_t>;
+		switch (type_oid)
+		{
+		case int2_oid: return select_decoder(format, text, &read_binary_number<std::int16_t, std::int32_t>);
+		case int4_oid: return select_decoder(format, text, &read_binary_number<std::int32_t>);
+		default: return nullptr;
+		}
+	}
+};
+
+template <>
+struct field_traits<std::int64_t>
+{
+	static field_decoder<std::int64_t> get_decoder(std::int32_t type_oid, std::int16_t format) noexcept
+	{
+		field_decoder<std::int64_t> text = &parse_text_number<std::int64_t>;
+		switch (type_oid)
+		{
+		case int2_oid: return select_decoder(format, text, &read_binary_number<std::int16_t, std::int64_t>);
+		case int4_oid: return select_decoder(format, text, &read_binary_number<std::int32_t, std::int64_t>);
+		case int8_oid: return select_decoder(format, text, &read_binary_number<std::int64_t>);
+		default: return nullptr;
+		}
+	}
+};
+
+template <>
+struct field_traits<std::uint32_t>
+{
+	static field_decoder<std::uint32_t> get_decoder(std::int32_t type_oid, std::int16_t format) noexcept
+	{
+		if (type_oid != oid_oid) return nullptr;
+		return select_decoder<std::uint32_t>(format, &parse_text_number<std::uint32_t>,
+			&read_binary_number<std::uint32_t>);
+	}
+};
+
+template <>
+struct field_traits<float>
+{
+	static field_decoder<float> get_decoder(std::int32_t type_oid, std::int16_t format) noexcept
+	{
+		if (type_oid != float4_oid) return nullptr;
+		return select_decoder<float>(format, &parse_text_number<float>, &read_binary_number<float>);
+	}
+};
+
+template <>
+struct field_traits<double>
+{
+	static field_decoder<double> get_decoder(std::int32_t type_oid, std::int16_t format) noexcept
+	{
+		field_decoder<double> text = &parse_text_number<double>;
+		switch (type_oid)
+		{
+		case float4_oid: return select_decoder(format, text, &read_binary_number<float, double>);
+		case float8_oid: return select_decoder(format, text, &read_binary_number<double>);
+		default: return nullptr;
+		}
+	}
+};
+
+// Whether a type is decoded into something other than a string (a number,
+// boolean, date or time)
+inline bool is_non_string_builtin(std::int32_t type_oid) noexcept
+{
+	switch (type_oid)
+	{
+	case bool_oid:
+	case int2_oid:
+	case int4_oid:
+	case int8_oid:
+	case oid_oid:
+	case float4_oid:
+	case float8_oid:
+	case date_oid:
+	case time_oid:
+	case timestamp_oid:
+	case timestamptz_oid:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Strings accept string types in any format, and the text representation
+// of types without built-in support. Built-in non-string types are rejected
+// in both formats, so a binding doesn't depend on whether a statement
+// was run with query() (text) or execute() (binary)
+template <typename T>
+struct string_field_traits
+{
+	static field_decoder<T> get_decoder(std::int32_t type_oid, std::int16_t format) noexcept
+	{
+		if (is_non_string_builtin(type_oid)) return nullptr;
+		if (format == binary_format && !is_string_type(type_oid)) return nullptr;
+		return &decode_string_field<T>;
+	}
+};
+
+template <> struct field_traits<std::string_view> : string_field_traits<std::string_view> {};
+template <> struct field_traits<std::string> : string_field_traits<std::string> {};
+
+template <>
+struct field_traits<date>
+{
+	static field_decoder<date> get_decoder(std::int32_t type_oid, std::int16_t format) noexcept
+	{
+		if (type_oid != date_oid) return nullptr;
+		return select_decoder<date>(format, &read_text_date, &read_binary_date);
+	}
+};
+
+template <>
+struct field_traits<datetime>
+{
+	static field_decoder<datetime> get_decoder(std::int32_t type_oid, std::int16_t format) noexcept
+	{
+		switch (type_oid)
+		{
+		case timestamp_oid: return select_decoder(format, &decode_text_datetime_field<false>, &read_binary_datetime);
+		case timestamptz_oid: return select_decoder(format, &decode_text_datetime_field<true>, &read_binary_datetime);
+		default: return nullptr;
+		}
+	}
+};
+
+template <>
+struct field_traits<time>
+{
+	static field_decoder<time> get_decoder(std::int32_t type_oid, std::int16_t format) noexcept
+	{
+		if (type_oid != time_oid) return nullptr;
+		return select_decoder<time>(format, &read_text_time, &read_binary_time);
+	}
+};
+
+/**
+ * \brief The decoder selected for a member.
+ * \details Columns the member's field_traits don't accept may still be decoded
+ * by a custom decoder from the codec_registry, which is resolved in the field's
+ * metadata. Its result is converted to the member by value_to_field().
+ */
+template <typename T>
+struct field_binding
+{
+	field_decoder<T> decoder {};
+	value_decoder custom_decoder {};
+
+	bool bind(const field_metadata& meta)
+	{
+		decoder = field_traits<T>::get_decoder(meta.type_oid(), meta.format());
+		if (!decoder && is_custom_decoder(meta.type_oid(), meta.format(), meta.decoder()))
+		{
+			custom_decoder = meta.decoder();
+		}
+		return decoder || custom_decoder;
+	}
+
+	errc decode(std::string_view from, T& output) const noexcept
+	{
+		if (decoder) return decoder(from, output);
+		value v;
+		auto err = custom_decoder(from, v);
+		if (err != errc::ok) return err;
+		return value_to_field(v, output);
+	}
+};
+
+// std::optional<T> members accept NULLs, and are decoded as T otherwise
+template <typename T>
+struct non_optional { using type = T; static constexpr bool is_optional = false; };
+
+template <typename T>
+struct non_optional<std::optional<T>> { using type = T; static constexpr bool is_optional = true; };
+
+template <typename T>
+using non_optional_t = typename non_optional<T>::type;
+
+template <typename T>
+struct member_pointer_traits;
+
+template <typename Class, typename Member>
+struct member_pointer_traits<Member Class::*> { using type = Member; };
+
+/**
+ * \brief Binds the fields of a resultset to the members of T.
+ * \details The decoder for each column is selected when the binding is
+ * created, so decoding a row performs no type checks nor allocations
+ * (other than those made by std::string members).
+ */
+template <typename T>
+class row_binding
+{
+	static constexpr auto fields_ = get_struct_fields<T>::value;
+	static_assert(is_struct_with_fields<T>(), "T must specialize get_struct_fields");
+
+	static constexpr std::size_t num_fields = std::tuple_size_v<std::decay_t<decltype(fields_)>>;
+	using index_seq = std::make_index_sequence<num_fields>;
+
+	template <std::size_t I>
+	using member_type = typename member_pointer_traits<std::decay_t<decltype(std::get<I>(fields_))>>::type;
+
+	template <typename Seq> struct decoder_tuple;
+	template <std::size_t... I>
+	struct decoder_tuple<std::index_sequence<I...>>
+	{
+		using type = std::tuple<field_binding<non_optional_t<member_type<I>>>...>;
+		static constexpr bool has_views = (std::is_same_v<non_optional_t<member_type<I>>, std::string_view> || ...);
+	};
+
+	typename decoder_tuple<index_seq>::type decoders_ {};
+	errc error_ {errc::ok};
+
+	template <std::size_t... I>
+	bool bind(const std::vector<field_metadata>& meta, std::index_sequence<I...>)
+	{
+		return (std::get<I>(decoders_).bind(meta[I]) && ...);
+	}
+
+	template <std::size_t I>
+	errc decode_field(deserialization_context& ctx, T& output) const noexcept
+	{
+		constexpr auto pmem = std::get<I>(fields_);
+		auto& member = output.*pmem;
+
+		std::int32_t size = 0;
+		auto err = deserialize(size, ctx);
+		if (err != errc::ok) return err;
+		if (size == -1)
+		{
+			if constexpr (non_optional<member_type<I>>::is_optional)
+			{
+				member.reset();
+				return errc::ok;
+			}
+			else
+			{
+				return errc::unexpected_null;
+			}
+		}
+		if (size < 0 || !ctx.enough_size(size)) return errc::incomplete_message;
+		std::string_view from = get_string(ctx.first(), size);
+		ctx.advance(size);
+		if constexpr (non_optional<member_type<I>>::is_optional)
+			return std::get<I>(decoders_).decode(from, member.emplace());
+		else
+			return std::get<I>(decoders_).decode(from, member);
+	}
+
+	template <std::size_t... I>
+	errc decode_fields(deserialization_context& ctx, T& output, std::index_sequence<I...>) const noexcept
+	{
+		errc err = errc::ok;
+		(void)(((err = decode_field<I>(ctx, output)) == errc::ok) && ...);
+		return err;
+	}
+public:
+	/// Whether T has members that point into the message they were decoded from.
+	static constexpr bool has_views = decoder_tuple<index_seq>::has_views;
+
+	/// Selects a decoder for each column. Any mismatch is reported by error().
+	explicit row_binding(const std::vector<field_metadata>& meta)
+	{
+		if (meta.size() != num_fields || !bind(meta, index_seq()))
+		{
+			error_ = errc::type_mismatch;
+		}
+	}
+
+	/// errc::type_mismatch if the resultset fields can't be stored in T.
+	errc error() const noexcept { return error_; }
+
+	/// Decodes a DataRow message body into output. The binding must be valid.
+	errc decode(boost::asio::const_buffer body, T& output) const noexcept
+	{
+		assert(error_ == errc::ok);
+		deserialization_context ctx (body);
+		std::int16_t field_count = 0;
+		auto err = deserialize(field_count, ctx);
+		if (err != errc::ok) return err;
+		if (std::size_t(field_count) != num_fields) return errc::protocol_value_error;
+		err = decode_fields(ctx, output, index_seq());
+		if (err != errc::ok) return err;
+		if (!ctx.empty()) return errc::extra_bytes;
+		return errc::ok;
+	}
+};
+
+// Private, do not use. Collects the rows fetched by fetch_many<T>()
+template <typename T>
+class typed_rows
+{
+	static_assert(!row_binding<T>::has_views,
+		"string_view members are only valid until the next row is read. Use std::string instead");
+
+	std::shared_ptr<const row_binding<T>> binding_;
+	std::vector<T> rows_;
+public:
+	typed_rows() = default;
+	explicit typed_rows(std::shared_ptr<const row_binding<T>> binding) noexcept: binding_(std::move(binding)) {}
+
+	errc append(boost::asio::const_buffer body)
+	{
+		if (binding_->error() != errc::ok) return binding_->error();
+		rows_.emplace_back();
+		return binding_->decode(body, rows_.back());
+	}
+
+	errc finish(const std::vector<field_metadata>&) const noexcept { return binding_->error(); }
+
+	std::size_t size() const noexcept { return rows_.size(); }
+
+	std::vector<T> release() noexcept { return std::move(rows_); }
+};
+
+// Private, do not use. Keeps the binding for the last type used with the
+// typed fetch functions, so columns are only matched to members once per resultset
+class row_binding_cache
+{
+	std::shared_ptr<const void> binding_;
+	const std::type_info* binding_type_ {};
+public:
+	template <typename T>
+	const row_binding<T>& get(const std::vector<field_metadata>& fields)
+	{
+		if (!binding_type_ || *binding_type_ != typeid(T))
+		{
+			binding_ = std::make_shared<const row_binding<T>>(fields);
+			binding_type_ = &typeid(T);
+		}
+		return *static_cast<const row_binding<T>*>(binding_.get());
+	}
+
+	template <typename T>
+	typed_rows<T> make_typed_rows(const std::vector<field_metadata>& fields)
+	{
+		get<T>(fields);
+		return typed_rows<T>(std::static_pointer_cast<const row_binding<T>>(binding_));
+	}
+};
+
+}
+
+#endif /* INCLUDE_PSQL_TYPED_ROW_H_ */
@@ -16,12 +16,12 @@ void print(const value& v)
 	}, v);
 }
 
-void print(const std::vector<value>& values)
+void print(const row_view& r)
 {
 	std::cout << "{ ";
-	for (const auto& v: values)
+	for (std::size_t i = 0; i < r.size(); ++i)
 	{
-		print(v);
+		print(r.at(i));
 		std::cout << ", ";
 	}
 	std::cout << " }\n";
@@ -44,17 +44,17 @@ int main()
 
 	// Query (resultset without fields)
 	auto result = conn.query("UPDATE mytable SET f1 = 100 WHERE f2 = 'adios'");
-	while (const row* r = result.fetch_one())
+	while (const row_view* r = result.fetch_one())
 	{
-		print(r->values());
+		print(*r);
 	}
 	std::cout << "UPDATE complete\n\n";
 
 	// Query (resultset with fields)
 	result = conn.query("SELECT * FROM \"mytable\";");
-	while (const row* r = result.fetch_one())
+	while (const row_view* r = result.fetch_one())
 	{
-		print(r->values());
+		print(*r);
 	}
 	std::cout << "SELECT complete\n\n";
 
@@ -62,9 +62,9 @@ int main()
 	std::array<value, 2> update_values { value(150), value("adios") };
 	auto stmt = conn.prepare_statement("UPDATE mytable SET f1 = $1 WHERE f2 = $2");
 	result = stmt.execute(std::begin(update_values), std::end(update_values));
-	while (const row* r = result.fetch_one())
+	while (const row_view* r = result.fetch_one())
 	{
-		print(r->values());
+		print(*r);
 	}
 	stmt.close();
 	std::cout << "Prepared UPDATE complete\n\n";
@@ -73,9 +73,9 @@ int main()
 	std::array<value, 2> select_values { value("hola"), value("quetal") };
 	stmt = conn.prepare_statement("SELECT * FROM mytable WHERE f2 IN ($1, $2)");
 	result = stmt.execute(std::begin(select_values), std::end(select_values));
-	while (const row* r = result.fetch_one())
+	while (const row_view* r = result.fetch_one())
 	{
-		print(r->values());
+		print(*r);
 	}
 	stmt.close();
 	std::cout << "Prepared SELECT complete\n\n";
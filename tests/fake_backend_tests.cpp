@@ -0,0 +1,337 @@
+// Behavior tests against the in-process fake server in bench/fake_backend.h:
+// how the client handles errors in the middle of a response, multi-statement
+// queries, cursors and the statement cache, over a real socket.
+// The SCRAM client is checked against the example exchange in RFC 7677.
+
+#define BOOST_TEST_MODULE psql_fake_backend_tests
+#include <boost/test/included/unit_test.hpp>
+
+#include "fake_backend.h"
+#include "psql/connection.h"
+#include <string>
+#include <vector>
+
+using namespace psql;
+using boost::asio::ip::tcp;
+
+namespace
+{
+
+// Statements containing "fail" fail with a division by zero.
+// Others are generated by fake_pg::make_generated_result
+fake_pg::fake_result script(std::string_view sql)
+{
+	if (sql.find("fail") != std::string_view::npos)
+	{
+		fake_pg::fake_result res;
+		res.error_sqlstate = "22012";
+		res.error_message = "division by zero";
+		return res;
+	}
+	return fake_pg::make_generated_result(sql);
+}
+
+fake_pg::fake_backend_config make_config()
+{
+	fake_pg::fake_backend_config res;
+	res.script = script;
+	return res;
+}
+
+// A server and a connection to it, ready for queries
+struct fixture
+{
+	fake_pg::fake_backend server {tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0), make_config()};
+	boost::asio::io_context ctx;
+	connection<tcp::socket> conn {ctx};
+	error_code err;
+	error_info info;
+
+	fixture()
+	{
+		conn.next_layer().connect(server.endpoint());
+		conn.handshake(connection_params{"user", "password", "db"});
+	}
+
+	// The connection can still be used, and is back to its initial state
+	void check_usable()
+	{
+		BOOST_TEST(conn.idle());
+		BOOST_TEST(conn.query("SELECT -- rows=2").fetch_all().size() == 2u);
+	}
+};
+
+const std::vector<value> no_params;
+
+}
+
+BOOST_FIXTURE_TEST_SUITE(test_pipeline, fixture)
+
+BOOST_AUTO_TEST_CASE(error_mid_pipeline)
+{
+	auto stmt = conn.prepare_statement("SELECT -- rows=3");
+	auto p = conn.make_pipeline();
+	p.add_query("SELECT -- rows=1");
+	p.add_query("SELECT fail");
+	p.add_execute(stmt, no_params.begin(), no_params.end());
+	p.add_query("SELECT fail -- again");
+	p.add_query("SELECT -- rows=4");
+	p.send();
+
+	BOOST_TEST(p.next_result().fetch_all().size() == 1u);
+	p.next_result(err, info);
+	BOOST_TEST(err == make_error_code(errc::server_error));
+	BOOST_TEST(info.sqlstate() == "22012");
+	BOOST_TEST(p.next_result().fetch_all().size() == 3u); // unaffected by the previous error
+	BOOST_CHECK_THROW(p.next_result(), boost::system::system_error);
+	BOOST_TEST(p.next_result().fetch_all().size() == 4u);
+	BOOST_TEST(!p.has_next_result());
+	check_usable();
+}
+
+BOOST_AUTO_TEST_CASE(unread_results_are_discarded)
+{
+	auto p = conn.make_pipeline();
+	p.add_query("SELECT -- rows=100");
+	p.add_query("SELECT fail");
+	p.add_query("SELECT -- rows=5");
+	p.send();
+	p.next_result(); // rows not read
+	p.next_result(err, info);
+	BOOST_TEST(err == make_error_code(errc::server_error));
+	BOOST_TEST(p.next_result().fetch_all().size() == 5u);
+	check_usable();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_FIXTURE_TEST_SUITE(test_multi_resultset, fixture)
+
+BOOST_AUTO_TEST_CASE(error_after_some_results)
+{
+	auto m = conn.multi_query("UPDATE t -- cols=0 rows=7; SELECT -- rows=2; SELECT fail; SELECT -- rows=9");
+	auto* r = m.next_resultset();
+	BOOST_TEST_REQUIRE(r != nullptr);
+	BOOST_TEST(r->affected_rows() == 7u);
+	r = m.next_resultset();
+	BOOST_TEST_REQUIRE(r != nullptr);
+	BOOST_TEST(r->fetch_all().size() == 2u);
+
+	// The server stops at the failing statement
+	r = m.next_resultset(err, info);
+	BOOST_TEST(err == make_error_code(errc::server_error));
+	BOOST_TEST(info.sqlstate() == "22012");
+	BOOST_TEST(m.complete());
+	check_usable();
+}
+
+BOOST_AUTO_TEST_CASE(error_with_rows_left_unread)
+{
+	auto m = conn.multi_query("SELECT -- rows=50; SELECT fail");
+	auto* r = m.next_resultset();
+	BOOST_TEST_REQUIRE(r != nullptr);
+	BOOST_TEST(r->fetch_one() != nullptr);
+	BOOST_CHECK_THROW(m.next_resultset(), boost::system::system_error);
+	BOOST_TEST(m.complete());
+	check_usable();
+}
+
+BOOST_AUTO_TEST_CASE(first_statement_fails)
+{
+	conn.query("SELECT fail; SELECT -- rows=3", err, info);
+	BOOST_TEST(err == make_error_code(errc::server_error));
+	check_usable();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_FIXTURE_TEST_SUITE(test_cursor, fixture)
+
+BOOST_AUTO_TEST_CASE(suspend_and_resume)
+{
+	for (bool prefetch: {false, true})
+	{
+		BOOST_TEST_CONTEXT("prefetch=" << prefetch)
+		{
+			auto stmt = conn.prepare_statement("SELECT -- rows=10 cols=2");
+			auto cur = stmt.open_cursor(no_params.begin(), no_params.end(), 4, prefetch);
+			BOOST_TEST(!conn.idle()); // the portal is open
+			std::vector<std::size_t> chunks;
+			while (!cur.complete())
+			{
+				auto rs = cur.fetch_next();
+				chunks.push_back(rs.size());
+				for (std::size_t i = 0; i < rs.size(); ++i)
+				{
+					BOOST_TEST(std::get<std::int32_t>(rs[i][0]) == 256);
+					BOOST_TEST(std::get<std::int64_t>(rs[i][1]) == 65536);
+				}
+			}
+			BOOST_TEST(chunks == (std::vector<std::size_t>{4, 4, 2}), boost::test_tools::per_element());
+			check_usable();
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(close_before_the_end)
+{
+	auto stmt = conn.prepare_statement("SELECT -- rows=10");
+	auto cur = stmt.open_cursor(no_params.begin(), no_params.end(), 3, true);
+	BOOST_TEST(cur.fetch_next().size() == 3u);
+	cur.close();
+	check_usable();
+
+	// The statement can open another cursor
+	cur = stmt.open_cursor(no_params.begin(), no_params.end(), 8);
+	BOOST_TEST(cur.fetch_next().size() == 8u);
+	BOOST_TEST(cur.fetch_next().size() == 2u);
+	BOOST_TEST(cur.complete());
+	check_usable();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_FIXTURE_TEST_SUITE(test_statement_cache, fixture)
+
+BOOST_AUTO_TEST_CASE(eviction_closes_lazily)
+{
+	conn.set_statement_cache_capacity(1);
+	const auto& stats = server.stats();
+
+	conn.prepare_statement("SELECT a -- rows=1");
+	conn.prepare_statement("SELECT b -- rows=2"); // evicts a
+	BOOST_TEST(conn.get_statement_cache().evictions() == 1u);
+	BOOST_TEST(stats.statements_prepared == 2u);
+	BOOST_TEST(stats.statements_closed == 0u); // the Close waits for the next request
+
+	// The Close goes with this request, and its response is discarded
+	{
+		auto b = conn.prepare_statement("SELECT b -- rows=2");
+		BOOST_TEST(b.execute(no_params.begin(), no_params.end()).fetch_all().size() == 2u);
+		BOOST_TEST(stats.statements_closed == 1u);
+		BOOST_TEST(conn.get_statement_cache().hits() == 1u);
+	}
+
+	// Preparing a again is a miss, which evicts b, as it's no longer referenced
+	auto a = conn.prepare_statement("SELECT a -- rows=1");
+	BOOST_TEST(stats.statements_prepared == 3u);
+	BOOST_TEST(conn.get_statement_cache().evictions() == 2u);
+	BOOST_TEST(a.execute(no_params.begin(), no_params.end()).fetch_all().size() == 1u);
+	BOOST_TEST(stats.statements_closed == 2u);
+	check_usable();
+}
+
+BOOST_AUTO_TEST_CASE(evicted_before_a_failing_request)
+{
+	conn.set_statement_cache_capacity(1);
+	conn.prepare_statement("SELECT a");
+	conn.prepare_statement("SELECT b"); // evicts a
+
+	// The Close is processed before the failing Parse, and its response still discarded
+	conn.prepare_statement("SELECT fail", err, info);
+	BOOST_TEST(err == make_error_code(errc::server_error));
+	BOOST_TEST(server.stats().statements_closed == 1u);
+	check_usable();
+}
+
+BOOST_AUTO_TEST_CASE(disabled_with_referenced_statements)
+{
+	auto a = conn.prepare_statement("SELECT a -- rows=1");
+	conn.prepare_statement("SELECT b -- rows=1");
+	conn.set_statement_cache_capacity(0);
+
+	// b is evicted. a is still referenced, so it's left to its owner
+	BOOST_TEST(conn.get_statement_cache().size() == 0u);
+	BOOST_TEST(conn.get_statement_cache().evictions() == 1u);
+	BOOST_TEST(!a.cached());
+	a.close();
+	BOOST_TEST(server.stats().statements_closed == 2u);
+	check_usable();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_FIXTURE_TEST_SUITE(test_fake_backend, fixture)
+
+BOOST_AUTO_TEST_CASE(unknown_statement)
+{
+	// Executing a statement the server doesn't have fails, without desynchronizing the connection
+	conn.set_statement_cache_capacity(0); // statements are closed by the caller
+	auto stmt = conn.prepare_statement("SELECT -- rows=1");
+	prepared_statement<tcp::socket> copy = stmt;
+	stmt.close();
+	copy.execute(no_params.begin(), no_params.end(), err, info);
+	BOOST_TEST(err == make_error_code(errc::server_error));
+	BOOST_TEST(info.sqlstate() == "26000");
+	check_usable();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(test_scram)
+
+// RFC 7677, section 3: user "user", password "pencil"
+constexpr std::string_view rfc_client_nonce = "rOprNGfwEbeRWgbNEkqO";
+constexpr std::string_view rfc_server_first =
+	"r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF$k0,s=W22ZaJ0SNY7soEsUEjb6gQ==,i=4096";
+
+BOOST_AUTO_TEST_CASE(rfc7677_example)
+{
+	scram_client client;
+	std::string client_first, client_final;
+	client.start(rfc_client_nonce, "user", client_first);
+	BOOST_TEST(client_first == "n,,n=user,r=rOprNGfwEbeRWgbNEkqO");
+
+	error_code err = make_error_code(client.process_server_first(rfc_server_first, "user", "pencil", client_final, nullptr));
+	BOOST_TEST(!err);
+	BOOST_TEST(client_final ==
+		"c=biws,r=rOprNGfwEbeRWgbNEkqO%hvYDpWUa2RaTCAfuxFIlj)hNlF$k0,p=dHzbZapWIk4jUhN+Ute9ytag9zjfMHgsqmmiz7AndVQ=");
+
+	err = make_error_code(client.process_server_final("v=6rriTRBi23WpRR/wtup+mMhUZUn/dB5nLTJRsjl95G4="));
+	BOOST_TEST(!err);
+	BOOST_TEST(!client.in_progress());
+}
+
+BOOST_AUTO_TEST_CASE(wrong_server_signature)
+{
+	// A server that doesn't know the password can't produce the signature
+	for (std::string_view server_final: {
+		"v=7rriTRBi23WpRR/wtup+mMhUZUn/dB5nLTJRsjl95G4=", // different signature
+		"v=6rriTRBi23WpRR/wtup+mMhUZUn/dB5nLTJRsjl95G4",  // bad padding
+		"e=invalid-proof"
+	})
+	{
+		scram_client client;
+		std::string client_first, client_final;
+		client.start(rfc_client_nonce, "user", client_first);
+		client.process_server_first(rfc_server_first, "user", "pencil", client_final, nullptr);
+		error_code err = make_error_code(client.process_server_final(server_final));
+		BOOST_TEST(err == make_error_code(errc::server_verification_failed));
+		BOOST_TEST(client.in_progress());
+	}
+}
+
+BOOST_AUTO_TEST_CASE(base64_padding)
+{
+	std::string output;
+	BOOST_TEST(detail::base64_decode("cGVuY2ls", output));
+	BOOST_TEST(output == "pencil");
+	BOOST_TEST(detail::base64_decode("cGVuY2k=", output));
+	BOOST_TEST(output == "penci");
+	BOOST_TEST(detail::base64_decode("cGVuYw==", output));
+	BOOST_TEST(output == "penc");
+
+	for (std::string_view input: {
+		"cGVuY2k",      // missing padding
+		"cGVuYw=",      // incomplete padding
+		"cGVuY===",     // too much padding
+		"cGVu=2k=",     // padding before the end of a group
+		"cG==Y2ls",     // padding before the last group
+		"cGVuYw=a",     // data after padding
+	})
+	{
+		BOOST_TEST(!detail::base64_decode(input, output), input);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()